@@ -1,124 +1,1113 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <stdint.h>
 #include <time.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include <linux/if_link.h>
+#include <linux/if_ether.h>
 
 #include "common/af_common.h"
+#include "common/pkt_classify.h"
+#include "common/pcap_writer.h"
+#include "common/xsk_uring.h"
+#include "common/xsk_sched.h"
+#include "common/xdp_meta_kern_user.h"
 
-#define INTERFACE_QUEUE_INDEX 0
 #define ETH_FRAME_SIZE 1000
-#define XDP_FLAGS XDP_FLAGS_SKB_MODE
-#define XDP_BIND_FLAGS XDP_COPY
-#define RX_BATCH_SIZE 64
+#define DEFAULT_RX_BATCH_SIZE 64
+#define MAX_RX_BATCH_SIZE 1024
+#define NS_PER_S 1000000000ULL
+#define DEFAULT_REPORT_INTERVAL_S 1
+#define IP_PROTO_MAX 256
+#define SAMPLE_SNAPLEN 128
+#define SAMPLE_RING_SIZE 64
+#define DEFAULT_STEERING_PROGRAM "af_xdp_kern.o"
+/* Bounds how long an idle worker sleeps, so it notices the stop flag and
+ * rotates its capture file on time */
+#define POLL_TIMEOUT_MS 100
+
+static const char *const eth_class_names[PKT_CLASS_MAX] = {
+    [PKT_CLASS_IPV4] = "IPv4",
+    [PKT_CLASS_IPV6] = "IPv6",
+    [PKT_CLASS_ARP] = "ARP",
+    [PKT_CLASS_OTHER] = "other",
+};
+
+/* Written only by the owning worker and read by the reporter, so updates
+ * are plain relaxed stores rather than atomic read-modify-writes */
+struct rx_counters
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t vlan_tagged;
+    uint64_t samples_dropped;
+    uint64_t eth_class[PKT_CLASS_MAX];
+    uint64_t ip_proto[IP_PROTO_MAX];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct sample
+{
+    const char *interface_name;
+    unsigned int queue;
+    uint32_t len;
+    uint32_t caplen;
+    uint8_t data[SAMPLE_SNAPLEN];
+};
+
+/* Single-producer/single-consumer ring carrying sampled packets from a
+ * worker to the reporter, which does the slow hexdump formatting */
+struct sample_ring
+{
+    _Atomic uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct sample samples[SAMPLE_RING_SIZE];
+};
 
+struct rx_worker
+{
+    const char *interface_name;
+    unsigned int queue;
+    struct xsk_socket_info *xsk_socket;
+    unsigned int batch_size;
+    bool busy_poll;
+    /* Wait and kick through an io_uring instead of poll() */
+    bool use_uring;
+    /* Held around fill ring updates when the queue has several sockets */
+    pthread_spinlock_t *fill_lock;
+    uint32_t sample_every;
+    uint32_t sample_countdown;
+    /* Capture file stream, NULL unless capturing */
+    struct pcap_stream *capture;
+    struct rx_counters counters;
+    struct sample_ring samples;
+};
+
+/* One interface's UMEM and program, shared by its queues' sockets */
+struct rx_device
+{
+    const char *name;
+    unsigned int num_queues;
+    struct xsk_umem_info *umem;
+    struct xsk_steering *steering;
+    pthread_spinlock_t *fill_locks;
+};
+
+/* A thread runs a single worker's loop, or multiplexes several */
+struct rx_thread
+{
+    pthread_t thread;
+    unsigned int cpu;
+    unsigned int num_workers;
+    struct rx_worker **workers;
+};
+
+static _Atomic bool exiting;
+/* Set with exiting by a worker that can't serve its sockets any more, so
+ * the tool stops rather than reporting rates without them */
+static _Atomic bool failed;
+
+static void _usage(const char *const prog_name);
+static void _handle_signal(int signal);
+static void _fail(void);
+static bool _start_thread(struct rx_thread *const thread);
+static void *_rx_thread(void *arg);
+static void _rx_loop(struct rx_worker *const worker);
+static void _rx_loop_uring(struct rx_worker *const worker);
+static void _rx_loop_sched(struct rx_thread *const thread);
 static bool _init_fill_queue(struct xsk_socket_info *const xsk_socket);
-static void _handle_receive_packets(struct xsk_socket_info *const xsk_socket);
-static void _process_packet(const uint8_t* const pkt, const uint32_t len);
-static void _fill_fq(struct xsk_socket_info *const xsk_socket);
+static unsigned int _handle_receive_packets(struct rx_worker *const worker);
+static unsigned int _sched_receive(void *ctx, const unsigned int budget);
+static unsigned int _receive_packets(struct rx_worker *const worker, const unsigned int max);
+static void _process_batch(struct rx_worker *const worker, const struct pkt_batch *const batch,
+                           const uint64_t *const addrs, const uint32_t *const lens);
+static void _counter_add(uint64_t *const counter, const uint64_t value);
+static void _sample_packet(struct rx_worker *const worker, const uint8_t *const pkt, const uint32_t len);
+static void _capture_batch(struct rx_worker *const worker, const struct xsk_frag_chain *const chains,
+                           const unsigned int n);
+static void _refill(struct rx_worker *const worker);
+static void _report_loop(struct rx_worker *const workers, const unsigned int num_workers,
+                         const unsigned int interval_s, const unsigned int duration_s);
+static void _sum_counters(struct rx_worker *const workers, const unsigned int num_workers,
+                          struct rx_counters *const sum);
+static void _drain_samples(struct sample_ring *const ring);
+static void _print_summary(struct rx_worker *const workers, const unsigned int num_workers, const uint64_t start_ns);
+static uint64_t _now_ns(void);
+static uint64_t _clock_ns(const clockid_t clock);
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    unsigned int num_queues = 0;
+    unsigned int socks_per_queue = 1;
+    unsigned int num_threads = 0;
+    const char *steering_program = DEFAULT_STEERING_PROGRAM;
+    unsigned int interval_s = DEFAULT_REPORT_INTERVAL_S;
+    unsigned int duration_s = 0;
+    unsigned int batch_size = DEFAULT_RX_BATCH_SIZE;
+    bool busy_poll = false;
+    bool use_uring = false;
+    bool multi_buffer = false;
+    uint32_t xdp_flags = XDP_FLAGS_SKB_MODE;
+    uint16_t bind_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    uint32_t sample_every = 0;
+    uint32_t num_frames = NUM_FRAMES;
+    uint32_t frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE;
+    struct xsk_ring_config rings = default_ring_config(XSK_PROFILE_RX_ONLY);
+    struct pcap_config capture = {
+        .format = PCAP_FORMAT_PCAPNG,
+        .snaplen = PCAP_DEFAULT_SNAPLEN,
+        .buffer_size = PCAP_DEFAULT_BUFFER_SIZE,
+        .num_buffers = PCAP_DEFAULT_BUFFERS,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:s:R:F:i:d:S:t:P:M:ZjpB:T:C:w:W:L:G:Y:E:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval_s = atoi(optarg);
+            break;
+        case 'd':
+            sample_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            num_queues = atoi(optarg);
+            break;
+        case 'S':
+            socks_per_queue = atoi(optarg);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'M':
+            if (!parse_xdp_mode(optarg, &xdp_flags))
+                _usage(argv[0]);
+            break;
+        case 'Z':
+            bind_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+            break;
+        case 'j':
+            multi_buffer = true;
+            break;
+        case 'p':
+            busy_poll = true;
+            break;
+        case 'E':
+            if (strcmp(optarg, "uring") == 0)
+                use_uring = true;
+            else if (strcmp(optarg, "poll") != 0)
+                _usage(argv[0]);
+            break;
+        case 'B':
+            batch_size = atoi(optarg);
+            break;
+        case 'T':
+            duration_s = atoi(optarg);
+            break;
+        case 'C':
+            if (!pkt_classify_select(optarg))
+            {
+                fprintf(stderr, "Classifier \"%s\" isn't available on this CPU\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            steering_program = optarg;
+            break;
+        case 'w':
+            capture.prefix = optarg;
+            break;
+        case 'W':
+            if (!pcap_parse_format(optarg, &capture.format))
+                _usage(argv[0]);
+            break;
+        case 'L':
+            capture.snaplen = strtoul(optarg, NULL, 0);
+            break;
+        case 'G':
+            capture.rotate_seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'Y':
+            capture.rotate_bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'f':
+            num_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            frame_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            rings.rx_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            rings.fill_size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            _usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        _usage(argv[0]);
+
+    /* Every device gets its own UMEM and program, and by default one socket
+     * and worker per combined channel of its NIC */
+    const unsigned int num_devices = argc - optind;
+    struct rx_device *const devices = calloc(num_devices, sizeof(*devices));
+    if (!devices)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (socks_per_queue == 0)
+        socks_per_queue = 1;
+
+    unsigned int num_workers = 0;
+    for (unsigned int d = 0; d < num_devices; d++)
+    {
+        devices[d].name = argv[optind + d];
+        devices[d].num_queues = num_queues ? num_queues : get_queue_count(devices[d].name);
+        num_workers += devices[d].num_queues * socks_per_queue;
+    }
+
+    /* A fill ring the queue's frames can't fill when idle, the sockets'
+     * frame caches full, keeps a scheduled socket from ever going idle */
+    if ((uint64_t)rings.fill_size + (uint64_t)socks_per_queue * FRAME_CACHE_SIZE > num_frames)
+    {
+        fprintf(stderr, "Fill ring size (%u) can't exceed the frames per queue (%u) less %u per socket cached\n",
+                rings.fill_size, num_frames, FRAME_CACHE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    if (batch_size == 0 || batch_size > MAX_RX_BATCH_SIZE)
+    {
+        fprintf(stderr, "Batch size must be between 1 and %u\n", MAX_RX_BATCH_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    /* A jumbo frame must fit in one peeked batch to be read at all */
+    if (multi_buffer)
+    {
+        if (batch_size < XSK_MAX_FRAGS)
+        {
+            fprintf(stderr, "Multi-buffer receive needs a batch size of at least %u\n", XSK_MAX_FRAGS);
+            exit(EXIT_FAILURE);
+        }
+        bind_flags |= XDP_USE_SG;
+    }
+
+    if (num_threads == 0 || num_threads > num_workers)
+        num_threads = num_workers;
+
+    /* A busy polling socket never raises the readiness event the shared
+     * threads wait for */
+    if (busy_poll && num_threads < num_workers)
     {
-        fprintf(stderr, "Provide device name\n");
+        fprintf(stderr, "Busy polling needs a thread per socket, drop -t or -p\n");
         exit(EXIT_FAILURE);
     }
 
-    struct xsk_socket_info *const xsk_socket = create_socket(argv[1], INTERFACE_QUEUE_INDEX, XDP_FLAGS, XDP_BIND_FLAGS);
-    if (!xsk_socket)
+    if (use_uring)
+    {
+        struct xsk_uring probe;
+        const int err = xsk_uring_init(&probe, XSK_URING_ENTRIES);
+
+        if (err)
+        {
+            fprintf(stderr, "io_uring isn't usable (%s), falling back to poll\n", strerror(-err));
+            use_uring = false;
+        }
+        else
+        {
+            xsk_uring_destroy(&probe);
+        }
+    }
+
+    if (capture.prefix && capture.snaplen == 0)
     {
+        fprintf(stderr, "Snaplen must be at least 1\n");
         exit(EXIT_FAILURE);
     }
 
-    if (!_init_fill_queue(xsk_socket))
+    struct rx_worker *const workers = aligned_alloc(CACHE_LINE_SIZE, num_workers * sizeof(*workers));
+    if (!workers)
     {
         exit(EXIT_FAILURE);
     }
+    memset(workers, 0, num_workers * sizeof(*workers));
+
+    /* One capture stream and file series per worker, numbered like the
+     * workers: device by device, queue * sockets_per_queue + slot */
+    struct pcap_writer *capture_writer = NULL;
+    if (capture.prefix)
+    {
+        capture_writer = pcap_writer_start(&capture, num_workers);
+        if (!capture_writer)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    struct pollfd fds[2];
+    unsigned int first_worker = 0;
+    for (unsigned int d = 0; d < num_devices; d++)
+    {
+        struct rx_device *const device = &devices[d];
+
+        device->umem = create_umem(device->name, device->num_queues * num_frames, frame_size, &rings);
+        if (!device->umem)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        /* Several sockets per queue need af_xdp_kern.o to pick one by flow
+         * hash, libxdp's default program only knows one socket per queue.
+         * Capturing uses it for the receive timestamps it puts in front of
+         * each packet, or takes the time in userspace when it can't load. */
+        if (socks_per_queue > 1)
+        {
+            device->steering = load_steering_program(device->name, steering_program, xdp_flags, socks_per_queue,
+                                                     multi_buffer);
+            device->fill_locks = calloc(device->num_queues, sizeof(*device->fill_locks));
+            if (!device->steering || !device->fill_locks)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (capture.prefix)
+        {
+            device->steering = load_steering_program(device->name, steering_program, xdp_flags, socks_per_queue,
+                                                     multi_buffer);
+            if (!device->steering)
+                fprintf(stderr, "Capturing on %s with userspace timestamps\n", device->name);
+        }
+
+        for (unsigned int queue = 0; queue < device->num_queues; queue++)
+        {
+            const unsigned int queue_first = first_worker + queue * socks_per_queue;
+            struct rx_worker *const queue_workers = &workers[queue_first];
+
+            if (device->fill_locks)
+                pthread_spin_init(&device->fill_locks[queue], PTHREAD_PROCESS_PRIVATE);
+
+            for (unsigned int slot = 0; slot < socks_per_queue; slot++)
+            {
+                struct rx_worker *const worker = &queue_workers[slot];
+
+                worker->interface_name = device->name;
+                worker->queue = queue;
+                worker->sample_every = sample_every;
+                worker->sample_countdown = sample_every;
+                worker->batch_size = batch_size;
+                worker->busy_poll = busy_poll;
+                worker->use_uring = use_uring;
+                if (capture_writer)
+                    worker->capture = &capture_writer->streams[queue_first + slot];
+
+                if (device->steering)
+                {
+                    if (device->fill_locks)
+                        worker->fill_lock = &device->fill_locks[queue];
+                    worker->xsk_socket = create_steered_socket(device->steering, device->name, queue, slot,
+                                                               bind_flags,
+                                                               slot == 0 ? device->umem
+                                                                         : queue_workers[0].xsk_socket->umem,
+                                                               &rings);
+                }
+                else
+                {
+                    worker->xsk_socket = create_shared_socket(device->name, queue, xdp_flags, bind_flags,
+                                                              device->umem, &rings);
+                }
+
+                if (!worker->xsk_socket)
+                {
+                    exit(EXIT_FAILURE);
+                }
+
+                if (busy_poll && xsk_enable_busy_poll(xsk_socket__fd(worker->xsk_socket->xsk), batch_size))
+                {
+                    fprintf(stderr, "Failed to enable busy polling on %s queue %u: %s\n", device->name, queue,
+                            strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            /* The queue's sockets share its fill ring, filling it once is enough */
+            if (!_init_fill_queue(queue_workers[0].xsk_socket))
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        printf("Receiving on %u queue(s) of %s with %u socket(s) each\n", device->num_queues, device->name,
+               socks_per_queue);
+        first_worker += device->num_queues * socks_per_queue;
+    }
+
+    /* Deal the sockets out round-robin, so a thread serving several gets
+     * different queues rather than all of one queue's sockets */
+    struct rx_thread *const threads = calloc(num_threads, sizeof(*threads));
+    struct rx_worker **const thread_workers = calloc(num_workers, sizeof(*thread_workers));
+    if (!threads || !thread_workers)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int t = 0, next = 0; t < num_threads; t++)
+    {
+        threads[t].cpu = t;
+        threads[t].workers = &thread_workers[next];
+        for (unsigned int w = t; w < num_workers; w += num_threads)
+            threads[t].workers[threads[t].num_workers++] = &workers[w];
+        next += threads[t].num_workers;
+    }
+
+    if (num_threads < num_workers)
+        printf("Serving %u socket(s) from %u thread(s)\n", num_workers, num_threads);
+
+    /* Threads start with the signals blocked so they all land on the main
+     * thread and cut its sleep short */
+    struct sigaction action = {.sa_handler = _handle_signal};
+    sigset_t signals, previous_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous_signals);
+
+    const uint64_t start_ns = _now_ns();
+    for (unsigned int t = 0; t < num_threads; t++)
+    {
+        if (!_start_thread(&threads[t]))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+
+    _report_loop(workers, num_workers, interval_s ? interval_s : DEFAULT_REPORT_INTERVAL_S, duration_s);
+
+    atomic_store(&exiting, true);
+    for (unsigned int t = 0; t < num_threads; t++)
+        pthread_join(threads[t].thread, NULL);
+
+    _print_summary(workers, num_workers, start_ns);
+
+    /* The workers are gone, so their streams can be closed from here */
+    if (capture_writer)
+    {
+        for (unsigned int w = 0; w < num_workers; w++)
+            pcap_stream_close(workers[w].capture);
+        pcap_writer_stop(capture_writer);
+    }
+
+    return atomic_load(&failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void _usage(const char *const prog_name)
+{
+    fprintf(stderr, "Usage: %s [-n num_queues] [-f frames_per_queue] [-s frame_size] [-R rx_ring_size] "
+            "[-F fill_ring_size] [-i report_interval_s] [-d hexdump_1_in_n] [-S sockets_per_queue] "
+            "[-t num_threads] [-P steering_program] [-M skb|native] [-Z (zero-copy)] [-j (multi-buffer)] "
+            "[-p (busy poll)] [-B rx_batch_size] [-T duration_s] [-C auto|avx2|sse2|scalar (classifier)] "
+            "[-w capture_prefix] [-W pcap|pcapng] [-L snaplen] [-G rotate_s] [-Y rotate_mb] "
+            "[-E poll|uring (event loop)] <device> [device...]\n", prog_name);
+    exit(EXIT_FAILURE);
+}
+
+static void _handle_signal(int signal)
+{
+    (void)signal;
+    atomic_store(&exiting, true);
+}
+
+static void _fail(void)
+{
+    atomic_store(&failed, true);
+    atomic_store(&exiting, true);
+}
+
+static bool _start_thread(struct rx_thread *const thread)
+{
+    pthread_attr_t attr;
+    cpu_set_t cpu_set;
+
+    /* Pin thread N to core N. With a thread per socket that puts queue N
+     * next to its IRQ when the NIC's interrupt affinity follows the default
+     * queue-to-core layout, and several sockets per queue take consecutive
+     * cores. */
+    CPU_ZERO(&cpu_set);
+    CPU_SET(thread->cpu % sysconf(_SC_NPROCESSORS_ONLN), &cpu_set);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+    const int ret = pthread_create(&thread->thread, &attr, _rx_thread, thread);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "Failed to start worker thread %u: %s\n", thread->cpu, strerror(ret));
+        return false;
+    }
+
+    return true;
+}
+
+static void *_rx_thread(void *arg)
+{
+    struct rx_thread *const thread = arg;
+    struct rx_worker *const worker = thread->workers[0];
+
+    if (thread->num_workers > 1)
+        _rx_loop_sched(thread);
+    else if (worker->use_uring)
+        _rx_loop_uring(worker);
+    else
+        _rx_loop(worker);
+
+    return NULL;
+}
+
+static void _rx_loop(struct rx_worker *const worker)
+{
+    struct pollfd fds[1];
     int ret, nfds = 1;
 
     memset(fds, 0, sizeof(fds));
-    fds[0].fd = xsk_socket__fd(xsk_socket->xsk);
+    fds[0].fd = xsk_socket__fd(worker->xsk_socket->xsk);
     fds[0].events = POLLIN;
 
-    while (true)
+    /* Only sleep in poll() once the RX ring is drained. With need_wakeup
+     * set this is also what restarts a driver waiting for fill frames.
+     * Busy polling never sleeps, the recvfrom() runs the driver instead. */
+    while (!atomic_load_explicit(&exiting, memory_order_relaxed))
     {
-        ret = poll(fds, nfds, -1);
-        if (ret <= 0 || ret > 1)
+        if (_handle_receive_packets(worker) > 0)
             continue;
-        _handle_receive_packets(xsk_socket);
+
+        if (worker->capture)
+            pcap_stream_tick(worker->capture, _clock_ns(CLOCK_REALTIME));
+
+        if (worker->busy_poll)
+        {
+            recvfrom(fds[0].fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+            continue;
+        }
+
+        ret = poll(fds, nfds, POLL_TIMEOUT_MS);
+        if (ret < 0 && errno != EINTR)
+        {
+            perror("poll failed");
+            _fail();
+            break;
+        }
     }
 }
 
-static bool _init_fill_queue(struct xsk_socket_info *const xsk_socket)
+/* The same loop on an io_uring: the socket's poll is armed once, and a
+ * sleep is one io_uring_enter() that also submits the fill ring kick the
+ * driver may be waiting for. Busy polling kicks on every pass instead. */
+static void _rx_loop_uring(struct rx_worker *const worker)
 {
-    uint32_t idx;
-    const int ret = xsk_ring_prod__reserve(&xsk_socket->umem->fq, XSK_RING_PROD__DEFAULT_NUM_DESCS, &idx);
+    const int fd = xsk_socket__fd(worker->xsk_socket->xsk);
+    struct xsk_uring ring;
+    uint32_t token;
 
-    if (ret != XSK_RING_PROD__DEFAULT_NUM_DESCS)
+    int ret = xsk_uring_init(&ring, XSK_URING_ENTRIES);
+    if (ret)
     {
-        perror("Failed to allocate fill queue descriptors");
-        return false;
+        fprintf(stderr, "Failed to set up io_uring for queue %u, falling back to poll: %s\n", worker->queue,
+                strerror(-ret));
+        _rx_loop(worker);
+        return;
+    }
+
+    if (!xsk_uring_add_socket(&ring, fd, 0))
+    {
+        fprintf(stderr, "Failed to poll queue %u through io_uring, falling back to poll\n", worker->queue);
+        xsk_uring_destroy(&ring);
+        _rx_loop(worker);
+        return;
+    }
+
+    while (!atomic_load_explicit(&exiting, memory_order_relaxed))
+    {
+        if (_handle_receive_packets(worker) > 0)
+            continue;
+
+        if (worker->capture)
+            pcap_stream_tick(worker->capture, _clock_ns(CLOCK_REALTIME));
+
+        if (worker->busy_poll || xsk_ring_prod__needs_wakeup(&worker->xsk_socket->umem->fq))
+            xsk_uring_kick_rx(&ring, fd);
+
+        ret = xsk_uring_wait(&ring, &token, 1, worker->busy_poll ? 0 : POLL_TIMEOUT_MS);
+        if (ret < 0)
+        {
+            fprintf(stderr, "io_uring wait failed for queue %u, falling back to poll: %s\n", worker->queue,
+                    strerror(-ret));
+            xsk_uring_destroy(&ring);
+            _rx_loop(worker);
+            return;
+        }
+    }
+
+    xsk_uring_destroy(&ring);
+}
+
+/* Several sockets, on any queues and devices, on one thread. The
+ * scheduler gives each ready socket one batch per round and does the
+ * refills and wakeup kicks, through the io_uring with -E uring, and the
+ * thread sleeps only once all of its sockets are idle. */
+static void _rx_loop_sched(struct rx_thread *const thread)
+{
+    struct rx_worker *const first = thread->workers[0];
+    struct xsk_sched sched;
+
+    int ret = xsk_sched_init(&sched, thread->num_workers, first->batch_size, _sched_receive, first->use_uring);
+    if (ret)
+    {
+        fprintf(stderr, "Failed to set up the scheduler for thread %u: %s\n", thread->cpu, strerror(-ret));
+        _fail();
+        return;
     }
 
-    for (int i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS; i++)
-        *xsk_ring_prod__fill_addr(&xsk_socket->umem->fq, idx++) = xsk_alloc_umem_frame(xsk_socket);
+    for (unsigned int w = 0; w < thread->num_workers; w++)
+    {
+        struct rx_worker *const worker = thread->workers[w];
+
+        ret = xsk_sched_add(&sched, worker->xsk_socket, worker, worker->fill_lock);
+        if (ret)
+        {
+            fprintf(stderr, "Failed to schedule %s queue %u: %s\n", worker->interface_name, worker->queue,
+                    strerror(-ret));
+            xsk_sched_destroy(&sched);
+            _fail();
+            return;
+        }
+    }
 
-    xsk_ring_prod__submit(&xsk_socket->umem->fq, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    while (!atomic_load_explicit(&exiting, memory_order_relaxed))
+    {
+        ret = xsk_sched_run(&sched, POLL_TIMEOUT_MS);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Socket scheduler failed: %s\n", strerror(-ret));
+            _fail();
+            break;
+        }
+
+        if (ret > 0 || !first->capture)
+            continue;
+
+        const uint64_t now = _clock_ns(CLOCK_REALTIME);
+        for (unsigned int w = 0; w < thread->num_workers; w++)
+            pcap_stream_tick(thread->workers[w]->capture, now);
+    }
+
+    xsk_sched_destroy(&sched);
+}
+
+static bool _init_fill_queue(struct xsk_socket_info *const xsk_socket)
+{
+    if (xsk_fill_fq(xsk_socket) == 0)
+    {
+        fprintf(stderr, "Failed to allocate fill queue descriptors\n");
+        return false;
+    }
 
     return true;
 }
 
-static void _handle_receive_packets(struct xsk_socket_info *const xsk_socket)
+static unsigned int _handle_receive_packets(struct rx_worker *const worker)
+{
+    const unsigned int rcvd = _receive_packets(worker, worker->batch_size);
+
+    if (rcvd)
+        _refill(worker);
+    return rcvd;
+}
+
+/* The scheduler refills the fill ring itself */
+static unsigned int _sched_receive(void *ctx, const unsigned int budget)
 {
+    return _receive_packets(ctx, budget);
+}
+
+/* Returns the descriptors consumed. Packets are classified by their first
+ * buffer, which holds the headers of a multi-buffer one. */
+static unsigned int _receive_packets(struct rx_worker *const worker, const unsigned int max)
+{
+    struct xsk_socket_info *const xsk_socket = worker->xsk_socket;
     uint32_t idx_rx = 0;
+    uint64_t bytes = 0;
+    unsigned int packets = 0;
+    unsigned int done = 0;
 
-    const unsigned int rcvd = xsk_ring_cons__peek(&xsk_socket->rx, RX_BATCH_SIZE, &idx_rx);
+    const unsigned int rcvd = xsk_ring_cons__peek(&xsk_socket->rx, max, &idx_rx);
     if (!rcvd)
+        return 0;
+
+    while (done < rcvd)
+    {
+        struct xsk_frag_chain chains[PKT_CLASSIFY_MAX_BATCH];
+        uint64_t addrs[PKT_CLASSIFY_MAX_BATCH];
+        uint32_t lens[PKT_CLASSIFY_MAX_BATCH];
+        uint64_t frames[PKT_CLASSIFY_MAX_BATCH];
+        struct pkt_batch batch;
+        unsigned int n = 0, num_frames = 0;
+
+        while (n < PKT_CLASSIFY_MAX_BATCH && done < rcvd)
+        {
+            struct xsk_frag_chain *const chain = &chains[n];
+            const uint32_t used = xsk_rx_frag_chain(&xsk_socket->rx, idx_rx + done, rcvd - done, chain);
+
+            if (used == 0 || num_frames + used > PKT_CLASSIFY_MAX_BATCH)
+                break;
+
+            for (uint32_t f = 0; f < used; f++)
+                frames[num_frames + f] = xsk_frag_chain_desc(&xsk_socket->rx, chain, f)->addr;
+
+            addrs[n] = frames[num_frames];
+            lens[n] = xsk_frag_chain_desc(&xsk_socket->rx, chain, 0)->len;
+            bytes += chain->len;
+            num_frames += used;
+            done += used;
+            n++;
+        }
+
+        if (n == 0)
+            break;
+
+        pkt_classify_batch(xsk_socket->umem->buffer, addrs, lens, n, &batch);
+        _process_batch(worker, &batch, addrs, lens);
+        if (worker->capture)
+            _capture_batch(worker, chains, n);
+        xsk_free_umem_frames(xsk_socket, frames, num_frames);
+        packets += n;
+    }
+
+    /* A packet cut off by the end of the peeked batch is read whole on the
+     * next call */
+    if (done < rcvd)
+        xsk_ring_cons__cancel(&xsk_socket->rx, rcvd - done);
+    if (!done)
+        return 0;
+
+    xsk_ring_cons__release(&xsk_socket->rx, done);
+    _counter_add(&worker->counters.packets, packets);
+    _counter_add(&worker->counters.bytes, bytes);
+    return done;
+}
+
+/* One counter update per class rather than per packet, then a pass over
+ * just the IP packets' protocol column */
+static void _process_batch(struct rx_worker *const worker, const struct pkt_batch *const batch,
+                           const uint64_t *const addrs, const uint32_t *const lens)
+{
+    struct rx_counters *const counters = &worker->counters;
+    const enum pkt_class ip_classes[] = {PKT_CLASS_IPV4, PKT_CLASS_IPV6};
+    unsigned int vlan_tagged = 0;
+
+    for (int cls = 0; cls < PKT_CLASS_MAX; cls++)
+    {
+        if (batch->class_count[cls])
+            _counter_add(&counters->eth_class[cls], batch->class_count[cls]);
+    }
+
+    for (unsigned int i = 0; i < batch->count; i++)
+        vlan_tagged += batch->flags[i] & PKT_F_VLAN;
+    if (vlan_tagged)
+        _counter_add(&counters->vlan_tagged, vlan_tagged);
+
+    for (unsigned int c = 0; c < sizeof(ip_classes) / sizeof(ip_classes[0]); c++)
+    {
+        const enum pkt_class cls = ip_classes[c];
+
+        for (unsigned int j = 0; j < batch->class_count[cls]; j++)
+        {
+            const unsigned int i = batch->class_index[cls][j];
+            _counter_add(&counters->ip_proto[batch->l4_proto[i]], (batch->flags[i] & PKT_F_L4) != 0);
+        }
+    }
+
+    if (!worker->sample_every)
         return;
 
-    for (unsigned int i = 0; i < rcvd; i++)
+    for (unsigned int i = 0; i < batch->count; i++)
     {
-        const struct xdp_desc *const xdp_desc = xsk_ring_cons__rx_desc(&xsk_socket->rx, idx_rx++);
-        const uint64_t addr = xdp_desc->addr;
-        const uint32_t len = xdp_desc->len;
+        if (--worker->sample_countdown == 0)
+        {
+            worker->sample_countdown = worker->sample_every;
+            _sample_packet(worker, xsk_umem__get_data(worker->xsk_socket->umem->buffer, addrs[i]), lens[i]);
+        }
+    }
+}
 
-        _process_packet(xsk_umem__get_data(xsk_socket->umem->buffer, addr), len);
-        xsk_free_umem_frame(xsk_socket, addr);
+/* Stamps each packet with the receive time the XDP program put in its
+ * metadata, converted to CLOCK_REALTIME, or the time the batch was read
+ * when there is none. The metadata is invalidated after reading so a
+ * reused frame isn't stamped with a stale time. */
+static void _capture_batch(struct rx_worker *const worker, const struct xsk_frag_chain *const chains,
+                           const unsigned int n)
+{
+    struct xsk_ring_cons *const rx = &worker->xsk_socket->rx;
+    void *const umem_area = worker->xsk_socket->umem->buffer;
+    const uint64_t realtime = _clock_ns(CLOCK_REALTIME);
+    const uint64_t mono_offset = realtime - _clock_ns(CLOCK_MONOTONIC);
+    uint64_t tai_offset = 0;
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        const struct xdp_desc *const head = xsk_frag_chain_desc(rx, &chains[i], 0);
+        uint8_t *const pkt = xsk_umem__get_data(umem_area, head->addr);
+        struct xdp_rx_meta *const meta = (struct xdp_rx_meta *)pkt - 1;
+        uint64_t timestamp = realtime;
+
+        if (meta->magic == XDP_RX_META_MAGIC)
+        {
+            meta->magic = 0;
+
+            if (meta->flags & XDP_RX_META_HW_TIMESTAMP)
+            {
+                if (!tai_offset)
+                    tai_offset = _clock_ns(CLOCK_TAI) - realtime;
+                timestamp = meta->timestamp - tai_offset;
+            }
+            else
+            {
+                timestamp = meta->timestamp + mono_offset;
+            }
+        }
+
+        if (chains[i].num_frags == 1)
+        {
+            pcap_stream_write(worker->capture, pkt, head->len, timestamp);
+            continue;
+        }
+
+        /* Jumbo frames are gathered from their fragments by the writer */
+        struct iovec iov[XSK_MAX_FRAGS];
+        for (uint32_t f = 0; f < chains[i].num_frags; f++)
+        {
+            const struct xdp_desc *const desc = xsk_frag_chain_desc(rx, &chains[i], f);
+
+            iov[f].iov_base = xsk_umem__get_data(umem_area, desc->addr);
+            iov[f].iov_len = desc->len;
+        }
+        pcap_stream_writev(worker->capture, iov, chains[i].num_frags, timestamp);
     }
+}
 
-    xsk_ring_cons__release(&xsk_socket->rx, rcvd);
+static void _refill(struct rx_worker *const worker)
+{
+    if (!worker->fill_lock)
+    {
+        xsk_fill_fq(worker->xsk_socket);
+        return;
+    }
 
-    _fill_fq(xsk_socket);
+    pthread_spin_lock(worker->fill_lock);
+    xsk_fill_fq(worker->xsk_socket);
+    pthread_spin_unlock(worker->fill_lock);
 }
 
-static void _process_packet(const uint8_t* const pkt, const uint32_t len)
+static void _counter_add(uint64_t *const counter, const uint64_t value)
 {
-    const uint16_t eth_type = (pkt[12] << 8) + pkt[13];
-    printf("eth type %x\n", eth_type);
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
 }
 
-static void _fill_fq(struct xsk_socket_info *const xsk_socket)
+/* Copies the start of the packet into the sample ring, or drops the sample
+ * when the reporter hasn't caught up. The worker never waits on it. */
+static void _sample_packet(struct rx_worker *const worker, const uint8_t *const pkt, const uint32_t len)
 {
-    const unsigned int stock_frames = xsk_prod_nb_free(&xsk_socket->umem->fq, xsk_umem_free_frames(xsk_socket));
+    struct sample_ring *const ring = &worker->samples;
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
 
-    if (stock_frames > 0)
+    if (head - tail == SAMPLE_RING_SIZE)
     {
-        uint32_t idx_fq = 0;
-        unsigned int ret = xsk_ring_prod__reserve(&xsk_socket->umem->fq, stock_frames, &idx_fq);
+        _counter_add(&worker->counters.samples_dropped, 1);
+        return;
+    }
+
+    struct sample *const sample = &ring->samples[head % SAMPLE_RING_SIZE];
+    sample->interface_name = worker->interface_name;
+    sample->queue = worker->queue;
+    sample->len = len;
+    sample->caplen = len < SAMPLE_SNAPLEN ? len : SAMPLE_SNAPLEN;
+    memcpy(sample->data, pkt, sample->caplen);
 
-        while (ret != stock_frames)
-            ret = xsk_ring_prod__reserve(&xsk_socket->umem->fq, stock_frames, &idx_fq);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
 
-        for (unsigned int i = 0; i < stock_frames; i++)
-            *xsk_ring_prod__fill_addr(&xsk_socket->umem->fq, idx_fq++) = xsk_alloc_umem_frame(xsk_socket);
+/* Runs on the main thread: sums the workers' counters every interval and
+ * prints the rates, then formats whatever samples the workers queued */
+static void _report_loop(struct rx_worker *const workers, const unsigned int num_workers,
+                         const unsigned int interval_s, const unsigned int duration_s)
+{
+    static struct rx_counters previous;
+    static struct rx_counters current;
 
-        xsk_ring_prod__submit(&xsk_socket->umem->fq, stock_frames);
+    static uint64_t previous_captured;
+    static uint64_t previous_capture_dropped;
+
+    for (unsigned int elapsed_s = 0; duration_s == 0 || elapsed_s < duration_s; elapsed_s += interval_s)
+    {
+        sleep(interval_s);
+        if (atomic_load(&exiting))
+            break;
+
+        _sum_counters(workers, num_workers, &current);
+
+        printf("RX: %.0f pps %.1f Mbit/s (vlan %lu, samples dropped %lu)\n",
+               (double)(current.packets - previous.packets) / interval_s,
+               (double)(current.bytes - previous.bytes) * 8 / interval_s / 1000000,
+               current.vlan_tagged - previous.vlan_tagged,
+               current.samples_dropped - previous.samples_dropped);
+
+        for (int i = 0; i < PKT_CLASS_MAX; i++)
+        {
+            const uint64_t delta = current.eth_class[i] - previous.eth_class[i];
+            if (delta)
+                printf("  %-8s %12.0f pps\n", eth_class_names[i], (double)delta / interval_s);
+        }
+
+        for (int i = 0; i < IP_PROTO_MAX; i++)
+        {
+            const uint64_t delta = current.ip_proto[i] - previous.ip_proto[i];
+            if (delta)
+                printf("  proto %-3d%12.0f pps\n", i, (double)delta / interval_s);
+        }
+
+        previous = current;
+
+        if (workers[0].capture)
+        {
+            uint64_t captured = 0, capture_dropped = 0;
+
+            for (unsigned int w = 0; w < num_workers; w++)
+            {
+                captured += __atomic_load_n(&workers[w].capture->packets, __ATOMIC_RELAXED);
+                capture_dropped += __atomic_load_n(&workers[w].capture->dropped, __ATOMIC_RELAXED);
+            }
+
+            printf("  captured %lu, capture dropped %lu\n", captured - previous_captured,
+                   capture_dropped - previous_capture_dropped);
+            previous_captured = captured;
+            previous_capture_dropped = capture_dropped;
+        }
+
+        for (unsigned int w = 0; w < num_workers; w++)
+            _drain_samples(&workers[w].samples);
+
+        fflush(stdout);
     }
-}
\ No newline at end of file
+}
+
+static void _drain_samples(struct sample_ring *const ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; tail != head; tail++)
+    {
+        const struct sample *const sample = &ring->samples[tail % SAMPLE_RING_SIZE];
+
+        printf("%s queue %u sample, %u bytes:\n", sample->interface_name, sample->queue, sample->len);
+        for (uint32_t offset = 0; offset < sample->caplen; offset += 16)
+        {
+            printf("  %04x ", offset);
+            for (uint32_t i = offset; i < offset + 16; i++)
+            {
+                if (i < sample->caplen)
+                    printf(" %02x", sample->data[i]);
+                else
+                    printf("   ");
+            }
+            printf("  ");
+            for (uint32_t i = offset; i < offset + 16 && i < sample->caplen; i++)
+                putchar(isprint(sample->data[i]) ? sample->data[i] : '.');
+            putchar('\n');
+        }
+
+        /* Release each slot once formatted so the worker can reuse it */
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+}
+
+static void _sum_counters(struct rx_worker *const workers, const unsigned int num_workers,
+                          struct rx_counters *const sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    for (unsigned int w = 0; w < num_workers; w++)
+    {
+        const uint64_t *const src = (const uint64_t *)&workers[w].counters;
+        uint64_t *const dst = (uint64_t *)sum;
+
+        for (size_t i = 0; i < sizeof(*sum) / sizeof(uint64_t); i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* One machine readable line for the benchmark driver, totals since start */
+static void _print_summary(struct rx_worker *const workers, const unsigned int num_workers, const uint64_t start_ns)
+{
+    static struct rx_counters total;
+    struct xdp_statistics kernel = {0};
+    struct rusage usage;
+
+    _sum_counters(workers, num_workers, &total);
+    const double seconds = (double)(_now_ns() - start_ns) / NS_PER_S;
+
+    for (unsigned int w = 0; w < num_workers; w++)
+    {
+        struct xdp_statistics socket_stats;
+
+        if (xsk_get_kernel_stats(workers[w].xsk_socket, &socket_stats))
+            continue;
+
+        kernel.rx_dropped += socket_stats.rx_dropped;
+        kernel.rx_invalid_descs += socket_stats.rx_invalid_descs;
+        kernel.rx_ring_full += socket_stats.rx_ring_full;
+        kernel.rx_fill_ring_empty_descs += socket_stats.rx_fill_ring_empty_descs;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    const double cpu_ns = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+                          (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+
+    printf("SUMMARY rx_packets=%lu rx_bytes=%lu seconds=%.3f pps=%.0f mbps=%.1f cpu_ns_per_packet=%.1f "
+           "rx_dropped=%llu rx_ring_full=%llu fill_ring_empty=%llu rx_invalid=%llu\n",
+           total.packets, total.bytes, seconds, total.packets / seconds, total.bytes * 8 / seconds / 1000000,
+           total.packets ? cpu_ns / total.packets : 0,
+           kernel.rx_dropped, kernel.rx_ring_full, kernel.rx_fill_ring_empty_descs, kernel.rx_invalid_descs);
+    fflush(stdout);
+}
+
+static uint64_t _now_ns(void)
+{
+    return _clock_ns(CLOCK_MONOTONIC);
+}
+
+static uint64_t _clock_ns(const clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
@@ -1,93 +1,1294 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <stdint.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
 
+#include <arpa/inet.h>
 #include <linux/if_link.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
 
 #include "common/af_common.h"
+#include "common/checksum.h"
+#include "common/pcap_reader.h"
+#include "common/xsk_encap.h"
 
 #define INTERFACE_QUEUE_INDEX 0
 #define ETH_FRAME_SIZE 1000
-#define XDP_FLAGS XDP_FLAGS_SKB_MODE
-#define XDP_BIND_FLAGS XDP_COPY
-#define PERIOD_NS 1000000
+#define DEFAULT_SRC_ADDR "10.0.0.1"
+#define DEFAULT_DST_ADDR "10.0.0.2"
+#define DEFAULT_SRC_PORT 49152
+/* discard */
+#define DEFAULT_DST_PORT 9
+#define IP_DF 0x4000
+#define DEFAULT_TTL 64
 #define NS_PER_S 1000000000
-#define BATCH_SIZE 1
+#define DEFAULT_RATE_PPS 1000
+#define DEFAULT_BURST_SIZE 1
+/* Deadlines closer than this are busy-waited, farther ones sleep until then */
+#define SPIN_NS 50000
+#define REPORT_PERIOD_NS NS_PER_S
+/* How long the refill thread sleeps while the TX thread catches up */
+#define REFILL_IDLE_NS 20000
 
+/* The generated UDP flow. Both addresses are of family, IPv4 ones in the
+ * first four bytes. */
+struct tx_flow
+{
+    int family;
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+    uint16_t sport;
+    uint16_t dport;
+    /* UDP header offset in the frame, the payload starts with the per-packet
+     * sequence number, the only field rewritten on every send */
+    uint32_t l4_offset;
+};
+
+/* A trace packet in a UMEM frame, due offset_ns after the replay started
+ * when played at its original speed. With multi-buffer a packet bigger
+ * than a frame is copied into a chain of them, frags pointing at the
+ * addresses of those after the first. */
+struct replay_packet
+{
+    uint64_t addr;
+    uint32_t len;
+    uint32_t num_frags;
+    uint64_t offset_ns;
+    const uint64_t *frags;
+};
+
+/* Replays a capture file. A trace that fits in UMEM is loaded into frames,
+ * or packed into slab buffers with -U, once and those are sent over and
+ * over, never copied again or freed. A bigger one is streamed: the refill thread copies packets from
+ * the mapped file into free frames and queues them on an SPSC ring, and the
+ * TX thread frees frames as their sends complete. */
+struct replay
+{
+    struct pcap_reader *reader;
+    /* Multiplier of the original rate, 0 to send as fast as possible */
+    double speed;
+    /* Times through the trace, 0 forever */
+    unsigned int loops;
+    uint32_t frame_size;
+    /* Longest packet sent, a frame or a chain of the most frames allowed */
+    uint32_t max_len;
+    uint64_t first_ns;
+    /* Offset added per pass through the trace: its length plus one mean
+     * packet gap, so the last packet and the next pass's first don't
+     * go out together */
+    uint64_t loop_ns;
+    uint64_t skipped;
+
+    bool preloaded;
+    /* Pass through the trace being sent, or streamed, being queued */
+    unsigned int loop;
+    /* Preloaded: the whole trace, with the TX thread's position in it */
+    struct replay_packet *packets;
+    uint32_t count;
+    uint32_t next;
+    /* UMEM frames the whole trace takes */
+    uint64_t num_frames;
+    /* XSK_MAX_FRAGS - 1 chain addresses per packet or ring slot, only
+     * allocated with multi-buffer */
+    uint64_t *frag_addrs;
+
+    /* Streamed: ring from the refill thread, which has its own magazine in
+     * front of the UMEM's frame pool */
+    pthread_t refill_thread;
+    struct xsk_umem_info *umem;
+    struct frame_cache frames;
+    struct replay_packet *ring;
+    uint32_t ring_mask;
+    _Atomic uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    /* Set once the ring and UMEM are as full as they get before sending */
+    _Atomic bool primed;
+    _Atomic bool done;
+    _Atomic bool stop;
+    uint64_t underruns;
+};
+
+/* With -e every generated packet is encapsulated in place on each send,
+ * its headers pushed into the frame headroom it is written behind, hlen
+ * bytes of it */
+struct tx_encap
+{
+    bool enabled;
+    enum xsk_encap_type type;
+    /* VLAN TCI or MPLS label, GRE and VXLAN keep theirs in tunnel */
+    uint32_t id;
+    struct xsk_tunnel tunnel;
+    uint32_t hlen;
+};
+
+struct tx_stats
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t bursts;
+    uint64_t lateness_sum_ns;
+    uint64_t lateness_max_ns;
+    uint64_t start_ns;
+};
+
+static void _usage(const char *const prog_name);
+static uint64_t _now_ns(void);
 static struct timespec create_timespec(const uint64_t time);
-static void create_frame(uint8_t *const frame);
+static uint64_t _wait_until(const uint64_t deadline_ns);
+static uint64_t _pace_offset_ns(const uint64_t packets, const uint64_t rate_pps);
+static void _init_frames(struct xsk_socket_info *const xsk_socket);
+static bool _init_template(void);
+static void _alloc_packed(struct xsk_socket_info *const xsk_socket, uint64_t *const addrs, const uint32_t n);
+static __sum16 _packet_csum(const uint8_t *const frame, const uint32_t frame_size);
+static void _send_burst(struct xsk_socket_info *const xsk_socket, const unsigned int burst_size,
+                        uint32_t *const sequence);
+static uint64_t _replay_run(struct xsk_socket_info *const xsk_socket, const unsigned int burst_size,
+                            const uint64_t end_ns, uint64_t *const total_bytes);
+static bool _replay_start(struct xsk_socket_info *const xsk_socket, const char *const path);
+static void _replay_stop(void);
+static bool _replay_usable(const struct pcap_packet *const packet);
+static uint64_t _replay_offset(const struct pcap_packet *const packet, const uint64_t loop_offset_ns);
+static uint32_t _frame_count(const uint32_t len, const uint32_t frame_size);
+static bool _replay_copy(struct frame_cache *const cache, const struct pcap_packet *const packet,
+                         struct replay_packet *const entry, uint64_t *const frags);
+static bool _replay_pack(const struct pcap_packet *const packet, struct replay_packet *const entry);
+static bool _replay_preload(struct xsk_socket_info *const xsk_socket);
+static void *_refill_loop(void *arg);
+static uint32_t _replay_peek(struct replay_packet *const packets, const uint32_t max);
+static void _replay_consume(const uint32_t n);
+static bool _replay_finished(void);
+static void _send_packets(struct xsk_socket_info *const xsk_socket, const struct replay_packet *const packets,
+                          const uint32_t n);
+static void _report(struct tx_stats *const stats, const uint64_t now_ns, const uint64_t rate_pps);
+static bool _parse_flow(const char *const saddr, const char *const daddr, struct tx_flow *const flow);
+static bool _parse_encap(const char *const spec, struct tx_encap *const encap);
+static void _encapsulate(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint8_t *const frame);
+static void create_frame(uint8_t *const frame, const uint32_t frame_size);
+static void _stamp_frame(uint8_t *const frame, const uint32_t sequence);
+static void _clear_frame(uint8_t *const frame);
 static void complete_tx(struct xsk_socket_info *xsk);
+static void _print_summary(struct xsk_socket_info *const xsk_socket, const uint64_t packets, const uint64_t bytes,
+                           const uint64_t start_ns);
+
+static const uint8_t dst_mac[ETH_ALEN] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+static const uint8_t src_mac[ETH_ALEN] = {0x77, 0x88, 0x00, 0x00, 0x00, 0x00};
+/* In busy-poll mode every sendto() runs the driver, so it is always made */
+static bool busy_poll = false;
+static struct tx_flow flow = {.sport = DEFAULT_SRC_PORT, .dport = DEFAULT_DST_PORT};
+static struct replay replay = {.speed = 1, .loops = 1};
+/* Generated packets span frags_per_packet frames, more than one only with
+ * multi-buffer */
+static uint32_t packet_len = ETH_FRAME_SIZE;
+static uint32_t frags_per_packet = 1;
+/* UDP checksum of a generated packet carrying sequence number 0 */
+static __sum16 template_check;
+/* With -U packets are packed into variable-size buffers of an unaligned
+ * UMEM instead of taking a frame each, generated ones copied from
+ * template_frame on every send */
+static struct umem_slab *slab;
+static uint8_t *template_frame;
+static struct tx_encap encap;
+/* The template's Ethernet header, which the pushes write over */
+static struct ethhdr template_eth;
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    uint64_t rate_pps = DEFAULT_RATE_PPS;
+    unsigned int burst_size = DEFAULT_BURST_SIZE;
+    uint32_t num_frames = NUM_FRAMES;
+    uint32_t frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE;
+    struct xsk_ring_config rings = default_ring_config(XSK_PROFILE_TX_ONLY);
+    uint32_t xdp_flags = XDP_FLAGS_SKB_MODE;
+    uint16_t bind_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    unsigned int duration_s = 0;
+    const char *saddr = DEFAULT_SRC_ADDR;
+    const char *daddr = DEFAULT_DST_ADDR;
+    const char *replay_file = NULL;
+    const char *outer_saddr = NULL;
+    const char *outer_daddr = NULL;
+    bool multi_buffer = false;
+    uint64_t slab_bytes = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:b:f:s:t:c:M:ZjpT:S:D:u:P:x:l:L:U:e:o:O:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            if (!_parse_encap(optarg, &encap))
+                _usage(argv[0]);
+            break;
+        case 'o':
+            outer_saddr = optarg;
+            break;
+        case 'O':
+            outer_daddr = optarg;
+            break;
+        case 'U':
+            slab_bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'L':
+            packet_len = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            multi_buffer = true;
+            break;
+        case 'P':
+            replay_file = optarg;
+            break;
+        case 'x':
+            replay.speed = strtod(optarg, NULL);
+            break;
+        case 'l':
+            replay.loops = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            saddr = optarg;
+            break;
+        case 'D':
+            daddr = optarg;
+            break;
+        case 'u':
+            flow.dport = atoi(optarg);
+            break;
+        case 'M':
+            if (!parse_xdp_mode(optarg, &xdp_flags))
+                _usage(argv[0]);
+            break;
+        case 'Z':
+            bind_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+            break;
+        case 'p':
+            busy_poll = true;
+            break;
+        case 'T':
+            duration_s = atoi(optarg);
+            break;
+        case 't':
+            rings.tx_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            rings.comp_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            num_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            frame_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            rate_pps = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            burst_size = atoi(optarg);
+            break;
+        default:
+            _usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        _usage(argv[0]);
+
+    if (!_parse_flow(saddr, daddr, &flow))
+    {
+        fprintf(stderr, "Source and destination must both be IPv4 or both IPv6 addresses\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (encap.enabled && (encap.type == XSK_ENCAP_GRE || encap.type == XSK_ENCAP_VXLAN))
     {
-        fprintf(stderr, "Provide device name\n");
+        struct tx_flow outer = {0};
+
+        if (!outer_saddr || !outer_daddr || !_parse_flow(outer_saddr, outer_daddr, &outer))
+        {
+            fprintf(stderr, "GRE and VXLAN need outer source and destination (-o, -O), both IPv4 or both IPv6\n");
+            exit(EXIT_FAILURE);
+        }
+
+        encap.tunnel.family = outer.family;
+        encap.tunnel.saddr = outer.saddr;
+        encap.tunnel.daddr = outer.daddr;
+    }
+    if (encap.enabled)
+        encap.hlen = xsk_encap_hlen(encap.type, &encap.tunnel);
+
+    /* Room for the headers and the sequence number */
+    if (packet_len < flow.l4_offset + sizeof(struct udphdr) + sizeof(uint32_t))
+    {
+        fprintf(stderr, "Packet length must be at least %zu\n",
+                flow.l4_offset + sizeof(struct udphdr) + sizeof(uint32_t));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Bigger packets are sent as chains of frames, which the socket only
+     * takes when bound for multi-buffer */
+    frags_per_packet = _frame_count(packet_len, frame_size);
+    replay.frame_size = frame_size;
+    replay.max_len = multi_buffer ? frame_size * XSK_MAX_FRAGS : frame_size;
+    if (multi_buffer)
+        bind_flags |= XDP_USE_SG;
+
+    if (frags_per_packet > 1 && !multi_buffer)
+    {
+        fprintf(stderr, "Packets longer than a frame (%u) need -j\n", frame_size);
+        exit(EXIT_FAILURE);
+    }
+
+    if (frags_per_packet > XSK_MAX_FRAGS || packet_len - ETH_HLEN > UINT16_MAX)
+    {
+        fprintf(stderr, "Packet length can't exceed %u frames or an IP packet's %u bytes\n", XSK_MAX_FRAGS,
+                UINT16_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    /* A packed buffer never crosses a page, so can't hold a chain */
+    if (slab_bytes && (multi_buffer || packet_len > UMEM_PAGE_SIZE))
+    {
+        fprintf(stderr, "-U packs packets of up to %u bytes and can't be combined with -j\n", UMEM_PAGE_SIZE);
         exit(EXIT_FAILURE);
     }
+    if (slab_bytes && replay.max_len > UMEM_PAGE_SIZE)
+        replay.max_len = UMEM_PAGE_SIZE;
 
-    struct xsk_socket_info *const xsk_socket = create_socket(argv[1], INTERFACE_QUEUE_INDEX, XDP_FLAGS, XDP_BIND_FLAGS);
+    /* Headers are pushed in front of a packet's one frame, its template
+     * written hlen bytes in */
+    if (encap.enabled && (multi_buffer || slab_bytes || replay_file))
+    {
+        fprintf(stderr, "-e encapsulates generated packets and can't be combined with -j, -U or -P\n");
+        exit(EXIT_FAILURE);
+    }
+    if (encap.enabled && packet_len + encap.hlen > frame_size)
+    {
+        fprintf(stderr, "Packet length plus the %u byte encapsulation can't exceed a frame (%u)\n", encap.hlen,
+                frame_size);
+        exit(EXIT_FAILURE);
+    }
+    rings.frame_headroom = encap.hlen;
+
+    /* A burst of the longest packets must fit in the TX ring and UMEM */
+    const uint32_t max_frags = replay_file ? _frame_count(replay.max_len, frame_size) : frags_per_packet;
+
+    if (burst_size == 0 || burst_size * max_frags > rings.tx_size)
+    {
+        fprintf(stderr, "Burst size must be between 1 and the TX ring size (%u) over %u frame(s) per packet\n",
+                rings.tx_size, max_frags);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!slab_bytes && burst_size * max_frags > num_frames)
+    {
+        fprintf(stderr, "Burst size can't exceed the number of frames (%u) over %u frame(s) per packet\n",
+                num_frames, max_frags);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Taking a page per packet, a burst may hold buffers in every slab but
+     * the one being cut from */
+    if (slab_bytes && (uint64_t)burst_size * UMEM_PAGE_SIZE + UMEM_SLAB_SIZE > slab_bytes)
+    {
+        fprintf(stderr, "-U needs at least %lu MB for bursts of %u\n",
+                ((uint64_t)burst_size * UMEM_PAGE_SIZE + UMEM_SLAB_SIZE + (1 << 20) - 1) >> 20, burst_size);
+        exit(EXIT_FAILURE);
+    }
+
+    struct xsk_umem_info *const umem =
+        slab_bytes ? create_unaligned_umem(argv[optind], num_frames, frame_size, slab_bytes, &rings)
+                   : create_umem(argv[optind], num_frames, frame_size, &rings);
+    if (!umem)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    struct xsk_socket_info *const xsk_socket = create_shared_socket(argv[optind], INTERFACE_QUEUE_INDEX, xdp_flags,
+                                                                    bind_flags, umem, &rings);
     if (!xsk_socket)
     {
         exit(EXIT_FAILURE);
     }
+    slab = umem->slab;
+
+    if (busy_poll && xsk_enable_busy_poll(xsk_socket__fd(xsk_socket->xsk), burst_size))
+    {
+        fprintf(stderr, "Failed to enable busy polling: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (replay_file)
+    {
+        if (!_replay_start(xsk_socket, replay_file))
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        const uint64_t start_ns = _now_ns();
+        uint64_t total_bytes = 0;
+        const uint64_t total_packets = _replay_run(
+            xsk_socket, burst_size, duration_s ? start_ns + duration_s * (uint64_t)NS_PER_S : UINT64_MAX,
+            &total_bytes);
+
+        _replay_stop();
+        _print_summary(xsk_socket, total_packets, total_bytes, start_ns);
+        return EXIT_SUCCESS;
+    }
+
+    if (slab)
+    {
+        if (!_init_template())
+            exit(EXIT_FAILURE);
+    }
+    else
+    {
+        _init_frames(xsk_socket);
+    }
+
+    /* A rate of 0 sends back to back bursts as fast as the ring drains */
+    struct tx_stats stats = {.start_ns = _now_ns()};
+    uint64_t pace_start_ns = stats.start_ns;
+    uint64_t paced_bursts = 0;
+    uint64_t next_report_ns = stats.start_ns + REPORT_PERIOD_NS;
+    const uint64_t start_ns = stats.start_ns;
+    const uint64_t end_ns = duration_s ? start_ns + duration_s * (uint64_t)NS_PER_S : UINT64_MAX;
+    uint64_t total_packets = 0;
+    uint32_t sequence = 0;
 
     while (true)
     {
-        const struct timespec ts = create_timespec(PERIOD_NS);
-        if (clock_nanosleep(CLOCK_REALTIME, 0, &ts, NULL) != 0)
+        if (rate_pps)
+        {
+            const uint64_t lateness_ns =
+                _wait_until(pace_start_ns + _pace_offset_ns(paced_bursts * burst_size, rate_pps));
+            stats.lateness_sum_ns += lateness_ns;
+            if (lateness_ns > stats.lateness_max_ns)
+                stats.lateness_max_ns = lateness_ns;
+
+            /* Deadlines are absolute, and computed from the burst count
+             * rather than summed periods, so that neither pacing error nor
+             * the rounding of a period accumulates into rate error. Only
+             * resynchronise after falling a full report period behind,
+             * instead of bursting to catch up. */
+            paced_bursts++;
+            if (lateness_ns > REPORT_PERIOD_NS)
+            {
+                pace_start_ns = _now_ns();
+                paced_bursts = 1;
+            }
+        }
+
+        _send_burst(xsk_socket, burst_size, &sequence);
+        stats.packets += burst_size;
+        stats.bytes += burst_size * (packet_len + encap.hlen);
+        stats.bursts++;
+        total_packets += burst_size;
+
+        const uint64_t now_ns = _now_ns();
+        if (now_ns >= next_report_ns)
         {
-            perror("Sleep failed");
+            _report(&stats, now_ns, rate_pps);
+            next_report_ns = now_ns + REPORT_PERIOD_NS;
+        }
+
+        if (now_ns >= end_ns)
+            break;
+    }
+
+    _print_summary(xsk_socket, total_packets, total_packets * (packet_len + encap.hlen), start_ns);
+    return EXIT_SUCCESS;
+}
+
+static void _usage(const char *const prog_name)
+{
+    fprintf(stderr, "Usage: %s [-r rate_pps (0 = line rate)] [-b burst_size] [-f num_frames] [-s frame_size] "
+            "[-t tx_ring_size] [-c comp_ring_size] [-M skb|native] [-Z (zero-copy)] [-j (multi-buffer)] "
+            "[-p (busy poll)] [-T duration_s] [-S src_ip] [-D dst_ip] [-u dst_port] [-L packet_len] "
+            "[-P replay_pcap] [-x speed (0 = top speed)] [-l loops (0 = forever)] [-U slab_mb (packed buffers)] "
+            "[-e vlan:tci|mpls:label|gre[:key]|vxlan:vni (encapsulation)] [-o outer_src_ip] [-O outer_dst_ip] "
+            "<device>\n", prog_name);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t _now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static struct timespec create_timespec(const uint64_t time)
+{
+    const struct timespec ts = {.tv_sec = time / NS_PER_S, .tv_nsec = time % NS_PER_S};
+    return ts;
+}
+
+/* Time from the pacing start until packet number packets is due at
+ * rate_pps, computed as whole seconds plus a remainder so long runs don't
+ * overflow */
+static uint64_t _pace_offset_ns(const uint64_t packets, const uint64_t rate_pps)
+{
+    return packets / rate_pps * NS_PER_S + packets % rate_pps * NS_PER_S / rate_pps;
+}
+
+/* Hybrid wait: sleep on an absolute CLOCK_MONOTONIC deadline until SPIN_NS
+ * before it, then spin so that scheduler wakeup latency doesn't show up as
+ * pacing jitter. Returns how late the caller is released. */
+static uint64_t _wait_until(const uint64_t deadline_ns)
+{
+    uint64_t now_ns = _now_ns();
+
+    if (now_ns + SPIN_NS < deadline_ns)
+    {
+        const struct timespec ts = create_timespec(deadline_ns - SPIN_NS);
+        const int ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (ret != 0 && ret != EINTR)
+        {
+            fprintf(stderr, "Sleep failed: %s\n", strerror(ret));
             exit(EXIT_FAILURE);
         }
+    }
+
+    while ((now_ns = _now_ns()) < deadline_ns)
+        ;
+
+    return now_ns - deadline_ns;
+}
+
+/* Writes the frame template into every UMEM frame once, behind the frame
+ * headroom. TX never modifies frame contents past the Ethernet header, so
+ * frames returned through the completion ring still hold the template and
+ * only need their varying fields patched before reuse. Any frame may be a
+ * packet's first or one of the rest of its chain, which is just more
+ * payload. */
+static void _init_frames(struct xsk_socket_info *const xsk_socket)
+{
+    const uint32_t frame_size = xsk_socket->umem->frame_size;
+    const uint32_t headroom = xsk_socket->umem->frame_headroom;
+
+    for (uint32_t i = 0; i < xsk_socket->umem->num_frames; i++)
+        create_frame(xsk_umem__get_data(xsk_socket->umem->buffer, (uint64_t)i * frame_size + headroom),
+                     frame_size - headroom);
+
+    memcpy(&template_eth, xsk_umem__get_data(xsk_socket->umem->buffer, headroom), sizeof(template_eth));
+    template_check = _packet_csum(xsk_umem__get_data(xsk_socket->umem->buffer, headroom), frame_size);
+}
+
+/* The packed buffers' contents don't survive reuse, a buffer may come back
+ * at any offset, so every send copies the whole packet from here */
+static bool _init_template(void)
+{
+    template_frame = malloc(packet_len);
+    if (!template_frame)
+        return false;
+
+    create_frame(template_frame, packet_len);
+    template_check = _packet_csum(template_frame, packet_len);
+    return true;
+}
+
+/* Takes buffers for n generated packets, reaping completions until the
+ * slabs have room */
+static void _alloc_packed(struct xsk_socket_info *const xsk_socket, uint64_t *const addrs, const uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        while ((addrs[i] = umem_slab_alloc(slab, packet_len)) == INVALID_UMEM_FRAME)
+            complete_tx(xsk_socket);
+    }
+}
+
+/* The packet's payload continues with whole copies of the template, so its
+ * checksum is summed over the first frame's L4 part and then the template
+ * once per further frame, with nothing copied together */
+static __sum16 _packet_csum(const uint8_t *const frame, const uint32_t frame_size)
+{
+    const uint32_t l4_len = packet_len - flow.l4_offset;
+    const uint32_t head_len = packet_len < frame_size ? packet_len : frame_size;
+    __wsum sum = csum_partial(frame + flow.l4_offset, head_len - flow.l4_offset, 0);
+
+    for (uint32_t offset = frame_size; offset < packet_len; offset += frame_size)
+        sum = csum_partial(frame, packet_len - offset < frame_size ? packet_len - offset : frame_size, sum);
+
+    if (flow.family == AF_INET)
+    {
+        const struct iphdr *const iph = (const struct iphdr *)(frame + ETH_HLEN);
+        sum = csum_ipv4_pseudo(iph->saddr, iph->daddr, l4_len, IPPROTO_UDP, sum);
+    }
+    else
+    {
+        const struct ipv6hdr *const ip6h = (const struct ipv6hdr *)(frame + ETH_HLEN);
+        sum = csum_ipv6_pseudo(&ip6h->saddr, &ip6h->daddr, l4_len, IPPROTO_UDP, sum);
+    }
+
+    /* A computed 0 goes on the wire as its one's complement twin, 0 means
+     * no checksum to IPv4 and is invalid over IPv6 */
+    const __sum16 check = csum_fold(sum);
+    return check ? check : 0xffff;
+}
+
+static void _send_burst(struct xsk_socket_info *const xsk_socket, const unsigned int burst_size,
+                        uint32_t *const sequence)
+{
+    const uint32_t frame_size = xsk_socket->umem->frame_size;
+    const unsigned int num_descs = burst_size * frags_per_packet;
+    uint64_t addrs[num_descs];
+    uint32_t allocated = 0;
+    uint32_t idx;
+
+    if (slab)
+    {
+        _alloc_packed(xsk_socket, addrs, num_descs);
+    }
+    else
+    {
+        while ((allocated += xsk_alloc_umem_frames(xsk_socket, addrs + allocated, num_descs - allocated)) <
+               num_descs)
+        {
+            complete_tx(xsk_socket);
+        }
+    }
+
+    while (xsk_ring_prod__reserve(&xsk_socket->tx, num_descs, &idx) < num_descs)
+    {
+        complete_tx(xsk_socket);
+    }
+
+    /* A chain is the packet's frames in consecutive descriptors, all but
+     * the last flagged to continue into the next */
+    for (unsigned int i = 0; i < num_descs; i++)
+    {
+        struct xdp_desc *const tx_desc = xsk_ring_prod__tx_desc(&xsk_socket->tx, idx + i);
+        const uint64_t addr = addrs[i] + xsk_socket->umem->frame_headroom;
+        uint8_t *const frame = xsk_umem__get_data(xsk_socket->umem->buffer, addr);
+        const uint32_t frag = i % frags_per_packet;
+        const uint32_t offset = frag * frame_size;
+
+        if (slab)
+            memcpy(frame, template_frame, packet_len);
 
-        uint32_t idx;
-        while (xsk_ring_prod__reserve(&xsk_socket->tx, BATCH_SIZE, &idx) < BATCH_SIZE)
+        if (frag == 0)
+            _stamp_frame(frame, (*sequence)++);
+        else
+            _clear_frame(frame);
+
+        tx_desc->addr = addr;
+        tx_desc->len = packet_len - offset < frame_size ? packet_len - offset : frame_size;
+        tx_desc->options = frag + 1 < frags_per_packet ? XDP_PKT_CONTD : 0;
+
+        if (encap.enabled)
+            _encapsulate(xsk_socket->umem, tx_desc, frame);
+    }
+
+    xsk_ring_prod__submit(&xsk_socket->tx, num_descs);
+    xsk_socket->outstanding_tx += num_descs;
+    complete_tx(xsk_socket);
+}
+
+/* Sends the trace in bursts of up to burst_size. Paced, each burst waits
+ * for its first packet's time and takes along those due by then; like the
+ * synthetic pacing it only resynchronises after falling a full report
+ * period behind. Returns the packets sent. */
+static uint64_t _replay_run(struct xsk_socket_info *const xsk_socket, const unsigned int burst_size,
+                            const uint64_t end_ns, uint64_t *const total_bytes)
+{
+    struct replay_packet burst[burst_size];
+    struct tx_stats stats = {.start_ns = _now_ns()};
+    uint64_t start_ns = stats.start_ns;
+    uint64_t next_report_ns = start_ns + REPORT_PERIOD_NS;
+    uint64_t total_packets = 0;
+
+    while (true)
+    {
+        uint32_t n = _replay_peek(burst, burst_size);
+        if (n == 0)
         {
+            if (_replay_finished())
+                break;
+
+            /* The refill thread is behind, hand it the frames this thread
+             * holds so it can't be left waiting for them */
+            replay.underruns++;
             complete_tx(xsk_socket);
+            frame_cache_flush(&xsk_socket->frames);
+            continue;
         }
 
-        for (unsigned int i = 0; i < BATCH_SIZE; i++)
+        if (replay.speed > 0)
         {
-            struct xdp_desc *const tx_desc = xsk_ring_prod__tx_desc(&xsk_socket->tx, idx + i);
-            const uint64_t addr = xsk_alloc_umem_frame(xsk_socket);
-            if (addr == INVALID_UMEM_FRAME)
+            const uint64_t lateness_ns = _wait_until(start_ns + (uint64_t)(burst[0].offset_ns / replay.speed));
+            stats.lateness_sum_ns += lateness_ns;
+            if (lateness_ns > stats.lateness_max_ns)
+                stats.lateness_max_ns = lateness_ns;
+            if (lateness_ns > REPORT_PERIOD_NS)
+                start_ns += lateness_ns;
+
+            const uint64_t now_ns = _now_ns();
+            uint32_t due = 1;
+            while (due < n && start_ns + (uint64_t)(burst[due].offset_ns / replay.speed) <= now_ns)
+                due++;
+            n = due;
+        }
+
+        _send_packets(xsk_socket, burst, n);
+        _replay_consume(n);
+
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < n; i++)
+            bytes += burst[i].len;
+        stats.packets += n;
+        stats.bytes += bytes;
+        stats.bursts++;
+        total_packets += n;
+        *total_bytes += bytes;
+
+        const uint64_t now_ns = _now_ns();
+        if (now_ns >= next_report_ns)
+        {
+            _report(&stats, now_ns, 0);
+            next_report_ns = now_ns + REPORT_PERIOD_NS;
+        }
+
+        if (now_ns >= end_ns)
+            break;
+    }
+
+    return total_packets;
+}
+
+static bool _replay_start(struct xsk_socket_info *const xsk_socket, const char *const path)
+{
+    struct pcap_packet packet;
+    uint64_t last_ns = 0;
+
+    replay.reader = pcap_reader_open(path);
+    if (!replay.reader)
+        return false;
+
+    replay.umem = xsk_socket->umem;
+
+    /* One pass over the mapping for the count and the time span */
+    while (pcap_reader_next(replay.reader, &packet))
+    {
+        if (!_replay_usable(&packet))
+        {
+            replay.skipped++;
+            continue;
+        }
+
+        if (replay.count++ == 0)
+            replay.first_ns = packet.timestamp_ns;
+        last_ns = packet.timestamp_ns;
+        replay.num_frames += _frame_count(packet.caplen, replay.frame_size);
+    }
+
+    if (replay.count == 0)
+    {
+        fprintf(stderr, "%s has no Ethernet packets of %u bytes or less to replay\n", path, replay.max_len);
+        return false;
+    }
+
+    if (replay.reader->truncated)
+        fprintf(stderr, "%s ends in a truncated record, replaying what comes before it\n", path);
+
+    const uint64_t span_ns = last_ns > replay.first_ns ? last_ns - replay.first_ns : 0;
+    replay.loop_ns = replay.count > 1 ? span_ns + span_ns / (replay.count - 1) : 0;
+
+    if (slab || replay.num_frames <= xsk_socket->umem->num_frames)
+    {
+        if (!_replay_preload(xsk_socket))
+            return false;
+    }
+    else
+    {
+        uint32_t ring_size = 1;
+        while (ring_size < xsk_socket->umem->num_frames)
+            ring_size <<= 1;
+
+        replay.ring = calloc(ring_size, sizeof(*replay.ring));
+        if (!replay.ring)
+            return false;
+        if (replay.max_len > replay.frame_size)
+        {
+            replay.frag_addrs = calloc((size_t)ring_size * (XSK_MAX_FRAGS - 1), sizeof(*replay.frag_addrs));
+            if (!replay.frag_addrs)
+                return false;
+        }
+        replay.ring_mask = ring_size - 1;
+        frame_cache_init(&replay.frames, xsk_socket->umem->pool);
+        pcap_reader_rewind(replay.reader);
+
+        const int ret = pthread_create(&replay.refill_thread, NULL, _refill_loop, NULL);
+        if (ret)
+        {
+            fprintf(stderr, "Failed to start the refill thread: %s\n", strerror(ret));
+            return false;
+        }
+
+        /* Give it the head start of filling UMEM before the first send */
+        while (!atomic_load(&replay.primed))
+            sched_yield();
+    }
+
+    printf("Replaying %u packets from %s (%s, %lu skipped)\n", replay.count, path,
+           replay.preloaded ? "preloaded" : "streamed", replay.skipped);
+    return true;
+}
+
+static void _replay_stop(void)
+{
+    if (replay.ring)
+    {
+        atomic_store(&replay.stop, true);
+        pthread_join(replay.refill_thread, NULL);
+    }
+
+    pcap_reader_close(replay.reader);
+}
+
+/* Packets are sent as captured, cut short if the capture cut them */
+static bool _replay_usable(const struct pcap_packet *const packet)
+{
+    return packet->caplen >= ETH_HLEN && packet->caplen <= replay.max_len;
+}
+
+static uint64_t _replay_offset(const struct pcap_packet *const packet, const uint64_t loop_offset_ns)
+{
+    const uint64_t offset_ns = packet->timestamp_ns > replay.first_ns ? packet->timestamp_ns - replay.first_ns : 0;
+    return offset_ns + loop_offset_ns;
+}
+
+static uint32_t _frame_count(const uint32_t len, const uint32_t frame_size)
+{
+    return len > frame_size ? (len + frame_size - 1) / frame_size : 1;
+}
+
+/* Copies a trace packet into frames from cache, one bigger than a frame
+ * into a chain whose further addresses go to frags. Takes no frame and
+ * returns false when the cache can't supply the whole chain. */
+static bool _replay_copy(struct frame_cache *const cache, const struct pcap_packet *const packet,
+                         struct replay_packet *const entry, uint64_t *const frags)
+{
+    const uint32_t num_frags = _frame_count(packet->caplen, replay.frame_size);
+    uint64_t addrs[XSK_MAX_FRAGS];
+
+    const uint32_t allocated = frame_cache_alloc_bulk(cache, addrs, num_frags);
+    if (allocated < num_frags)
+    {
+        frame_cache_free_bulk(cache, addrs, allocated);
+        return false;
+    }
+
+    for (uint32_t f = 0; f < num_frags; f++)
+    {
+        const uint32_t offset = f * replay.frame_size;
+        const uint32_t len = packet->caplen - offset < replay.frame_size ? packet->caplen - offset : replay.frame_size;
+
+        memcpy(xsk_umem__get_data(replay.umem->buffer, addrs[f]), packet->data + offset, len);
+        if (f > 0)
+            frags[f - 1] = addrs[f];
+    }
+
+    entry->addr = addrs[0];
+    entry->len = packet->caplen;
+    entry->num_frags = num_frags;
+    entry->frags = frags;
+    return true;
+}
+
+/* Copies a trace packet into a slab buffer of its own size. Only used to
+ * preload, the refill thread and the TX thread freeing its buffers can't
+ * share the slabs. */
+static bool _replay_pack(const struct pcap_packet *const packet, struct replay_packet *const entry)
+{
+    entry->addr = umem_slab_alloc(slab, packet->caplen);
+    if (entry->addr == INVALID_UMEM_FRAME)
+        return false;
+
+    memcpy(xsk_umem__get_data(replay.umem->buffer, entry->addr), packet->data, packet->caplen);
+    entry->len = packet->caplen;
+    entry->num_frags = 1;
+    entry->frags = NULL;
+    return true;
+}
+
+static bool _replay_preload(struct xsk_socket_info *const xsk_socket)
+{
+    struct pcap_packet packet;
+    uint32_t i = 0;
+
+    replay.packets = calloc(replay.count, sizeof(*replay.packets));
+    if (!replay.packets)
+        return false;
+
+    if (replay.max_len > replay.frame_size)
+    {
+        replay.frag_addrs = calloc((size_t)replay.count * (XSK_MAX_FRAGS - 1), sizeof(*replay.frag_addrs));
+        if (!replay.frag_addrs)
+            return false;
+    }
+
+    pcap_reader_rewind(replay.reader);
+    while (i < replay.count && pcap_reader_next(replay.reader, &packet))
+    {
+        if (!_replay_usable(&packet))
+            continue;
+
+        struct replay_packet *const entry = &replay.packets[i];
+        if (slab)
+        {
+            if (!_replay_pack(&packet, entry))
             {
-                fprintf(stderr, "Failed to allocate UMEM frame\n");
-                exit(EXIT_FAILURE);
+                fprintf(stderr, "The trace doesn't fit in %u slabs, -U needs more to preload it\n",
+                        slab->num_slabs);
+                return false;
             }
-            uint8_t *const pkt = xsk_umem__get_data(xsk_socket->umem->buffer, addr);
-            create_frame(pkt);
-            tx_desc->addr = addr;
-            tx_desc->len = ETH_FRAME_SIZE;
         }
+        else
+        {
+            /* The trace fits in UMEM, the frames can't run out */
+            _replay_copy(&xsk_socket->frames, &packet, entry,
+                         replay.frag_addrs ? &replay.frag_addrs[(size_t)i * (XSK_MAX_FRAGS - 1)] : NULL);
+        }
+        entry->offset_ns = _replay_offset(&packet, 0);
+        i++;
+    }
+
+    replay.preloaded = true;
+    return true;
+}
+
+/* Copies the trace into free frames for the TX thread, looping over it as
+ * often as asked, and only ever waits for the TX thread, never the other
+ * way round */
+static void *_refill_loop(void *arg)
+{
+    const struct timespec idle = {.tv_nsec = REFILL_IDLE_NS};
+    uint32_t head = atomic_load_explicit(&replay.head, memory_order_relaxed);
+    uint64_t loop_offset_ns = 0;
+    struct pcap_packet packet;
+
+    (void)arg;
+
+    while (!atomic_load_explicit(&replay.stop, memory_order_relaxed))
+    {
+        if (!pcap_reader_next(replay.reader, &packet))
+        {
+            if (replay.loops && replay.loop + 1 >= replay.loops)
+                break;
+
+            __atomic_store_n(&replay.loop, replay.loop + 1, __ATOMIC_RELAXED);
+
+            pcap_reader_rewind(replay.reader);
+            loop_offset_ns += replay.loop_ns;
+            continue;
+        }
+
+        if (!_replay_usable(&packet))
+            continue;
+
+        const uint32_t slot = head & replay.ring_mask;
+        struct replay_packet *const entry = &replay.ring[slot];
+        uint64_t *const frags = replay.frag_addrs ? &replay.frag_addrs[(size_t)slot * (XSK_MAX_FRAGS - 1)] : NULL;
+
+        while (head - atomic_load_explicit(&replay.tail, memory_order_acquire) > replay.ring_mask ||
+               !_replay_copy(&replay.frames, &packet, entry, frags))
+        {
+            atomic_store_explicit(&replay.primed, true, memory_order_relaxed);
+            if (atomic_load_explicit(&replay.stop, memory_order_relaxed))
+                return NULL;
+            nanosleep(&idle, NULL);
+        }
+
+        entry->offset_ns = _replay_offset(&packet, loop_offset_ns);
+        atomic_store_explicit(&replay.head, ++head, memory_order_release);
+    }
+
+    atomic_store_explicit(&replay.done, true, memory_order_release);
+    atomic_store_explicit(&replay.primed, true, memory_order_relaxed);
+    return NULL;
+}
+
+/* Copies up to max of the next packets to send without consuming them.
+ * Preloaded, a burst stops at the end of a pass. */
+static uint32_t _replay_peek(struct replay_packet *const packets, const uint32_t max)
+{
+    if (replay.preloaded)
+    {
+        if (_replay_finished())
+            return 0;
+
+        const uint32_t n = replay.count - replay.next < max ? replay.count - replay.next : max;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            packets[i] = replay.packets[replay.next + i];
+            packets[i].offset_ns += replay.loop * replay.loop_ns;
+        }
+        return n;
+    }
+
+    const uint32_t tail = atomic_load_explicit(&replay.tail, memory_order_relaxed);
+    const uint32_t available = atomic_load_explicit(&replay.head, memory_order_acquire) - tail;
+    const uint32_t n = available < max ? available : max;
+
+    for (uint32_t i = 0; i < n; i++)
+        packets[i] = replay.ring[(tail + i) & replay.ring_mask];
+    return n;
+}
+
+static void _replay_consume(const uint32_t n)
+{
+    if (replay.preloaded)
+    {
+        replay.next += n;
+        if (replay.next == replay.count)
+        {
+            replay.next = 0;
+            replay.loop++;
+        }
+        return;
+    }
+
+    atomic_store_explicit(&replay.tail, atomic_load_explicit(&replay.tail, memory_order_relaxed) + n,
+                          memory_order_release);
+}
+
+/* Streamed, done is only set after the last packet was queued, so an empty
+ * ring seen after it means everything was sent */
+static bool _replay_finished(void)
+{
+    if (replay.preloaded)
+        return replay.loops && replay.loop >= replay.loops;
 
-        xsk_ring_prod__submit(&xsk_socket->tx, BATCH_SIZE);
-        xsk_socket->outstanding_tx += BATCH_SIZE;
+    return atomic_load_explicit(&replay.done, memory_order_acquire) &&
+           atomic_load_explicit(&replay.head, memory_order_relaxed) ==
+               atomic_load_explicit(&replay.tail, memory_order_relaxed);
+}
+
+static void _send_packets(struct xsk_socket_info *const xsk_socket, const struct replay_packet *const packets,
+                          const uint32_t n)
+{
+    uint32_t num_descs = 0;
+    uint32_t idx;
+
+    for (uint32_t i = 0; i < n; i++)
+        num_descs += packets[i].num_frags;
+
+    while (xsk_ring_prod__reserve(&xsk_socket->tx, num_descs, &idx) < num_descs)
+    {
         complete_tx(xsk_socket);
     }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        const struct replay_packet *const packet = &packets[i];
+
+        for (uint32_t f = 0; f < packet->num_frags; f++)
+        {
+            struct xdp_desc *const tx_desc = xsk_ring_prod__tx_desc(&xsk_socket->tx, idx++);
+            const uint32_t offset = f * replay.frame_size;
+
+            tx_desc->addr = f ? packet->frags[f - 1] : packet->addr;
+            tx_desc->len = packet->len - offset < replay.frame_size ? packet->len - offset : replay.frame_size;
+            tx_desc->options = f + 1 < packet->num_frags ? XDP_PKT_CONTD : 0;
+        }
+    }
+
+    xsk_ring_prod__submit(&xsk_socket->tx, num_descs);
+    xsk_socket->outstanding_tx += num_descs;
+    complete_tx(xsk_socket);
 }
 
-static struct timespec create_timespec(const uint64_t time)
+static void _report(struct tx_stats *const stats, const uint64_t now_ns, const uint64_t rate_pps)
 {
-    const struct timespec ts = {.tv_sec = time / NS_PER_S, .tv_nsec = time % NS_PER_S};
-    return ts;
+    const double period_s = (double)(now_ns - stats->start_ns) / NS_PER_S;
+    const double achieved_pps = stats->packets / period_s;
+    const double mbps = stats->bytes * 8 / period_s / 1000000;
+
+    if (replay.reader)
+    {
+        printf("TX: %.0f pps %.1f Mbit/s replaying at %s%gx, pass %u, pacing lateness avg %.2f us max %.2f us, "
+               "underruns %lu\n",
+               achieved_pps, mbps, replay.speed > 0 ? "" : "top speed ", replay.speed,
+               __atomic_load_n(&replay.loop, __ATOMIC_RELAXED) + 1,
+               stats->bursts ? stats->lateness_sum_ns / 1000.0 / stats->bursts : 0,
+               stats->lateness_max_ns / 1000.0, replay.underruns);
+    }
+    else if (rate_pps)
+    {
+        printf("TX: %.0f pps (target %lu, error %+.3f%%) %.1f Mbit/s, pacing lateness avg %.2f us max %.2f us\n",
+               achieved_pps, rate_pps, (achieved_pps - rate_pps) * 100 / rate_pps, mbps,
+               stats->bursts ? stats->lateness_sum_ns / 1000.0 / stats->bursts : 0,
+               stats->lateness_max_ns / 1000.0);
+    }
+    else
+    {
+        printf("TX: %.0f pps (line rate) %.1f Mbit/s\n", achieved_pps, mbps);
+    }
+
+    *stats = (struct tx_stats){.start_ns = now_ns};
+}
+
+static bool _parse_flow(const char *const saddr, const char *const daddr, struct tx_flow *const flow)
+{
+    if (inet_pton(AF_INET, saddr, &flow->saddr) == 1 && inet_pton(AF_INET, daddr, &flow->daddr) == 1)
+    {
+        flow->family = AF_INET;
+        flow->l4_offset = ETH_HLEN + sizeof(struct iphdr);
+        return true;
+    }
+
+    if (inet_pton(AF_INET6, saddr, &flow->saddr) == 1 && inet_pton(AF_INET6, daddr, &flow->daddr) == 1)
+    {
+        flow->family = AF_INET6;
+        flow->l4_offset = ETH_HLEN + sizeof(struct ipv6hdr);
+        return true;
+    }
+
+    return false;
+}
+
+/* Takes vlan:<tci>, mpls:<label>, gre or gre:<key> and vxlan:<vni>. The
+ * outer Ethernet header of a tunnel repeats the generated packet's. */
+static bool _parse_encap(const char *const spec, struct tx_encap *const encap)
+{
+    const char *const colon = strchr(spec, ':');
+    const size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+    const uint32_t id = colon ? strtoul(colon + 1, NULL, 0) : 0;
+
+    if (name_len == 4 && !strncmp(spec, "vlan", name_len) && colon)
+        encap->type = XSK_ENCAP_VLAN;
+    else if (name_len == 4 && !strncmp(spec, "mpls", name_len) && colon)
+        encap->type = XSK_ENCAP_MPLS;
+    else if (name_len == 3 && !strncmp(spec, "gre", name_len))
+        encap->type = XSK_ENCAP_GRE;
+    else if (name_len == 5 && !strncmp(spec, "vxlan", name_len) && colon)
+        encap->type = XSK_ENCAP_VXLAN;
+    else
+        return false;
+
+    encap->enabled = true;
+    encap->id = id;
+    memcpy(encap->tunnel.h_dest, dst_mac, ETH_ALEN);
+    memcpy(encap->tunnel.h_source, src_mac, ETH_ALEN);
+    encap->tunnel.ttl = DEFAULT_TTL;
+    encap->tunnel.sport = DEFAULT_SRC_PORT;
+    encap->tunnel.dport = VXLAN_PORT;
+    encap->tunnel.key = id;
+    encap->tunnel.has_key = encap->type == XSK_ENCAP_GRE && colon;
+    return true;
 }
 
-static void create_frame(uint8_t *const frame)
+/* The frame may have been sent before, encapsulated the same way, so its
+ * Ethernet header is restored before headers are pushed in front again */
+static void _encapsulate(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint8_t *const frame)
 {
-    memset(frame, 0, ETH_FRAME_SIZE);
-    frame[0] = 0x11;
-    frame[1] = 0x22;
-    frame[2] = 0x33;
-    frame[3] = 0x44;
-    frame[4] = 0x55;
-    frame[5] = 0x66;
-    frame[6] = 0x77;
-    frame[7] = 0x88;
+    bool pushed = false;
+
+    memcpy(frame, &template_eth, sizeof(template_eth));
+
+    switch (encap.type)
+    {
+    case XSK_ENCAP_VLAN:
+        pushed = xsk_push_vlan(umem, desc, ETH_P_8021Q, encap.id);
+        break;
+    case XSK_ENCAP_MPLS:
+        pushed = xsk_push_mpls(umem, desc, encap.id, 0, DEFAULT_TTL);
+        break;
+    case XSK_ENCAP_GRE:
+        pushed = xsk_push_gre(umem, desc, &encap.tunnel);
+        break;
+    case XSK_ENCAP_VXLAN:
+        pushed = xsk_push_vxlan(umem, desc, &encap.tunnel);
+        break;
+    }
+
+    /* The headroom was sized for it, so this is a bug */
+    if (!pushed)
+    {
+        fprintf(stderr, "Failed to encapsulate a packet\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Ethernet, IPv4 or IPv6 and UDP headers for a packet_len packet, followed
+ * by a zero payload holding sequence number 0. The UDP checksum is left
+ * zero, _stamp_frame() puts in each packet's. */
+static void create_frame(uint8_t *const frame, const uint32_t frame_size)
+{
+    struct ethhdr *const eth = (struct ethhdr *)frame;
+    struct udphdr *const udp = (struct udphdr *)(frame + flow.l4_offset);
+    const uint32_t l4_len = packet_len - flow.l4_offset;
+
+    memset(frame, 0, packet_len < frame_size ? packet_len : frame_size);
+    memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+    memcpy(eth->h_source, src_mac, ETH_ALEN);
+
+    udp->source = htons(flow.sport);
+    udp->dest = htons(flow.dport);
+    udp->len = htons(l4_len);
+
+    if (flow.family == AF_INET)
+    {
+        struct iphdr *const iph = (struct iphdr *)(eth + 1);
+
+        eth->h_proto = htons(ETH_P_IP);
+        iph->version = 4;
+        iph->ihl = sizeof(*iph) / 4;
+        iph->tot_len = htons(packet_len - ETH_HLEN);
+        iph->frag_off = htons(IP_DF);
+        iph->ttl = DEFAULT_TTL;
+        iph->protocol = IPPROTO_UDP;
+        memcpy(&iph->saddr, &flow.saddr, sizeof(iph->saddr));
+        memcpy(&iph->daddr, &flow.daddr, sizeof(iph->daddr));
+        iph->check = ipv4_header_csum(iph);
+    }
+    else
+    {
+        struct ipv6hdr *const ip6h = (struct ipv6hdr *)(eth + 1);
+
+        eth->h_proto = htons(ETH_P_IPV6);
+        ip6h->version = 6;
+        ip6h->payload_len = htons(l4_len);
+        ip6h->nexthdr = IPPROTO_UDP;
+        ip6h->hop_limit = DEFAULT_TTL;
+        ip6h->saddr = flow.saddr;
+        ip6h->daddr = flow.daddr;
+    }
+}
+
+/* The checksum is patched from the sequence 0 one rather than redone. It
+ * is set afresh every time because the frame may last have been further
+ * along a chain, where it holds no checksum. */
+static void _stamp_frame(uint8_t *const frame, const uint32_t sequence)
+{
+    struct udphdr *const udp = (struct udphdr *)(frame + flow.l4_offset);
+    uint8_t *const payload = (uint8_t *)(udp + 1);
+    const uint32_t sequence_be = htonl(sequence);
+
+    memcpy(payload, &sequence_be, sizeof(sequence_be));
+    udp->check = template_check;
+    csum_replace4(&udp->check, 0, sequence_be);
+    if (udp->check == 0)
+        udp->check = 0xffff;
+}
+
+/* Returns a frame sent as the head of an earlier packet to the plain
+ * template, the payload template_check was computed over */
+static void _clear_frame(uint8_t *const frame)
+{
+    struct udphdr *const udp = (struct udphdr *)(frame + flow.l4_offset);
+
+    udp->check = 0;
+    memset(udp + 1, 0, sizeof(uint32_t));
 }
 
 static void complete_tx(struct xsk_socket_info *xsk)
@@ -98,17 +1299,47 @@ static void complete_tx(struct xsk_socket_info *xsk)
     if (!xsk->outstanding_tx)
         return;
 
-    sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    /* The kernel only needs a kick when it has stopped draining the TX ring */
+    if (busy_poll || xsk_ring_prod__needs_wakeup(&xsk->tx))
+        sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
 
     /* Collect/free completed TX buffers */
-    completed = xsk_ring_cons__peek(&xsk->umem->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx_cq);
+    completed = xsk_ring_cons__peek(&xsk->umem->cq, xsk->umem->cq.size, &idx_cq);
 
     if (completed > 0)
     {
-        for (int i = 0; i < completed; i++)
-            xsk_free_umem_frame(xsk, *xsk_ring_cons__comp_addr(&xsk->umem->cq, idx_cq + i));
+        /* Preloaded replay frames are sent again, never freed */
+        for (int i = 0; i < completed && !replay.preloaded; i++)
+        {
+            const uint64_t addr = *xsk_ring_cons__comp_addr(&xsk->umem->cq, idx_cq + i);
+
+            if (slab)
+                umem_slab_free(slab, addr);
+            else
+                xsk_free_umem_frame(xsk, addr);
+        }
 
         xsk_ring_cons__release(&xsk->umem->cq, completed);
         xsk->outstanding_tx -= completed < xsk->outstanding_tx ? completed : xsk->outstanding_tx;
     }
-}
\ No newline at end of file
+}
+
+/* One machine readable line for the benchmark driver */
+static void _print_summary(struct xsk_socket_info *const xsk_socket, const uint64_t packets, const uint64_t bytes,
+                           const uint64_t start_ns)
+{
+    struct xdp_statistics kernel = {0};
+    struct rusage usage;
+
+    const double seconds = (double)(_now_ns() - start_ns) / NS_PER_S;
+    xsk_get_kernel_stats(xsk_socket, &kernel);
+    getrusage(RUSAGE_SELF, &usage);
+    const double cpu_ns = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+                          (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+
+    printf("SUMMARY tx_packets=%lu seconds=%.3f pps=%.0f mbps=%.1f cpu_ns_per_packet=%.1f "
+           "tx_invalid=%llu tx_ring_empty=%llu\n",
+           packets, seconds, packets / seconds, bytes * 8 / seconds / 1000000,
+           packets ? cpu_ns / packets : 0, kernel.tx_invalid_descs, kernel.tx_ring_empty_descs);
+    fflush(stdout);
+}
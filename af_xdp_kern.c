@@ -1,43 +1,316 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+#include <stdbool.h>
 #include <linux/bpf.h>
 
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "common/parsing_helpers.h"
+#include "common/xdp_stats_kern_user.h"
+#include "common/xdp_stats_kern.h"
+#include "common/xdp_filter_kern_user.h"
+#include "common/xdp_meta_kern_user.h"
+
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+#ifndef IP_MF
+#define IP_MF 0x2000
+#endif
+#ifndef IP_OFFSET
+#define IP_OFFSET 0x1fff
+#endif
+
+#define MAX_XSKS 1024
+
+#ifdef XDP_RX_HW_TIMESTAMP
+/* Only resolvable in programs bound to a device whose driver implements
+ * it, so it is compiled into af_xdp_kern_hwts.o only */
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
+					 __u64 *timestamp) __ksym;
+#endif
+
+/* Sockets bound to each RX queue, set by the loader before the program is
+ * loaded. Socket s of queue q is at index q * socks_per_queue + s of
+ * xsks_map. Kept in its own section so userspace can set it without BTF. */
+const volatile __u32 socks_per_queue SEC(".rodata.steering") = 1;
 
 struct {
 	__uint(type, BPF_MAP_TYPE_XSKMAP);
 	__type(key, __u32);
 	__type(value, __u32);
-	__uint(max_entries, 64);
+	__uint(max_entries, MAX_XSKS);
 } xsks_map SEC(".maps");
 
+/* Flow filter, consulted in order: exact 5-tuple, destination prefix,
+ * source prefix and finally the default action */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct flow_key);
+	__type(value, __u32);
+	__uint(max_entries, XDP_FILTER_MAX_FLOWS);
+} filter_flows SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct lpm_v4_key);
+	__type(value, __u32);
+	__uint(max_entries, XDP_FILTER_MAX_PREFIXES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} filter_v4 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct lpm_v6_key);
+	__type(value, __u32);
+	__uint(max_entries, XDP_FILTER_MAX_PREFIXES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} filter_v6 SEC(".maps");
+
 struct {
-	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(type, BPF_MAP_TYPE_ARRAY);
 	__type(key, __u32);
 	__type(value, __u32);
-	__uint(max_entries, 64);
-} xdp_stats_map SEC(".maps");
+	__uint(max_entries, 1);
+} filter_default SEC(".maps");
 
-SEC("xdp")
-int xdp_sock_prog(struct xdp_md *ctx)
+static __always_inline __u32 rol32(__u32 word, unsigned int shift)
 {
-    int index = ctx->rx_queue_index;
-    __u32 *pkt_count;
+	return (word << shift) | (word >> (32 - shift));
+}
 
-    pkt_count = bpf_map_lookup_elem(&xdp_stats_map, &index);
-    if (pkt_count) {
+/* MurmurHash3 mixing steps */
+static __always_inline __u32 hash_mix(__u32 hash, __u32 word)
+{
+	word *= 0xcc9e2d51;
+	word = rol32(word, 15);
+	word *= 0x1b873593;
 
-        /* We pass every other packet */
-        if ((*pkt_count)++ & 1)
-            return XDP_PASS;
+	hash ^= word;
+	hash = rol32(hash, 13);
+	return hash * 5 + 0xe6546b64;
+}
+
+static __always_inline __u32 hash_final(__u32 hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/* IPv6 addresses are folded into 32 bits, that's plenty to pick a socket */
+static __always_inline __u32 fold_addr(const __u8 *addr)
+{
+	const __u32 *words = (const __u32 *)addr;
+
+	return words[0] ^ words[1] ^ words[2] ^ words[3];
+}
+
+/* Fills in the L3/L4 tuple of the packet. Returns false for non-IP packets.
+ * Packets without TCP/UDP ports are keyed by their addresses only, and so
+ * are all IP fragments, the first included: only it has the ports, and
+ * keying it apart would steer the fragments of one datagram to different
+ * sockets. IPv6 fragments already stop at their fragment header. */
+static __always_inline bool parse_flow(struct xdp_md *ctx,
+				       struct flow_key *key)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	struct ipv6hdr *ip6h;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+	int eth_type, ip_type;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iph);
+		if (ip_type < 0)
+			return false;
+		key->family = AF_INET;
+		__builtin_memcpy(key->saddr, &iph->saddr, sizeof(iph->saddr));
+		__builtin_memcpy(key->daddr, &iph->daddr, sizeof(iph->daddr));
+
+		if (iph->frag_off & bpf_htons(IP_MF | IP_OFFSET)) {
+			key->proto = iph->protocol;
+			return true;
+		}
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr(&nh, data_end, &ip6h);
+		if (ip_type < 0)
+			return false;
+		key->family = AF_INET6;
+		__builtin_memcpy(key->saddr, &ip6h->saddr, sizeof(ip6h->saddr));
+		__builtin_memcpy(key->daddr, &ip6h->daddr, sizeof(ip6h->daddr));
+	} else {
+		return false;
+	}
+
+	key->proto = ip_type;
+	if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(&nh, data_end, &udph) < 0)
+			return true;
+		key->sport = udph->source;
+		key->dport = udph->dest;
+	} else if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(&nh, data_end, &tcph) < 0)
+			return true;
+		key->sport = tcph->source;
+		key->dport = tcph->dest;
+	}
+
+	return true;
+}
+
+/* Both directions of a flow hash to the same value, the endpoints are put
+ * in a canonical order before hashing */
+static __always_inline __u32 flow_hash(const struct flow_key *key)
+{
+	__u32 saddr = fold_addr(key->saddr);
+	__u32 daddr = fold_addr(key->daddr);
+	__u32 lo_addr, hi_addr;
+	__u16 lo_port, hi_port;
+	__u32 hash;
+
+	if (saddr < daddr || (saddr == daddr && key->sport <= key->dport)) {
+		lo_addr = saddr;
+		hi_addr = daddr;
+		lo_port = key->sport;
+		hi_port = key->dport;
+	} else {
+		lo_addr = daddr;
+		hi_addr = saddr;
+		lo_port = key->dport;
+		hi_port = key->sport;
+	}
+
+	hash = hash_mix(key->proto, lo_addr);
+	hash = hash_mix(hash, hi_addr);
+	hash = hash_mix(hash, ((__u32)lo_port << 16) | hi_port);
+	return hash_final(hash);
+}
+
+static __always_inline __u32 *lookup_prefix(const struct flow_key *key,
+					    __u8 dir)
+{
+	const __u8 *addr = dir == XDP_FILTER_DST ? key->daddr : key->saddr;
+
+	if (key->family == AF_INET) {
+		struct lpm_v4_key lpm = { .prefixlen = 8 + 32, .dir = dir };
+
+		__builtin_memcpy(lpm.addr, addr, sizeof(lpm.addr));
+		return bpf_map_lookup_elem(&filter_v4, &lpm);
+	} else {
+		struct lpm_v6_key lpm = { .prefixlen = 8 + 128, .dir = dir };
+
+		__builtin_memcpy(lpm.addr, addr, sizeof(lpm.addr));
+		return bpf_map_lookup_elem(&filter_v6, &lpm);
+	}
+}
+
+static __always_inline __u32 filter_action(const struct flow_key *key,
+					   bool is_ip)
+{
+	__u32 zero = 0;
+	__u32 *action;
+
+	if (is_ip) {
+		action = bpf_map_lookup_elem(&filter_flows, key);
+		if (!action)
+			action = lookup_prefix(key, XDP_FILTER_DST);
+		if (!action)
+			action = lookup_prefix(key, XDP_FILTER_SRC);
+		if (action)
+			return *action;
+	}
+
+	action = bpf_map_lookup_elem(&filter_default, &zero);
+	return action ? *action : XDP_FILTER_REDIRECT;
+}
+
+/* Puts the receive time in front of the packet for userspace to measure
+ * how long it sat in the RX ring. Drivers without metadata support fail
+ * bpf_xdp_adjust_meta() and the packet goes up without it. */
+static __always_inline void write_rx_meta(struct xdp_md *ctx)
+{
+	struct xdp_rx_meta *meta;
+	void *data;
+	__u64 timestamp = 0;
+	__u32 flags = 0;
+
+#ifdef XDP_RX_HW_TIMESTAMP
+	if (!bpf_xdp_metadata_rx_timestamp(ctx, &timestamp) && timestamp)
+		flags = XDP_RX_META_HW_TIMESTAMP;
+#endif
+	if (!flags)
+		timestamp = bpf_ktime_get_ns();
+
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+		return;
+
+	meta = (void *)(long)ctx->data_meta;
+	data = (void *)(long)ctx->data;
+	if ((void *)(meta + 1) > data)
+		return;
+
+	meta->timestamp = timestamp;
+	meta->flags = flags;
+	meta->magic = XDP_RX_META_MAGIC;
+}
+
+static __always_inline int steer_to_socket(struct xdp_md *ctx)
+{
+    struct flow_key flow = {};
+    __u32 key = ctx->rx_queue_index * socks_per_queue;
+    bool is_ip;
+
+    /* Only traffic userspace asked for crosses into AF_XDP */
+    is_ip = parse_flow(ctx, &flow);
+    switch (filter_action(&flow, is_ip)) {
+    case XDP_FILTER_PASS:
+        return xdp_stats_record_action(ctx, XDP_PASS);
+    case XDP_FILTER_DROP:
+        return xdp_stats_record_action(ctx, XDP_DROP);
     }
 
+    /* Spread the queue over its sockets by flow, so every packet of a
+     * flow is seen by the same consumer */
+    if (socks_per_queue > 1)
+        key += flow_hash(&flow) % socks_per_queue;
+
     /* A set entry here means that the correspnding queue_id
      * has an active AF_XDP socket bound to it. */
-    if (bpf_map_lookup_elem(&xsks_map, &index))
-        return bpf_redirect_map(&xsks_map, index, 0);
+    if (bpf_map_lookup_elem(&xsks_map, &key)) {
+        write_rx_meta(ctx);
+        return xdp_stats_record_action(ctx, bpf_redirect_map(&xsks_map, key, 0));
+    }
 
-    return XDP_PASS;
+    return xdp_stats_record_action(ctx, XDP_PASS);
+}
+
+SEC("xdp")
+int xdp_sock_prog(struct xdp_md *ctx)
+{
+	return steer_to_socket(ctx);
+}
+
+/* The same program flagged as multi-buffer aware, for interfaces with an
+ * MTU above what fits a single buffer. The driver hands it jumbo frames as
+ * a head buffer plus fragments, and everything parsed is in the head. The
+ * sockets must be bound with XDP_USE_SG to take such packets. */
+SEC("xdp.frags")
+int xdp_sock_prog_frags(struct xdp_md *ctx)
+{
+	return steer_to_socket(ctx);
 }
 
-char _license[] SEC("license") = "GPL";
\ No newline at end of file
+char _license[] SEC("license") = "GPL";
@@ -19,6 +19,7 @@
 #include <sys/resource.h>
 
 #include <bpf/bpf.h>
+#include <bpf/bpf_endian.h>
 #include <xdp/xsk.h>
 #include <xdp/libxdp.h>
 
@@ -30,19 +31,41 @@
 #include <linux/icmpv6.h>
 
 #include "common/common_params.h"
+#include "common/parsing_helpers.h"
+#include "common/checksum.h"
 #include "common/common_user_bpf_xdp.h"
 #include "common/common_libbpf.h"
+#include "common/umem_alloc.h"
+#include "common/stats_exporter.h"
+#include "common/latency_hist.h"
+#include "common/xdp_meta_kern_user.h"
+#include "common/xsk_uring.h"
+#include "common/xsk_busy_poll.h"
 
 #define NUM_FRAMES         4096
 #define FRAME_SIZE         XSK_UMEM__DEFAULT_FRAME_SIZE
 #define RX_BATCH_SIZE      64
 #define INVALID_UMEM_FRAME UINT64_MAX
+#define STATS_INTERVAL_MS  1000
+
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
+#ifndef XDP_PKT_CONTD
+#define XDP_PKT_CONTD (1 << 0)
+#endif
 
 static struct xdp_program *prog;
 int xsk_map_fd;
 bool custom_xsk = false;
 struct config cfg = {
 	.ifindex   = -1,
+	.umem_num_frames = NUM_FRAMES,
+	.umem_frame_size = FRAME_SIZE,
+	.udp_echo_port = 7,
 };
 
 struct xsk_umem_info {
@@ -50,27 +73,36 @@ struct xsk_umem_info {
 	struct xsk_ring_cons cq;
 	struct xsk_umem *umem;
 	void *buffer;
+	uint32_t num_frames;
+	uint32_t frame_size;
 };
+/* Written only by the thread servicing the socket and read by stats_poll().
+ * Counters are updated and read as relaxed atomics so the reader never sees
+ * a torn value, and the record has its own cache lines so the reader
+ * doesn't steal the ring state the RX thread is working on. timestamp is
+ * only set in the reader's snapshots.
+ */
 struct stats_record {
 	uint64_t timestamp;
 	uint64_t rx_packets;
 	uint64_t rx_bytes;
 	uint64_t tx_packets;
 	uint64_t tx_bytes;
-};
+	uint64_t tx_dropped;
+} __attribute__((aligned(64)));
 struct xsk_socket_info {
 	struct xsk_ring_cons rx;
 	struct xsk_ring_prod tx;
 	struct xsk_umem_info *umem;
 	struct xsk_socket *xsk;
 
-	uint64_t umem_frame_addr[NUM_FRAMES];
+	uint64_t *umem_frame_addr;
 	uint32_t umem_frame_free;
 
 	uint32_t outstanding_tx;
 
 	struct stats_record stats;
-	struct stats_record prev_stats;
+	struct latency_hist latency;
 };
 
 static inline __u32 xsk_ring_prod__free(struct xsk_ring_prod *r)
@@ -113,9 +145,50 @@ static const struct option_wrapper long_options[] = {
 	{{"poll-mode",	 no_argument,		NULL, 'p' },
 	 "Use the poll() API waiting for packets to arrive"},
 
+	{{"busy-poll",	 no_argument,		NULL,  9  },
+	 "Use preferred busy polling (set napi_defer_hard_irqs/gro_flush_timeout)"},
+
+	{{"uring",	 no_argument,		NULL,  16 },
+	 "Wait and kick the kernel through io_uring instead of poll()/sendto() (Linux 5.13+)"},
+
+	{{"multi-buffer", no_argument,		NULL,  17 },
+	 "Take packets bigger than a frame as descriptor chains (Linux 6.6+, load the xdp.frags program)"},
+
 	{{"quiet",	 no_argument,		NULL, 'q' },
 	 "Quiet mode (no output)"},
 
+	{{"frames",	 required_argument,	NULL,  7  },
+	 "Number of UMEM frames, default=4096", "<num>"},
+
+	{{"frame-size",	 required_argument,	NULL,  8  },
+	 "UMEM frame size (2048 or 4096), default=4096", "<bytes>"},
+
+	{{"reflect",	 no_argument,		NULL,  5  },
+	 "Answer ICMPv4/ICMPv6 echo and UDP echo requests"},
+
+	{{"udp-echo-port", required_argument,	NULL,  6  },
+	 "UDP port answered in --reflect mode, default=7", "<port>"},
+
+	{{"filter",	 required_argument,	NULL,  10 },
+	 "Add a flow filter rule (needs --filename), e.g. \"redirect dst 10.0.0.0/8\" or "
+	 "\"drop flow udp 10.0.0.1 53 10.0.0.2 1024\"", "<rule>"},
+
+	{{"filter-default", required_argument,	NULL,  11 },
+	 "Action for traffic no filter rule matches: redirect (default), pass or drop", "<action>"},
+
+	{{"stats-socket", required_argument,	NULL,  12 },
+	 "Serve XDP action counters in Prometheus format on Unix socket <path> (needs --filename)", "<path>"},
+
+	{{"stats-json",	 required_argument,	NULL,  13 },
+	 "Append XDP action counters as JSON lines to <file>, - for stdout (needs --filename)", "<file>"},
+
+	{{"rx-latency",	 no_argument,		NULL,  14 },
+	 "Measure how long packets wait in the RX ring (needs --filename af_xdp_kern.o)"},
+
+	{{"hw-timestamp", no_argument,		NULL,  15 },
+	 "Bind the program to the device for NIC RX timestamps (af_xdp_kern_hwts.o, "
+	 "set LIBXDP_SKIP_DISPATCHER=1)"},
+
 	{{"filename",    required_argument,	NULL,  1  },
 	 "Load program from <file>", "<file>"},
 
@@ -126,9 +199,22 @@ static const struct option_wrapper long_options[] = {
 };
 
 static bool global_exit;
-
-static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size)
+/* Set while rx_and_process_uring() runs, the kicks then go through it */
+static struct xsk_uring *uring;
+/* Set by --stats-socket/--stats-json, stopped on the way out */
+static struct xdp_stats_exporter *stats_exporter;
+static FILE *stats_json;
+
+static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size,
+						uint32_t frame_size)
 {
+	struct xsk_umem_config umem_cfg = {
+		.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.frame_size = frame_size,
+		.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+		.flags = XSK_UMEM__DEFAULT_FLAGS,
+	};
 	struct xsk_umem_info *umem;
 	int ret;
 
@@ -137,13 +223,15 @@ static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size)
 		return NULL;
 
 	ret = xsk_umem__create(&umem->umem, buffer, size, &umem->fq, &umem->cq,
-			       NULL);
+			       &umem_cfg);
 	if (ret) {
 		errno = -ret;
 		return NULL;
 	}
 
 	umem->buffer = buffer;
+	umem->num_frames = size / frame_size;
+	umem->frame_size = frame_size;
 	return umem;
 }
 
@@ -160,7 +248,7 @@ static uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk)
 
 static void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame)
 {
-	assert(xsk->umem_frame_free < NUM_FRAMES);
+	assert(xsk->umem_frame_free < xsk->umem->num_frames);
 
 	xsk->umem_frame_addr[xsk->umem_frame_free++] = frame;
 }
@@ -176,13 +264,21 @@ static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
 	struct xsk_socket_config xsk_cfg;
 	struct xsk_socket_info *xsk_info;
 	uint32_t idx;
+	uint32_t fill_size;
 	int i;
 	int ret;
 	uint32_t prog_id;
 
-	xsk_info = calloc(1, sizeof(*xsk_info));
+	/* The stats record must really get its own cache lines */
+	xsk_info = aligned_alloc(__alignof__(*xsk_info), sizeof(*xsk_info));
 	if (!xsk_info)
 		return NULL;
+	memset(xsk_info, 0, sizeof(*xsk_info));
+
+	xsk_info->umem_frame_addr = calloc(umem->num_frames,
+					   sizeof(*xsk_info->umem_frame_addr));
+	if (!xsk_info->umem_frame_addr)
+		return NULL;
 
 	xsk_info->umem = umem;
 	xsk_cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
@@ -196,6 +292,14 @@ static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
 	if (ret)
 		goto error_exit;
 
+	if (cfg->xsk_busy_poll) {
+		/* A budget of one RX batch per busy poll */
+		ret = xsk_enable_busy_poll(xsk_socket__fd(xsk_info->xsk),
+					   RX_BATCH_SIZE);
+		if (ret)
+			goto error_exit;
+	}
+
 	if (custom_xsk) {
 		ret = xsk_socket__update_xskmap(xsk_info->xsk, xsk_map_fd);
 		if (ret)
@@ -207,25 +311,27 @@ static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
 	}
 
 	/* Initialize umem frame allocation */
-	for (i = 0; i < NUM_FRAMES; i++)
-		xsk_info->umem_frame_addr[i] = i * FRAME_SIZE;
+	for (i = 0; i < umem->num_frames; i++)
+		xsk_info->umem_frame_addr[i] = (uint64_t)i * umem->frame_size;
 
-	xsk_info->umem_frame_free = NUM_FRAMES;
+	xsk_info->umem_frame_free = umem->num_frames;
 
-	/* Stuff the receive path with buffers, we assume we have enough */
-	ret = xsk_ring_prod__reserve(&xsk_info->umem->fq,
-				     XSK_RING_PROD__DEFAULT_NUM_DESCS,
-				     &idx);
+	/* Stuff the receive path with buffers, as many as the ring and the
+	 * free frames allow */
+	fill_size = xsk_umem_free_frames(xsk_info);
+	if (fill_size > XSK_RING_PROD__DEFAULT_NUM_DESCS)
+		fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
 
-	if (ret != XSK_RING_PROD__DEFAULT_NUM_DESCS)
+	ret = xsk_ring_prod__reserve(&xsk_info->umem->fq, fill_size, &idx);
+
+	if (ret != fill_size)
 		goto error_exit;
 
-	for (i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS; i ++)
+	for (i = 0; i < fill_size; i++)
 		*xsk_ring_prod__fill_addr(&xsk_info->umem->fq, idx++) =
 			xsk_alloc_umem_frame(xsk_info);
 
-	xsk_ring_prod__submit(&xsk_info->umem->fq,
-			      XSK_RING_PROD__DEFAULT_NUM_DESCS);
+	xsk_ring_prod__submit(&xsk_info->umem->fq, fill_size);
 
 	return xsk_info;
 
@@ -234,6 +340,22 @@ error_exit:
 	return NULL;
 }
 
+/* With XDP_USE_NEED_WAKEUP the kernel flags the fill ring when it stopped
+ * processing it, only then does RX need a syscall. In busy-poll mode the
+ * syscall is what runs the driver, so it is always made.
+ */
+static void kick_rx(struct xsk_socket_info *xsk)
+{
+	if (!cfg.xsk_busy_poll && !xsk_ring_prod__needs_wakeup(&xsk->umem->fq))
+		return;
+
+	if (uring)
+		xsk_uring_kick_rx(uring, xsk_socket__fd(xsk->xsk));
+	else
+		recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT,
+			 NULL, NULL);
+}
+
 static void complete_tx(struct xsk_socket_info *xsk)
 {
 	unsigned int completed;
@@ -242,7 +364,13 @@ static void complete_tx(struct xsk_socket_info *xsk)
 	if (!xsk->outstanding_tx)
 		return;
 
-	sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+	if (cfg.xsk_busy_poll || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+		if (uring)
+			xsk_uring_kick_tx(uring, xsk_socket__fd(xsk->xsk));
+		else
+			sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT,
+			       NULL, 0);
+	}
 
 	/* Collect/free completed TX buffers */
 	completed = xsk_ring_cons__peek(&xsk->umem->cq,
@@ -261,99 +389,222 @@ static void complete_tx(struct xsk_socket_info *xsk)
 	}
 }
 
-static inline __sum16 csum16_add(__sum16 csum, __be16 addend)
+static void swap_mac(struct ethhdr *eth)
+{
+	uint8_t tmp_mac[ETH_ALEN];
+
+	memcpy(tmp_mac, eth->h_dest, ETH_ALEN);
+	memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, tmp_mac, ETH_ALEN);
+}
+
+/* Swapping addresses or ports leaves the IPv4 header checksum and the L4
+ * pseudo-header checksums unchanged, so only the echo type needs patching.
+ */
+static bool reflect_udp(struct hdr_cursor *nh, void *data_end)
 {
-	uint16_t res = (uint16_t)csum;
+	struct udphdr *udp;
+	__be16 tmp_port;
+
+	if (parse_udphdr(nh, data_end, &udp) < 0 ||
+	    udp->dest != htons(cfg.udp_echo_port))
+		return false;
 
-	res += (__u16)addend;
-	return (__sum16)(res + (res < (__u16)addend));
+	tmp_port = udp->source;
+	udp->source = udp->dest;
+	udp->dest = tmp_port;
+	return true;
 }
 
-static inline __sum16 csum16_sub(__sum16 csum, __be16 addend)
+static bool reflect_ipv6(struct hdr_cursor *nh, void *data_end)
 {
-	return csum16_add(csum, ~addend);
+	struct ipv6hdr *ipv6;
+	struct icmp6hdr *icmp;
+	struct in6_addr tmp_ip;
+	uint32_t icmp_len;
+
+	switch (parse_ip6hdr(nh, data_end, &ipv6)) {
+	case IPPROTO_ICMPV6:
+		if (parse_icmp6hdr(nh, data_end, &icmp) != ICMPV6_ECHO_REQUEST)
+			return false;
+
+		/* Only answer requests that arrived intact, RFC 4443 has
+		 * messages with a bad checksum silently discarded */
+		icmp_len = ntohs(ipv6->payload_len);
+		if ((void *)icmp + icmp_len > data_end ||
+		    ipv6_l4_csum(ipv6, icmp, icmp_len, IPPROTO_ICMPV6))
+			return false;
+
+		icmp->icmp6_type = ICMPV6_ECHO_REPLY;
+		csum_replace2(&icmp->icmp6_cksum,
+			      htons(ICMPV6_ECHO_REQUEST << 8),
+			      htons(ICMPV6_ECHO_REPLY << 8));
+		break;
+	case IPPROTO_UDP:
+		if (!reflect_udp(nh, data_end))
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	memcpy(&tmp_ip, &ipv6->saddr, sizeof(tmp_ip));
+	memcpy(&ipv6->saddr, &ipv6->daddr, sizeof(tmp_ip));
+	memcpy(&ipv6->daddr, &tmp_ip, sizeof(tmp_ip));
+	return true;
 }
 
-static inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new)
+static bool reflect_ipv4(struct hdr_cursor *nh, void *data_end)
 {
-	*sum = ~csum16_add(csum16_sub(~(*sum), old), new);
+	struct iphdr *ip;
+	struct icmphdr *icmp;
+	__be32 tmp_ip;
+
+	switch (parse_iphdr(nh, data_end, &ip)) {
+	case IPPROTO_ICMP:
+		if (parse_icmphdr(nh, data_end, &icmp) != ICMP_ECHO)
+			return false;
+
+		icmp->type = ICMP_ECHOREPLY;
+		csum_replace2(&icmp->checksum,
+			      htons(ICMP_ECHO << 8),
+			      htons(ICMP_ECHOREPLY << 8));
+		break;
+	case IPPROTO_UDP:
+		if (!reflect_udp(nh, data_end))
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	tmp_ip = ip->saddr;
+	ip->saddr = ip->daddr;
+	ip->daddr = tmp_ip;
+	return true;
 }
 
+/* Rewrites an ICMPv6/ICMPv4 echo request or a UDP packet to the echo port
+ * into its reply in place. Returns true if the frame should be sent back out
+ * of the receive port.
+ */
 static bool process_packet(struct xsk_socket_info *xsk,
 			   uint64_t addr, uint32_t len)
 {
 	uint8_t *pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+	struct hdr_cursor nh = { .pos = pkt };
+	void *data_end = pkt + len;
+	struct ethhdr *eth;
+	bool reply = false;
+	int eth_type;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IPV6))
+		reply = reflect_ipv6(&nh, data_end);
+	else if (eth_type == bpf_htons(ETH_P_IP))
+		reply = reflect_ipv4(&nh, data_end);
+
+	if (reply)
+		swap_mac(eth);
+
+	return reply;
+}
 
-    /* Lesson#3: Write an IPv6 ICMP ECHO parser to send responses
-	 *
-	 * Some assumptions to make it easier:
-	 * - No VLAN handling
-	 * - Only if nexthdr is ICMP
-	 * - Just return all data with MAC/IP swapped, and type set to
-	 *   ICMPV6_ECHO_REPLY
-	 * - Recalculate the icmp checksum */
-
-	if (false) {
-		int ret;
-		uint32_t tx_idx = 0;
-		uint8_t tmp_mac[ETH_ALEN];
-		struct in6_addr tmp_ip;
-		struct ethhdr *eth = (struct ethhdr *) pkt;
-		struct ipv6hdr *ipv6 = (struct ipv6hdr *) (eth + 1);
-		struct icmp6hdr *icmp = (struct icmp6hdr *) (ipv6 + 1);
-
-		if (ntohs(eth->h_proto) != ETH_P_IPV6 ||
-		    len < (sizeof(*eth) + sizeof(*ipv6) + sizeof(*icmp)) ||
-		    ipv6->nexthdr != IPPROTO_ICMPV6 ||
-		    icmp->icmp6_type != ICMPV6_ECHO_REQUEST)
-			return false;
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+			 __ATOMIC_RELAXED);
+}
 
-		memcpy(tmp_mac, eth->h_dest, ETH_ALEN);
-		memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
-		memcpy(eth->h_source, tmp_mac, ETH_ALEN);
+/* Queue all replies of one RX batch with a single TX reserve/submit. The
+ * kernel is then kicked once for the whole batch by complete_tx(). A reply
+ * to a multi-buffer packet is its chain of descriptors, the continuation
+ * flags kept.
+ */
+static void transmit_batch(struct xsk_socket_info *xsk,
+			   const struct xdp_desc *descs, unsigned int nb)
+{
+	uint32_t tx_idx = 0;
+	uint64_t bytes = 0;
+	unsigned int i, packets = 0;
+
+	if (xsk_ring_prod__reserve(&xsk->tx, nb, &tx_idx) != nb) {
+		/* No more transmit slots, drop the batch */
+		for (i = 0; i < nb; i++)
+			xsk_free_umem_frame(xsk, descs[i].addr);
+		stats_add(&xsk->stats.tx_dropped, nb);
+		return;
+	}
 
-		memcpy(&tmp_ip, &ipv6->saddr, sizeof(tmp_ip));
-		memcpy(&ipv6->saddr, &ipv6->daddr, sizeof(tmp_ip));
-		memcpy(&ipv6->daddr, &tmp_ip, sizeof(tmp_ip));
+	for (i = 0; i < nb; i++) {
+		struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&xsk->tx,
+								  tx_idx++);
 
-		icmp->icmp6_type = ICMPV6_ECHO_REPLY;
+		tx_desc->addr = descs[i].addr;
+		tx_desc->len = descs[i].len;
+		tx_desc->options = descs[i].options & XDP_PKT_CONTD;
+		bytes += descs[i].len;
+		packets += !(descs[i].options & XDP_PKT_CONTD);
+	}
 
-		csum_replace2(&icmp->icmp6_cksum,
-			      htons(ICMPV6_ECHO_REQUEST << 8),
-			      htons(ICMPV6_ECHO_REPLY << 8));
+	xsk_ring_prod__submit(&xsk->tx, nb);
+	xsk->outstanding_tx += nb;
+	stats_add(&xsk->stats.tx_packets, packets);
+	stats_add(&xsk->stats.tx_bytes, bytes);
+}
 
-		/* Here we sent the packet out of the receive port. Note that
-		 * we allocate one entry and schedule it. Your design would be
-		 * faster if you do batch processing/transmission */
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec t;
 
-		ret = xsk_ring_prod__reserve(&xsk->tx, 1, &tx_idx);
-		if (ret != 1) {
-			/* No more transmit slots, drop the packet */
-			return false;
-		}
+	clock_gettime(clock, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
 
-		xsk_ring_prod__tx_desc(&xsk->tx, tx_idx)->addr = addr;
-		xsk_ring_prod__tx_desc(&xsk->tx, tx_idx)->len = len;
-		xsk_ring_prod__submit(&xsk->tx, 1);
-		xsk->outstanding_tx++;
+/* Records the time since the XDP program stamped the frame. Each frame's
+ * metadata is invalidated after reading, so a packet the program couldn't
+ * stamp isn't counted with a stale timestamp. NIC timestamps are compared
+ * with CLOCK_TAI, software ones with CLOCK_MONOTONIC. */
+static void record_rx_latency(struct xsk_socket_info *xsk, uint64_t addr,
+			      uint64_t *mono_now, uint64_t *tai_now)
+{
+	struct xdp_rx_meta *meta = (struct xdp_rx_meta *)
+		xsk_umem__get_data(xsk->umem->buffer, addr) - 1;
+	uint64_t now;
 
-		xsk->stats.tx_bytes += len;
-		xsk->stats.tx_packets++;
-		return true;
+	if (meta->magic != XDP_RX_META_MAGIC)
+		return;
+	meta->magic = 0;
+
+	if (meta->flags & XDP_RX_META_HW_TIMESTAMP) {
+		if (!*tai_now)
+			*tai_now = clock_ns(CLOCK_TAI);
+		now = *tai_now;
+	} else {
+		if (!*mono_now)
+			*mono_now = clock_ns(CLOCK_MONOTONIC);
+		now = *mono_now;
 	}
 
-	return false;
+	latency_hist_record(&xsk->latency,
+			    now > meta->timestamp ? now - meta->timestamp : 0);
 }
 
 static void handle_receive_packets(struct xsk_socket_info *xsk)
 {
-	unsigned int rcvd, stock_frames, i;
+	struct xdp_desc replies[RX_BATCH_SIZE];
+	unsigned int rcvd, stock_frames, i, f, nb_frags, nb_replies = 0;
+	unsigned int packets = 0;
 	uint32_t idx_rx = 0, idx_fq = 0;
+	uint64_t bytes = 0;
+	uint64_t mono_now = 0, tai_now = 0;
 	int ret;
 
 	rcvd = xsk_ring_cons__peek(&xsk->rx, RX_BATCH_SIZE, &idx_rx);
-	if (!rcvd)
+	if (!rcvd) {
+		kick_rx(xsk);
 		return;
+	}
 
 	/* Stuff the ring with as much frames as possible */
 	stock_frames = xsk_prod_nb_free(&xsk->umem->fq,
@@ -365,9 +616,11 @@ static void handle_receive_packets(struct xsk_socket_info *xsk)
 					     &idx_fq);
 
 		/* This should not happen, but just in case */
-		while (ret != stock_frames)
-			ret = xsk_ring_prod__reserve(&xsk->umem->fq, rcvd,
+		while (ret != stock_frames) {
+			kick_rx(xsk);
+			ret = xsk_ring_prod__reserve(&xsk->umem->fq, stock_frames,
 						     &idx_fq);
+		}
 
 		for (i = 0; i < stock_frames; i++)
 			*xsk_ring_prod__fill_addr(&xsk->umem->fq, idx_fq++) =
@@ -376,23 +629,100 @@ static void handle_receive_packets(struct xsk_socket_info *xsk)
 		xsk_ring_prod__submit(&xsk->umem->fq, stock_frames);
 	}
 
-	/* Process received packets */
-	for (i = 0; i < rcvd; i++) {
-		uint64_t addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
-		uint32_t len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
+	/* Process received packets. A packet bigger than a frame is a chain of
+	 * descriptors, all but the last flagged XDP_PKT_CONTD. It is parsed in
+	 * its first buffer, which holds the headers, and echoed as a chain.
+	 */
+	for (i = 0; i < rcvd; i += nb_frags) {
+		const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx + i);
+		uint64_t addr = desc->addr;
+		uint32_t len = desc->len;
+		uint32_t pkt_len = len;
+
+		for (nb_frags = 1; (desc->options & XDP_PKT_CONTD) && i + nb_frags < rcvd; nb_frags++) {
+			desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx + i + nb_frags);
+			pkt_len += desc->len;
+		}
+
+		/* The rest of the chain is behind the peeked batch, read
+		 * the packet whole next time */
+		if (desc->options & XDP_PKT_CONTD)
+			break;
 
-		if (!process_packet(xsk, addr, len))
-			xsk_free_umem_frame(xsk, addr);
+		/* One clock read per batch, the latency is that of the batch */
+		if (cfg.rx_latency)
+			record_rx_latency(xsk, addr, &mono_now, &tai_now);
 
-		xsk->stats.rx_bytes += len;
+		if (cfg.xsk_reflect && process_packet(xsk, addr, len)) {
+			for (f = 0; f < nb_frags; f++)
+				replies[nb_replies++] = *xsk_ring_cons__rx_desc(&xsk->rx, idx_rx + i + f);
+		} else {
+			for (f = 0; f < nb_frags; f++)
+				xsk_free_umem_frame(xsk, xsk_ring_cons__rx_desc(&xsk->rx, idx_rx + i + f)->addr);
+		}
+
+		bytes += pkt_len;
+		packets++;
 	}
 
-	xsk_ring_cons__release(&xsk->rx, rcvd);
-	xsk->stats.rx_packets += rcvd;
+	if (i < rcvd)
+		xsk_ring_cons__cancel(&xsk->rx, rcvd - i);
+	xsk_ring_cons__release(&xsk->rx, i);
+	stats_add(&xsk->stats.rx_packets, packets);
+	stats_add(&xsk->stats.rx_bytes, bytes);
+
+	if (nb_replies)
+		transmit_batch(xsk, replies, nb_replies);
 
 	/* Do we need to wake up the kernel for transmission */
 	complete_tx(xsk);
-  }
+}
+
+/* The loop below on an io_uring. The socket's multishot poll is armed
+ * once and the kicks handle_receive_packets() queues go to the kernel with
+ * the wait, so an iteration makes at most one io_uring_enter() and none
+ * while packets keep arriving without kicks. Returns false when there is
+ * no usable io_uring, before touching the socket. */
+static bool rx_and_process_uring(struct config *cfg,
+				 struct xsk_socket_info *xsk_socket)
+{
+	struct xsk_uring ring;
+	uint32_t token;
+	int err, timeout;
+
+	err = xsk_uring_init(&ring, XSK_URING_ENTRIES);
+	if (err) {
+		fprintf(stderr, "ERR: io_uring setup failed \"%s\", falling back to poll\n",
+			strerror(-err));
+		return false;
+	}
+
+	if (!xsk_uring_add_socket(&ring, xsk_socket__fd(xsk_socket->xsk), 0)) {
+		fprintf(stderr, "ERR: io_uring poll failed, falling back to poll\n");
+		xsk_uring_destroy(&ring);
+		return false;
+	}
+
+	uring = &ring;
+
+	while (!global_exit) {
+		handle_receive_packets(xsk_socket);
+
+		/* In poll mode, sleep once the RX ring is drained */
+		timeout = cfg->xsk_poll_mode &&
+			  !xsk_cons_nb_avail(&xsk_socket->rx, 1) ? -1 : 0;
+		err = xsk_uring_wait(&ring, &token, 1, timeout);
+		if (err < 0) {
+			fprintf(stderr, "ERR: io_uring wait failed \"%s\"\n",
+				strerror(-err));
+			break;
+		}
+	}
+
+	uring = NULL;
+	xsk_uring_destroy(&ring);
+	return true;
+}
 
 static void rx_and_process(struct config *cfg,
 			   struct xsk_socket_info *xsk_socket)
@@ -400,6 +730,9 @@ static void rx_and_process(struct config *cfg,
 	struct pollfd fds[2];
 	int ret, nfds = 1;
 
+	if (cfg->xsk_uring && rx_and_process_uring(cfg, xsk_socket))
+		return;
+
 	memset(fds, 0, sizeof(fds));
 	fds[0].fd = xsk_socket__fd(xsk_socket->xsk);
 	fds[0].events = POLLIN;
@@ -440,8 +773,43 @@ static double calc_period(struct stats_record *r, struct stats_record *p)
 	return period_;
 }
 
+static void stats_read(const struct stats_record *stats,
+		       struct stats_record *snapshot)
+{
+	snapshot->timestamp  = gettime();
+	snapshot->rx_packets = __atomic_load_n(&stats->rx_packets, __ATOMIC_RELAXED);
+	snapshot->rx_bytes   = __atomic_load_n(&stats->rx_bytes, __ATOMIC_RELAXED);
+	snapshot->tx_packets = __atomic_load_n(&stats->tx_packets, __ATOMIC_RELAXED);
+	snapshot->tx_bytes   = __atomic_load_n(&stats->tx_bytes, __ATOMIC_RELAXED);
+	snapshot->tx_dropped = __atomic_load_n(&stats->tx_dropped, __ATOMIC_RELAXED);
+}
+
+/* The kernel's view of the socket: packets it couldn't deliver because
+ * the RX ring was full or the fill ring empty, and bad descriptors */
+static void xsk_kernel_stats_read(struct xsk_socket_info *xsk,
+				  struct xdp_statistics *stats)
+{
+	socklen_t optlen = sizeof(*stats);
+
+	if (getsockopt(xsk_socket__fd(xsk->xsk), SOL_XDP, XDP_STATISTICS,
+		       stats, &optlen))
+		memset(stats, 0, sizeof(*stats));
+}
+
+static void latency_print(const struct latency_hist *latency)
+{
+	printf("%-12s p50 %'lu ns p99 %'lu ns p99.9 %'lu ns max %'lu ns (%'lu samples)\n",
+	       "    Latency:",
+	       latency_hist_percentile(latency, 50),
+	       latency_hist_percentile(latency, 99),
+	       latency_hist_percentile(latency, 99.9),
+	       latency->max, latency->count);
+}
+
 static void stats_print(struct stats_record *stats_rec,
-			struct stats_record *stats_prev)
+			struct stats_record *stats_prev,
+			struct xdp_statistics *xdp_rec,
+			struct xdp_statistics *xdp_prev)
 {
 	uint64_t packets, bytes;
 	double period;
@@ -476,6 +844,19 @@ static void stats_print(struct stats_record *stats_rec,
 	       stats_rec->tx_bytes / 1000 , bps,
 	       period);
 
+	/* Where packets are lost: in the kernel before the RX ring (no fill
+	 * frames, RX ring full), or in this program (TX ring full) */
+	printf("%-12s rx ring full %'lld fill ring empty %'lld dropped %'lld"
+	       " invalid rx/tx %'lld/%'lld tx ring empty %'lld app tx dropped %'lld\n",
+	       "       Loss:",
+	       xdp_rec->rx_ring_full - xdp_prev->rx_ring_full,
+	       xdp_rec->rx_fill_ring_empty_descs - xdp_prev->rx_fill_ring_empty_descs,
+	       xdp_rec->rx_dropped - xdp_prev->rx_dropped,
+	       xdp_rec->rx_invalid_descs - xdp_prev->rx_invalid_descs,
+	       xdp_rec->tx_invalid_descs - xdp_prev->tx_invalid_descs,
+	       xdp_rec->tx_ring_empty_descs - xdp_prev->tx_ring_empty_descs,
+	       (__u64)(stats_rec->tx_dropped - stats_prev->tx_dropped));
+
 	printf("\n");
 }
 
@@ -484,21 +865,137 @@ static void *stats_poll(void *arg)
 	unsigned int interval = 2;
 	struct xsk_socket_info *xsk = arg;
 	static struct stats_record previous_stats = { 0 };
+	static struct latency_hist previous_latency, latency, latency_delta;
+	struct stats_record stats;
+	struct xdp_statistics previous_xdp, xdp;
 
-	previous_stats.timestamp = gettime();
+	stats_read(&xsk->stats, &previous_stats);
+	xsk_kernel_stats_read(xsk, &previous_xdp);
 
 	/* Trick to pretty printf with thousands separators use %' */
 	setlocale(LC_NUMERIC, "en_US");
 
 	while (!global_exit) {
 		sleep(interval);
-		xsk->stats.timestamp = gettime();
-		stats_print(&xsk->stats, &previous_stats);
-		previous_stats = xsk->stats;
+		stats_read(&xsk->stats, &stats);
+		xsk_kernel_stats_read(xsk, &xdp);
+		stats_print(&stats, &previous_stats, &xdp, &previous_xdp);
+		previous_stats = stats;
+		previous_xdp = xdp;
+
+		if (cfg.rx_latency) {
+			latency_hist_snapshot(&xsk->latency, &latency);
+			latency_hist_delta(&latency, &previous_latency, &latency_delta);
+			latency_print(&latency_delta);
+			previous_latency = latency;
+		}
 	}
 	return NULL;
 }
 
+/* The RX metadata kfuncs only resolve in programs loaded for the device
+ * they run on */
+static int bind_to_device(struct xdp_program *xdp_prog)
+{
+	struct bpf_program *bpf_prog;
+	int err;
+
+	bpf_object__for_each_program(bpf_prog, xdp_program__bpf_obj(xdp_prog)) {
+		err = bpf_program__set_ifindex(bpf_prog, cfg.ifindex);
+		if (!err)
+			err = bpf_program__set_flags(bpf_prog,
+						     bpf_program__flags(bpf_prog) |
+						     BPF_F_XDP_DEV_BOUND_ONLY);
+		if (err) {
+			fprintf(stderr, "ERR: can't bind program to %s: %s\n",
+				cfg.ifname, strerror(-err));
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/* Installs the --filter rules, without any everything still goes to the
+ * AF_XDP socket */
+static int configure_filter(struct bpf_object *obj)
+{
+	struct xdp_filter filter;
+	int action, err, i;
+
+	if (xdp_filter_open(obj, &filter))
+		return -ENOENT;
+
+	if (cfg.filter_default) {
+		action = xdp_filter_parse_action(cfg.filter_default);
+		if (action < 0) {
+			fprintf(stderr, "ERROR: unknown filter action '%s'\n",
+				cfg.filter_default);
+			return action;
+		}
+
+		err = xdp_filter_set_default(&filter, action);
+		if (err) {
+			fprintf(stderr, "ERROR: can't set default filter action: %s\n",
+				strerror(-err));
+			return err;
+		}
+	}
+
+	for (i = 0; i < cfg.num_filter_rules; i++) {
+		err = xdp_filter_add_rule(&filter, cfg.filter_rules[i]);
+		if (err) {
+			fprintf(stderr, "ERROR: bad filter rule '%s': %s\n",
+				cfg.filter_rules[i], strerror(-err));
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int start_stats_exporter(struct bpf_object *obj)
+{
+	struct bpf_map *map;
+
+	if (!cfg.stats_socket && !cfg.stats_json)
+		return 0;
+
+	map = bpf_object__find_map_by_name(obj, "xdp_stats_map");
+	if (!map) {
+		fprintf(stderr, "ERROR: no xdp_stats_map found\n");
+		return -ENOENT;
+	}
+
+	if (cfg.stats_json) {
+		stats_json = strcmp(cfg.stats_json, "-") ? fopen(cfg.stats_json, "a") : stdout;
+		if (!stats_json) {
+			fprintf(stderr, "ERROR: can't open %s: %s\n",
+				cfg.stats_json, strerror(errno));
+			return -errno;
+		}
+	}
+
+	stats_exporter = xdp_stats_exporter_start(bpf_map__fd(map),
+						  STATS_INTERVAL_MS,
+						  cfg.stats_socket, stats_json);
+	if (!stats_exporter) {
+		fprintf(stderr, "ERROR: can't start stats exporter: %s\n",
+			strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void stop_stats_exporter(void)
+{
+	if (stats_exporter)
+		xdp_stats_exporter_stop(stats_exporter);
+	if (stats_json && stats_json != stdout)
+		fclose(stats_json);
+}
+
 static void exit_application(int signal)
 {
 	int err;
@@ -518,7 +1015,7 @@ int main(int argc, char **argv)
 {
 	int ret;
 	void *packet_buffer;
-	uint64_t packet_buffer_size;
+	uint64_t packet_buffer_size, packet_buffer_mapped;
 	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts);
 	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts, 0);
 	struct rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY};
@@ -567,6 +1064,9 @@ int main(int argc, char **argv)
 			return err;
 		}
 
+		if (cfg.xdp_hw_timestamp && bind_to_device(prog))
+			return EXIT_FAIL_BPF;
+
 		err = xdp_program__attach(prog, cfg.ifindex, cfg.attach_mode, 0);
 		if (err) {
 			libxdp_strerror(err, errmsg, sizeof(errmsg));
@@ -583,6 +1083,18 @@ int main(int argc, char **argv)
 				strerror(xsk_map_fd));
 			exit(EXIT_FAILURE);
 		}
+
+		if (configure_filter(xdp_program__bpf_obj(prog)))
+			exit(EXIT_FAILURE);
+
+		if (start_stats_exporter(xdp_program__bpf_obj(prog)))
+			exit(EXIT_FAILURE);
+	} else if (cfg.num_filter_rules || cfg.filter_default) {
+		fprintf(stderr, "ERROR: --filter needs a program with filter maps (--filename)\n");
+		return EXIT_FAIL_OPTION;
+	} else if (cfg.stats_socket || cfg.stats_json) {
+		fprintf(stderr, "ERROR: --stats-socket/--stats-json need a program with xdp_stats_map (--filename)\n");
+		return EXIT_FAIL_OPTION;
 	}
 
 	/* Allow unlimited locking of memory, so all memory needed for packet
@@ -594,25 +1106,40 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	/* Allocate memory for NUM_FRAMES of the default XDP frame size */
-	packet_buffer_size = NUM_FRAMES * FRAME_SIZE;
-	if (posix_memalign(&packet_buffer,
-			   getpagesize(), /* PAGE_SIZE aligned */
-			   packet_buffer_size)) {
+	/* The fill ring is stocked from the frames, fewer would leave it
+	 * short */
+	if (cfg.umem_num_frames < XSK_RING_PROD__DEFAULT_NUM_DESCS) {
+		fprintf(stderr, "ERROR: --frames must be at least the fill ring size (%u)\n",
+			XSK_RING_PROD__DEFAULT_NUM_DESCS);
+		return EXIT_FAIL_OPTION;
+	}
+
+	/* Allocate the UMEM from hugepages on the NIC's NUMA node, prefaulted
+	 * so the first packets don't take page faults */
+	packet_buffer_size = (uint64_t)cfg.umem_num_frames * cfg.umem_frame_size;
+	packet_buffer = umem_buffer_alloc(packet_buffer_size,
+					  get_interface_numa_node(cfg.ifname),
+					  &packet_buffer_mapped);
+	if (!packet_buffer) {
 		fprintf(stderr, "ERROR: Can't allocate buffer memory \"%s\"\n",
 			strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
 	/* Initialize shared packet_buffer for umem usage */
-	umem = configure_xsk_umem(packet_buffer, packet_buffer_size);
+	umem = configure_xsk_umem(packet_buffer, packet_buffer_size,
+				  cfg.umem_frame_size);
 	if (umem == NULL) {
 		fprintf(stderr, "ERROR: Can't create umem \"%s\"\n",
 			strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	/* Open and configure the AF_XDP (xsk) socket */
+	/* Open and configure the AF_XDP (xsk) socket, only wake the kernel
+	 * up when it asks for it */
+	cfg.xsk_bind_flags |= XDP_USE_NEED_WAKEUP;
+	if (cfg.xsk_multi_buffer)
+		cfg.xsk_bind_flags |= XDP_USE_SG;
 	xsk_socket = xsk_configure_socket(&cfg, umem);
 	if (xsk_socket == NULL) {
 		fprintf(stderr, "ERROR: Can't setup AF_XDP socket \"%s\"\n",
@@ -635,8 +1162,10 @@ int main(int argc, char **argv)
 	rx_and_process(&cfg, xsk_socket);
 
 	/* Cleanup */
+	stop_stats_exporter();
 	xsk_socket__delete(xsk_socket->xsk);
 	xsk_umem__delete(umem->umem);
+	umem_buffer_free(packet_buffer, packet_buffer_mapped);
 
 	return EXIT_OK;
 }
\ No newline at end of file
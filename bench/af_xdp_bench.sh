@@ -0,0 +1,125 @@
+#!/bin/bash
+# Runs af_tx into af_rx over a veth pair between two private network
+# namespaces for every combination of the settings below and writes one CSV
+# row per run. Needs root and nothing but a kernel with AF_XDP and veth.
+#
+# Override any list from the environment, e.g.
+#   MODES="native" BATCHES="64 256" DURATION=10 ./bench/af_xdp_bench.sh out.csv
+# Combinations the kernel refuses (veth has no zero-copy) are recorded with
+# status "unsupported".
+
+set -u
+
+ROOT_DIR=$(cd "$(dirname "$0")/.." && pwd)
+AF_TX=${AF_TX:-$ROOT_DIR/af_tx}
+AF_RX=${AF_RX:-$ROOT_DIR/af_rx}
+OUTPUT=${1:-bench_results.csv}
+
+MODES=${MODES:-"skb native"}
+COPY_MODES=${COPY_MODES:-"copy zerocopy"}
+POLL_MODES=${POLL_MODES:-"poll busy"}
+BATCHES=${BATCHES:-"1 16 64 256"}
+RING_SIZES=${RING_SIZES:-"512 2048"}
+DURATION=${DURATION:-5}
+FRAMES=${FRAMES:-8192}
+
+NS_TX=afxdp_bench_tx
+NS_RX=afxdp_bench_rx
+VETH_TX=afxdp_tx0
+VETH_RX=afxdp_rx0
+
+cleanup()
+{
+    ip netns del $NS_TX 2>/dev/null
+    ip netns del $NS_RX 2>/dev/null
+}
+
+setup()
+{
+    cleanup
+    ip netns add $NS_TX || return 1
+    ip netns add $NS_RX || return 1
+    ip link add $VETH_TX netns $NS_TX type veth peer name $VETH_RX netns $NS_RX || return 1
+    ip -n $NS_TX link set dev $VETH_TX up
+    ip -n $NS_RX link set dev $VETH_RX up
+
+    # Native XDP redirect into a veth needs a program or GRO on the peer
+    ip netns exec $NS_RX ethtool -K $VETH_RX gro on >/dev/null 2>&1
+    return 0
+}
+
+# Prints the value of key from a "SUMMARY key=value ..." line
+field()
+{
+    sed -n "s/.*[ ]$2=\([^ ]*\).*/\1/p" <<< "$1"
+}
+
+run_one()
+{
+    local mode=$1 copy=$2 poll=$3 batch=$4 ring=$5
+    local flags=(-M "$mode")
+    local rx_log tx_log rx_summary tx_summary status=ok
+
+    [ "$copy" = zerocopy ] && flags+=(-Z)
+    [ "$poll" = busy ] && flags+=(-p)
+
+    setup || { echo "Can't create veth pair" >&2; exit 1; }
+
+    rx_log=$(mktemp)
+    tx_log=$(mktemp)
+
+    ip netns exec $NS_RX "$AF_RX" -n 1 -f $FRAMES -B "$batch" -R "$ring" -F "$ring" -T $((DURATION + 2)) \
+        -i $((DURATION + 2)) "${flags[@]}" $VETH_RX >"$rx_log" 2>&1 &
+    local rx_pid=$!
+
+    # Let the receiver attach before traffic starts
+    sleep 1
+    ip netns exec $NS_TX "$AF_TX" -r 0 -f $FRAMES -b "$batch" -t "$ring" -c "$ring" -T $DURATION \
+        "${flags[@]}" $VETH_TX >"$tx_log" 2>&1
+    wait $rx_pid
+
+    rx_summary=$(grep '^SUMMARY' "$rx_log")
+    tx_summary=$(grep '^SUMMARY' "$tx_log")
+    if [ -z "$rx_summary" ] || [ -z "$tx_summary" ]; then
+        status=unsupported
+        sed 's/^/  /' "$rx_log" "$tx_log" >&2
+    fi
+
+    echo "$mode,$copy,$poll,$batch,$ring,$status,$(field "$tx_summary" pps),$(field "$rx_summary" pps)," \
+         "$(field "$rx_summary" mbps),$(field "$tx_summary" cpu_ns_per_packet)," \
+         "$(field "$rx_summary" cpu_ns_per_packet),$(field "$rx_summary" rx_dropped)," \
+         "$(field "$rx_summary" rx_ring_full),$(field "$rx_summary" fill_ring_empty)," \
+         "$(field "$tx_summary" tx_invalid)" | tr -d ' ' >> "$OUTPUT"
+
+    rm -f "$rx_log" "$tx_log"
+    cleanup
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "$0 must run as root to create network namespaces" >&2
+    exit 1
+fi
+
+for tool in "$AF_TX" "$AF_RX"; do
+    [ -x "$tool" ] || { echo "$tool not built, run make first" >&2; exit 1; }
+done
+
+trap cleanup EXIT
+
+echo "mode,copy,poll,batch,ring,status,tx_pps,rx_pps,rx_mbps,tx_cpu_ns_per_packet,rx_cpu_ns_per_packet," \
+     "rx_dropped,rx_ring_full,fill_ring_empty,tx_invalid" | tr -d ' ' > "$OUTPUT"
+
+for mode in $MODES; do
+    for copy in $COPY_MODES; do
+        for poll in $POLL_MODES; do
+            for batch in $BATCHES; do
+                for ring in $RING_SIZES; do
+                    echo "$mode $copy $poll batch $batch ring $ring"
+                    run_one "$mode" "$copy" "$poll" "$batch" "$ring"
+                done
+            done
+        done
+    done
+done
+
+echo "Results in $OUTPUT"
@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <bpf/bpf_endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "../common/af_common.h"
+#include "../common/parsing_helpers.h"
+#include "../common/checksum.h"
+#include "../common/pkt_classify.h"
+#include "../common/xsk_encap.h"
+
+#define NS_PER_S 1000000000ULL
+#define DEFAULT_OPS 1000000
+#define DEFAULT_WARMUP_OPS 100000
+#define DEFAULT_REPETITIONS 11
+#define MAX_REPETITIONS 1000
+#define BENCH_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+#define BENCH_FILL_SIZE 2048
+/* Descriptors the simulated kernel takes off the fill ring between refills */
+#define BENCH_FILL_CONSUME 64
+#define BENCH_BULK_SIZE 64
+/* Bytes of each frame written and read back by the reuse benchmarks, about
+ * what building or parsing a small packet touches */
+#define BENCH_TOUCH_SIZE 256
+#define CSUM_WORDS 1024
+#define NUM_PACKETS 4
+/* Long enough a random mix that the branch predictor can't learn it */
+#define CLASSIFY_PACKETS 1024
+
+/* Everything the benchmarks work on: a UMEM-shaped buffer with its frame
+ * pool, a socket whose only live parts are its frame cache and a fill ring
+ * backed by plain memory, and a few prebuilt packets */
+struct bench_ctx
+{
+    struct xsk_socket_info *xsk;
+    struct xsk_umem_info umem;
+    uint32_t fq_producer;
+    uint32_t fq_consumer;
+    uint32_t fq_flags;
+    uint8_t *buffer;
+    uint32_t num_frames;
+    uint32_t frame_size;
+    __be16 csum_words[CSUM_WORDS];
+    uint8_t packets[NUM_PACKETS][128];
+    uint32_t packet_lens[NUM_PACKETS];
+    /* The same packets in random order over the first frames */
+    uint64_t classify_addrs[CLASSIFY_PACKETS];
+    uint32_t classify_lens[CLASSIFY_PACKETS];
+    struct pkt_batch batch;
+};
+
+struct microbench
+{
+    const char *name;
+    const char *description;
+    /* Performs ops operations, each the unit ns/op and cycles/op refer to */
+    void (*run)(struct bench_ctx *const ctx, const uint64_t ops);
+    /* Implementation the benchmark runs, for code with several */
+    bool (*select)(const char *const name);
+    const char *impl;
+};
+
+struct bench_result
+{
+    double ns_per_op[MAX_REPETITIONS];
+    double cycles_per_op[MAX_REPETITIONS];
+};
+
+static void _usage(const char *const prog_name);
+static bool _init_ctx(struct bench_ctx *const ctx, const uint32_t num_frames, const uint32_t frame_size);
+static void _build_packets(struct bench_ctx *const ctx);
+static void _run_bench(const struct microbench *const bench, struct bench_ctx *const ctx, const uint64_t ops,
+                       const uint64_t warmup_ops, const unsigned int repetitions);
+static int _cmp_double(const void *a, const void *b);
+static uint64_t _now_ns(void);
+static uint64_t _cycles(void);
+
+static void _bench_alloc_free(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_alloc_free_bulk(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_fill_fq(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_csum16_add(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_csum_replace2(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_parse(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_reuse_lifo(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_reuse_fifo(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_classify(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_csum_partial(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_encap_vlan(struct bench_ctx *const ctx, const uint64_t ops);
+static void _bench_encap_vxlan(struct bench_ctx *const ctx, const uint64_t ops);
+static struct xdp_desc _encap_desc(struct bench_ctx *const ctx);
+
+/* Results are folded in here so the compiler can't drop the work */
+static volatile uint64_t _sink;
+
+static const struct microbench benchmarks[] = {
+    {"alloc_free", "xsk_alloc_umem_frame + xsk_free_umem_frame", _bench_alloc_free},
+    {"alloc_free_bulk", "xsk_alloc_umem_frames + xsk_free_umem_frames, per frame", _bench_alloc_free_bulk},
+    {"fill_fq", "xsk_fill_fq refill after the kernel took 64 frames, per frame", _bench_fill_fq},
+    {"csum16_add", "csum16_add", _bench_csum16_add},
+    {"csum_replace2", "csum_replace2", _bench_csum_replace2},
+    {"parse", "parse_ethhdr + IPv4/IPv6 + UDP/TCP/ICMPv6, per packet", _bench_parse},
+    {"reuse_lifo", "frame cache alloc, touch, free: most recent frame first", _bench_reuse_lifo},
+    {"reuse_fifo", "frame pool get, touch, put: oldest frame first", _bench_reuse_fifo},
+    {"classify_scalar", "pkt_classify_batch of 64 packets one at a time, per packet", _bench_classify,
+     pkt_classify_select, "scalar"},
+    {"classify_sse2", "pkt_classify_batch with SSE2 lanes, per packet", _bench_classify, pkt_classify_select, "sse2"},
+    {"classify_avx2", "pkt_classify_batch with AVX2 gathers, per packet", _bench_classify, pkt_classify_select,
+     "avx2"},
+    {"csum_scalar", "csum_partial over a 1500 byte packet", _bench_csum_partial, csum_select, "scalar"},
+    {"csum_avx2", "csum_partial over a 1500 byte packet with AVX2", _bench_csum_partial, csum_select, "avx2"},
+    {"encap_vlan", "xsk_push_vlan + xsk_pop_vlan in place", _bench_encap_vlan},
+    {"encap_vxlan", "xsk_push_vxlan + xsk_pull_vxlan over IPv4 in place", _bench_encap_vxlan},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char *argv[])
+{
+    uint64_t ops = DEFAULT_OPS;
+    uint64_t warmup_ops = DEFAULT_WARMUP_OPS;
+    unsigned int repetitions = DEFAULT_REPETITIONS;
+    uint32_t num_frames = NUM_FRAMES;
+    uint32_t frame_size = BENCH_FRAME_SIZE;
+    int cpu = sched_getcpu();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:r:c:f:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            ops = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            warmup_ops = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'f':
+            num_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            frame_size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            _usage(argv[0]);
+        }
+    }
+
+    if (ops == 0 || repetitions == 0 || repetitions > MAX_REPETITIONS)
+    {
+        fprintf(stderr, "Need at least one op and between 1 and %u repetitions\n", MAX_REPETITIONS);
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_frames < 2 * BENCH_FILL_SIZE || frame_size < BENCH_TOUCH_SIZE)
+    {
+        fprintf(stderr, "Need at least %u frames of at least %u bytes\n", 2 * BENCH_FILL_SIZE, BENCH_TOUCH_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Migrations between repetitions would show up as noise, and the reuse
+     * benchmarks only mean something if the cache they warm stays ours */
+    if (cpu >= 0)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set))
+        {
+            fprintf(stderr, "Can't pin to CPU %d: %s\n", cpu, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct bench_ctx *const ctx = calloc(1, sizeof(*ctx));
+    if (!ctx || !_init_ctx(ctx, num_frames, frame_size))
+    {
+        fprintf(stderr, "Can't set up benchmark state: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("CPU %d, %lu ops x %u repetitions after %lu warmup ops, %u frames of %u bytes\n", cpu, ops, repetitions,
+           warmup_ops, num_frames, frame_size);
+#ifndef HAVE_TSC
+    printf("No TSC on this architecture, cycles/op not measured\n");
+#endif
+    printf("%-16s %10s %10s %10s %8s %10s  %s\n", "benchmark", "min ns/op", "med ns/op", "mean ns/op", "stddev",
+           "med cyc/op", "measures");
+
+    for (unsigned int i = 0; i < NUM_BENCHMARKS; i++)
+    {
+        bool selected = optind >= argc;
+
+        for (int arg = optind; arg < argc && !selected; arg++)
+            selected = strstr(benchmarks[i].name, argv[arg]) != NULL;
+
+        if (!selected)
+            continue;
+
+        if (benchmarks[i].select && !benchmarks[i].select(benchmarks[i].impl))
+            printf("%-16s not supported on this CPU\n", benchmarks[i].name);
+        else
+            _run_bench(&benchmarks[i], ctx, ops, warmup_ops, repetitions);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void _usage(const char *const prog_name)
+{
+    fprintf(stderr, "Usage: %s [-n ops_per_repetition] [-w warmup_ops] [-r repetitions] [-c cpu (-1 = no pinning)] "
+            "[-f num_frames] [-s frame_size] [benchmark ...]\n", prog_name);
+    exit(EXIT_FAILURE);
+}
+
+static bool _init_ctx(struct bench_ctx *const ctx, const uint32_t num_frames, const uint32_t frame_size)
+{
+    ctx->num_frames = num_frames;
+    ctx->frame_size = frame_size;
+
+    ctx->buffer = aligned_alloc(getpagesize(), (size_t)num_frames * frame_size);
+    uint64_t *const fill_ring = calloc(BENCH_FILL_SIZE, sizeof(*fill_ring));
+    ctx->xsk = aligned_alloc(CACHE_LINE_SIZE, sizeof(*ctx->xsk));
+    ctx->umem.pool = frame_pool_create(num_frames, frame_size);
+    if (!ctx->buffer || !fill_ring || !ctx->xsk || !ctx->umem.pool)
+        return false;
+
+    /* Fault the whole buffer in so first touches aren't page faults */
+    memset(ctx->buffer, 0, (size_t)num_frames * frame_size);
+
+    /* A producer ring laid out the way xsk_umem__create() leaves it: the
+     * cached consumer runs one ring size ahead of the real one */
+    ctx->umem.buffer = ctx->buffer;
+    ctx->umem.num_frames = num_frames;
+    ctx->umem.frame_size = frame_size;
+    ctx->umem.fq.producer = &ctx->fq_producer;
+    ctx->umem.fq.consumer = &ctx->fq_consumer;
+    ctx->umem.fq.flags = &ctx->fq_flags;
+    ctx->umem.fq.ring = fill_ring;
+    ctx->umem.fq.size = BENCH_FILL_SIZE;
+    ctx->umem.fq.mask = BENCH_FILL_SIZE - 1;
+    ctx->umem.fq.cached_cons = BENCH_FILL_SIZE;
+
+    memset(ctx->xsk, 0, sizeof(*ctx->xsk));
+    ctx->xsk->umem = &ctx->umem;
+    frame_cache_init(&ctx->xsk->frames, ctx->umem.pool);
+
+    srand(1);
+    for (unsigned int i = 0; i < CSUM_WORDS; i++)
+        ctx->csum_words[i] = rand();
+
+    _build_packets(ctx);
+    return true;
+}
+
+/* IPv4/UDP, IPv6/UDP, VLAN IPv4/TCP and IPv6/ICMPv6 echo */
+static void _build_packets(struct bench_ctx *const ctx)
+{
+    for (unsigned int i = 0; i < NUM_PACKETS; i++)
+    {
+        uint8_t *const pkt = ctx->packets[i];
+        struct ethhdr *const eth = (struct ethhdr *)pkt;
+        uint8_t *l3 = pkt + sizeof(*eth);
+        uint8_t l4_proto = i == 2 ? IPPROTO_TCP : i == 3 ? IPPROTO_ICMPV6 : IPPROTO_UDP;
+        const bool ipv6 = i == 1 || i == 3;
+        uint8_t *l4;
+
+        eth->h_proto = htons(ipv6 ? ETH_P_IPV6 : ETH_P_IP);
+        if (i == 2)
+        {
+            struct vlan_hdr *const vlan = (struct vlan_hdr *)l3;
+            eth->h_proto = htons(ETH_P_8021Q);
+            vlan->h_vlan_TCI = htons(100);
+            vlan->h_vlan_encapsulated_proto = htons(ETH_P_IP);
+            l3 += sizeof(*vlan);
+        }
+
+        if (ipv6)
+        {
+            struct ipv6hdr *const ip6 = (struct ipv6hdr *)l3;
+            ip6->version = 6;
+            ip6->nexthdr = l4_proto;
+            ip6->payload_len = htons(sizeof(struct tcphdr));
+            l4 = l3 + sizeof(*ip6);
+        }
+        else
+        {
+            struct iphdr *const ip = (struct iphdr *)l3;
+            ip->version = 4;
+            ip->ihl = sizeof(*ip) / 4;
+            ip->protocol = l4_proto;
+            ip->tot_len = htons(sizeof(*ip) + sizeof(struct tcphdr));
+            l4 = l3 + sizeof(*ip);
+        }
+
+        if (l4_proto == IPPROTO_UDP)
+            ((struct udphdr *)l4)->len = htons(sizeof(struct udphdr) + 12);
+        else if (l4_proto == IPPROTO_TCP)
+            ((struct tcphdr *)l4)->doff = sizeof(struct tcphdr) / 4;
+        else
+            ((struct icmp6hdr *)l4)->icmp6_type = ICMPV6_ECHO_REQUEST;
+
+        ctx->packet_lens[i] = l4 - pkt + sizeof(struct tcphdr);
+    }
+
+    for (unsigned int i = 0; i < CLASSIFY_PACKETS; i++)
+    {
+        const unsigned int p = rand() % NUM_PACKETS;
+
+        ctx->classify_addrs[i] = (uint64_t)i * ctx->frame_size;
+        ctx->classify_lens[i] = ctx->packet_lens[p];
+        memcpy(ctx->buffer + ctx->classify_addrs[i], ctx->packets[p], ctx->packet_lens[p]);
+    }
+}
+
+/* Times each repetition with both clocks and reports the spread. The median
+ * is the number to compare; min shows the best case with everything hot and
+ * stddev how much the machine got in the way. */
+static void _run_bench(const struct microbench *const bench, struct bench_ctx *const ctx, const uint64_t ops,
+                       const uint64_t warmup_ops, const unsigned int repetitions)
+{
+    static struct bench_result result;
+    double sum = 0;
+    double sum_sq = 0;
+
+    if (warmup_ops)
+        bench->run(ctx, warmup_ops);
+
+    for (unsigned int rep = 0; rep < repetitions; rep++)
+    {
+        const uint64_t start_ns = _now_ns();
+        const uint64_t start_cycles = _cycles();
+
+        bench->run(ctx, ops);
+
+        const uint64_t cycles = _cycles() - start_cycles;
+        const uint64_t ns = _now_ns() - start_ns;
+
+        result.ns_per_op[rep] = (double)ns / ops;
+        result.cycles_per_op[rep] = (double)cycles / ops;
+        sum += result.ns_per_op[rep];
+        sum_sq += result.ns_per_op[rep] * result.ns_per_op[rep];
+    }
+
+    qsort(result.ns_per_op, repetitions, sizeof(double), _cmp_double);
+    qsort(result.cycles_per_op, repetitions, sizeof(double), _cmp_double);
+
+    const double mean = sum / repetitions;
+    const double variance = sum_sq / repetitions - mean * mean;
+
+    printf("%-16s %10.2f %10.2f %10.2f %7.1f%% %10.1f  %s\n", bench->name, result.ns_per_op[0],
+           result.ns_per_op[repetitions / 2], mean, variance > 0 ? sqrt(variance) * 100 / mean : 0,
+           result.cycles_per_op[repetitions / 2], bench->description);
+}
+
+static void _bench_alloc_free(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        const uint64_t frame = xsk_alloc_umem_frame(ctx->xsk);
+        acc += frame;
+        xsk_free_umem_frame(ctx->xsk, frame);
+    }
+
+    _sink += acc;
+}
+
+static void _bench_alloc_free_bulk(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    uint64_t frames[BENCH_BULK_SIZE];
+
+    for (uint64_t i = 0; i < ops; i += BENCH_BULK_SIZE)
+    {
+        const uint32_t allocated = xsk_alloc_umem_frames(ctx->xsk, frames, BENCH_BULK_SIZE);
+        xsk_free_umem_frames(ctx->xsk, frames, allocated);
+    }
+
+    _sink += frames[0];
+}
+
+/* Plays the kernel's part as well: takes BENCH_FILL_CONSUME descriptors off
+ * the fill ring and returns their frames to the cache, as af_rx does once
+ * they come back on the RX ring, then refills. The first call fills the
+ * whole ring and every later one tops up what the kernel took. */
+static void _bench_fill_fq(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    struct xsk_ring_prod *const fq = &ctx->umem.fq;
+    const uint64_t *const ring = fq->ring;
+
+    for (uint64_t filled = 0; filled < ops;)
+    {
+        const uint32_t consumer = ctx->fq_consumer;
+        const uint32_t available = ctx->fq_producer - consumer;
+        const uint32_t taken = available < BENCH_FILL_CONSUME ? available : BENCH_FILL_CONSUME;
+
+        for (uint32_t i = 0; i < taken; i++)
+            xsk_free_umem_frame(ctx->xsk, ring[(consumer + i) & fq->mask]);
+        __atomic_store_n(&ctx->fq_consumer, consumer + taken, __ATOMIC_RELEASE);
+
+        const unsigned int refilled = xsk_fill_fq(ctx->xsk);
+        filled += refilled ? refilled : 1;
+    }
+}
+
+static void _bench_csum16_add(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    __sum16 sum = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+        sum = csum16_add(sum, ctx->csum_words[i & (CSUM_WORDS - 1)]);
+
+    _sink += sum;
+}
+
+/* The reflect path's update: one 16 bit field of the header changes */
+static void _bench_csum_replace2(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    __sum16 sum = ctx->csum_words[0];
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        const __be16 old = ctx->csum_words[i & (CSUM_WORDS - 1)];
+        csum_replace2(&sum, old, old ^ htons(0x0100));
+    }
+
+    _sink += sum;
+}
+
+static void _bench_parse(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        const unsigned int p = i % NUM_PACKETS;
+        void *const data_end = ctx->packets[p] + ctx->packet_lens[p];
+        struct hdr_cursor nh = {.pos = ctx->packets[p]};
+        struct ethhdr *eth;
+        struct iphdr *ip;
+        struct ipv6hdr *ip6;
+        struct udphdr *udp;
+        struct tcphdr *tcp;
+        struct icmp6hdr *icmp6;
+        int proto;
+
+        const int eth_type = parse_ethhdr(&nh, data_end, &eth);
+        if (eth_type == htons(ETH_P_IP))
+            proto = parse_iphdr(&nh, data_end, &ip);
+        else if (eth_type == htons(ETH_P_IPV6))
+            proto = parse_ip6hdr(&nh, data_end, &ip6);
+        else
+            continue;
+
+        if (proto == IPPROTO_UDP)
+            acc += parse_udphdr(&nh, data_end, &udp);
+        else if (proto == IPPROTO_TCP)
+            acc += parse_tcphdr(&nh, data_end, &tcp);
+        else if (proto == IPPROTO_ICMPV6)
+            acc += parse_icmp6hdr(&nh, data_end, &icmp6);
+    }
+
+    _sink += acc;
+}
+
+static inline uint64_t _touch_frame(struct bench_ctx *const ctx, const uint64_t addr)
+{
+    uint64_t *const data = (uint64_t *)(ctx->buffer + addr);
+    uint64_t acc = 0;
+
+    for (unsigned int i = 0; i < BENCH_TOUCH_SIZE / sizeof(*data); i++)
+    {
+        data[i] += i;
+        acc += data[i];
+    }
+
+    return acc;
+}
+
+/* The frame cache hands back the frame just freed, so the same few lines
+ * stay in L1 */
+static void _bench_reuse_lifo(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        const uint64_t frame = xsk_alloc_umem_frame(ctx->xsk);
+        acc += _touch_frame(ctx, frame);
+        xsk_free_umem_frame(ctx->xsk, frame);
+    }
+
+    _sink += acc;
+}
+
+/* The pool's ring hands out the frame freed longest ago, cycling through the
+ * whole UMEM, so with a UMEM bigger than the LLC every touch misses. Compare
+ * against reuse_lifo; the pool's own cost is in alloc_free_bulk's range. */
+static void _bench_reuse_fifo(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    struct frame_pool *const pool = ctx->umem.pool;
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        uint32_t frame;
+
+        if (frame_pool_get_bulk(pool, &frame, 1) == 0)
+            break;
+        acc += _touch_frame(ctx, (uint64_t)frame << pool->frame_shift);
+        frame_pool_put_bulk(pool, &frame, 1);
+    }
+
+    _sink += acc;
+}
+
+/* Full batches of IPv4, IPv6 and tagged packets in random order */
+static void _bench_classify(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    for (uint64_t i = 0; i < ops; i += PKT_CLASSIFY_MAX_BATCH)
+    {
+        const unsigned int first = i % CLASSIFY_PACKETS;
+        pkt_classify_batch(ctx->buffer, &ctx->classify_addrs[first], &ctx->classify_lens[first],
+                           PKT_CLASSIFY_MAX_BATCH, &ctx->batch);
+    }
+
+    _sink += ctx->batch.class_count[PKT_CLASS_IPV4];
+}
+
+/* Cycles through the classify frames, so like a freshly received packet
+ * the data mostly isn't in L1 */
+static void _bench_csum_partial(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    __wsum sum = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+        sum = csum_partial(ctx->buffer + (i % CLASSIFY_PACKETS) * ctx->frame_size, ETH_DATA_LEN, sum);
+
+    _sink += sum;
+}
+
+static void _bench_encap_vlan(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    struct xdp_desc desc = _encap_desc(ctx);
+    uint16_t tci = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        xsk_push_vlan(&ctx->umem, &desc, ETH_P_8021Q, i);
+        xsk_pop_vlan(&ctx->umem, &desc, &tci);
+    }
+
+    _sink += tci;
+}
+
+static void _bench_encap_vxlan(struct bench_ctx *const ctx, const uint64_t ops)
+{
+    const struct xsk_tunnel tunnel = {
+        .family = AF_INET,
+        .saddr.s6_addr = {10, 0, 0, 1},
+        .daddr.s6_addr = {10, 0, 0, 2},
+        .ttl = 64,
+        .sport = 49152,
+        .dport = VXLAN_PORT,
+    };
+    struct xdp_desc desc = _encap_desc(ctx);
+    uint32_t vni = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        xsk_push_vxlan(&ctx->umem, &desc, &tunnel);
+        xsk_pull_vxlan(&ctx->umem, &desc, &vni);
+    }
+
+    _sink += vni + desc.len;
+}
+
+/* The IPv4/UDP packet where the kernel would have received it in the last
+ * frame, behind XDP_PACKET_HEADROOM */
+static struct xdp_desc _encap_desc(struct bench_ctx *const ctx)
+{
+    const struct xdp_desc desc = {
+        .addr = (uint64_t)(ctx->num_frames - 1) * ctx->frame_size + XDP_PACKET_HEADROOM,
+        .len = ctx->packet_lens[0],
+    };
+
+    memcpy(ctx->buffer + desc.addr, ctx->packets[0], desc.len);
+    return desc;
+}
+
+static int _cmp_double(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t _now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+/* Reference cycles at the TSC's constant rate, not core clock cycles, on
+ * every CPU of the last decade */
+static uint64_t _cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
@@ -2,26 +2,124 @@
 #define _DEFAULT_SOURCE
 
 #include "af_common.h"
+#include "umem_alloc.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
-#include <assert.h>
 #include <errno.h>
 #include <sys/resource.h>
 #include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/ethtool.h>
+#include <linux/if_link.h>
+#include <linux/sockios.h>
+#include <linux/if_xdp.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
 
-#define XSK_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
 
-static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size);
+static struct xsk_umem_info *allocate_umem(const char *const interface_name, const uint32_t num_frames,
+                                          const uint32_t frame_size, const uint64_t extra_size,
+                                          const uint32_t flags, const struct xsk_ring_config *const rings);
+static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size, const uint32_t frame_size,
+                                               const uint32_t flags, const struct xsk_ring_config *const rings);
+static void destroy_umem(struct xsk_umem_info *const umem);
+static struct umem_slab *create_umem_slab(const uint64_t base, const uint32_t num_slabs);
+static struct xsk_umem_info *clone_socket_umem(const struct xsk_umem_info *const umem);
 static struct xsk_socket_info *xsk_configure_socket(const char *const interface_name, const unsigned int queue_num,
                                              const uint32_t xdp_flags, const uint16_t bind_flags,
-                                             struct xsk_umem_info *umem);
+                                             const uint32_t libbpf_flags, struct xsk_umem_info *umem,
+                                             const struct xsk_ring_config *const rings);
+
+struct xsk_ring_config default_ring_config(const enum xsk_socket_profile profile)
+{
+    struct xsk_ring_config rings = {
+        .profile = profile,
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+    };
+
+    /* The kernel won't bind without both UMEM rings, but a socket that
+     * never receives (transmits) needs no depth in its fill (completion)
+     * ring. Unused RX/TX rings are not created at all. */
+    if (profile == XSK_PROFILE_TX_ONLY)
+    {
+        rings.rx_size = 0;
+        rings.fill_size = XSK_RING_MIN_NUM_DESCS;
+    }
+    else if (profile == XSK_PROFILE_RX_ONLY)
+    {
+        rings.tx_size = 0;
+        rings.comp_size = XSK_RING_MIN_NUM_DESCS;
+    }
+
+    return rings;
+}
 
 struct xsk_socket_info *create_socket(const char *const interface_name, const unsigned int queue_num,
-                                      const uint32_t xdp_flags, const uint16_t bind_flags)
+                                      const uint32_t xdp_flags, const uint16_t bind_flags,
+                                      const struct xsk_ring_config *const rings)
 {
-    void *packet_buffer;
-   
+    struct xsk_umem_info *const umem = create_umem(interface_name, NUM_FRAMES, XSK_UMEM__DEFAULT_FRAME_SIZE, rings);
+    if (umem == NULL)
+        return NULL;
+
+    return create_shared_socket(interface_name, queue_num, xdp_flags, bind_flags, umem, rings);
+}
+
+struct xsk_umem_info *create_umem(const char *const interface_name, const uint32_t num_frames,
+                                  const uint32_t frame_size, const struct xsk_ring_config *const rings)
+{
+    return allocate_umem(interface_name, num_frames, frame_size, 0, XSK_UMEM__DEFAULT_FLAGS, rings);
+}
+
+/* The slabs start on the first page boundary after the frames */
+struct xsk_umem_info *create_unaligned_umem(const char *const interface_name, const uint32_t num_frames,
+                                            const uint32_t frame_size, const uint64_t slab_bytes,
+                                            const struct xsk_ring_config *const rings)
+{
+    const uint64_t frames_size = ((uint64_t)num_frames * frame_size + UMEM_PAGE_SIZE - 1) & ~(uint64_t)(UMEM_PAGE_SIZE - 1);
+    const uint32_t num_slabs = (slab_bytes + UMEM_SLAB_SIZE - 1) / UMEM_SLAB_SIZE;
+
+    if (num_slabs == 0)
+    {
+        fprintf(stderr, "ERROR: An unaligned umem needs at least one slab\n");
+        return NULL;
+    }
+
+    struct xsk_umem_info *const umem = allocate_umem(interface_name, num_frames, frame_size,
+                                                     frames_size - (uint64_t)num_frames * frame_size +
+                                                         (uint64_t)num_slabs * UMEM_SLAB_SIZE,
+                                                     XDP_UMEM_UNALIGNED_CHUNK_FLAG, rings);
+    if (umem == NULL)
+        return NULL;
+
+    umem->slab = create_umem_slab(frames_size, num_slabs);
+    if (umem->slab == NULL)
+    {
+        fprintf(stderr, "ERROR: Can't create umem slabs \"%s\"\n",
+                strerror(errno));
+        destroy_umem(umem);
+        return NULL;
+    }
+
+    return umem;
+}
+
+static struct xsk_umem_info *allocate_umem(const char *const interface_name, const uint32_t num_frames,
+                                          const uint32_t frame_size, const uint64_t extra_size,
+                                          const uint32_t flags, const struct xsk_ring_config *const rings)
+{
+    uint64_t mapped_size;
+
     struct rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY};
     if (setrlimit(RLIMIT_MEMLOCK, &rlim))
     {
@@ -30,60 +128,389 @@ struct xsk_socket_info *create_socket(const char *const interface_name, const un
         return NULL;
     }
 
-    uint64_t packet_buffer_size = NUM_FRAMES * XSK_FRAME_SIZE;
-    if (posix_memalign(&packet_buffer,
-                       getpagesize(), /* PAGE_SIZE aligned */
-                       packet_buffer_size))
+    /* Keep the packet buffers on the NIC's NUMA node, DMA and the RX path
+     * both touch every frame */
+    const uint64_t packet_buffer_size = (uint64_t)num_frames * frame_size + extra_size;
+    void *const packet_buffer = umem_buffer_alloc(packet_buffer_size, get_interface_numa_node(interface_name),
+                                                  &mapped_size);
+    if (packet_buffer == NULL)
     {
         fprintf(stderr, "ERROR: Can't allocate buffer memory \"%s\"\n",
                 strerror(errno));
         return NULL;
     }
 
-    struct xsk_umem_info *const umem = configure_xsk_umem(packet_buffer, packet_buffer_size);
+    struct xsk_umem_info *const umem = configure_xsk_umem(packet_buffer, packet_buffer_size, frame_size, flags,
+                                                          rings);
     if (umem == NULL)
     {
         fprintf(stderr, "ERROR: Can't create umem \"%s\"\n",
                 strerror(errno));
+        umem_buffer_free(packet_buffer, mapped_size);
         return NULL;
     }
+    umem->mapped_size = mapped_size;
 
-    struct xsk_socket_info *const xsk_socket = xsk_configure_socket(interface_name, queue_num, xdp_flags, bind_flags, umem);
-    if (xsk_socket == NULL)
+    umem->pool = frame_pool_create(num_frames, frame_size);
+    if (umem->pool == NULL)
     {
-        fprintf(stderr, "ERROR: Can't setup AF_XDP socket \"%s\"\n",
+        fprintf(stderr, "ERROR: Can't create frame pool \"%s\"\n",
                 strerror(errno));
+        destroy_umem(umem);
+        return NULL;
+    }
+
+    umem->num_frames = num_frames;
+    umem->frame_size = frame_size;
+    return umem;
+}
+
+struct xsk_socket_info *create_shared_socket(const char *const interface_name, const unsigned int queue_num,
+                                             const uint32_t xdp_flags, const uint16_t bind_flags,
+                                             struct xsk_umem_info *const umem,
+                                             const struct xsk_ring_config *const rings)
+{
+    /* Every socket gets its own fill and completion ring on the shared umem */
+    struct xsk_umem_info *const socket_umem = clone_socket_umem(umem);
+    if (socket_umem == NULL)
+        return NULL;
+
+    struct xsk_socket_info *const xsk_socket = xsk_configure_socket(interface_name, queue_num, xdp_flags, bind_flags, 0,
+                                                                    socket_umem, rings);
+    if (xsk_socket == NULL)
+    {
+        fprintf(stderr, "ERROR: Can't setup AF_XDP socket on queue %u \"%s\"\n",
+                queue_num, strerror(errno));
+        if (bind_flags & XDP_USE_SG)
+            fprintf(stderr, "Multi-buffer sockets need Linux 6.6, and driver support in zero-copy mode\n");
+        free(socket_umem);
         return NULL;
     }
 
+    frame_cache_init(&xsk_socket->frames, umem->pool);
+
     return xsk_socket;
 }
 
-uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk)
+struct xsk_steering *load_steering_program(const char *const interface_name, const char *const filename,
+                                           const uint32_t xdp_flags, const uint32_t socks_per_queue,
+                                           const bool multi_buffer)
 {
-    uint64_t frame;
-    if (xsk->umem_frame_free == 0)
-        return INVALID_UMEM_FRAME;
+    char errmsg[1024];
+
+    struct xsk_steering *const steering = calloc(1, sizeof(*steering));
+    if (steering == NULL)
+        return NULL;
+
+    steering->xdp_flags = xdp_flags;
+    steering->socks_per_queue = socks_per_queue;
+    steering->prog = xdp_program__open_file(filename, multi_buffer ? "xdp.frags" : "xdp", NULL);
+    int err = libxdp_get_error(steering->prog);
+    if (err)
+    {
+        libxdp_strerror(err, errmsg, sizeof(errmsg));
+        fprintf(stderr, "ERROR: Can't open XDP program %s \"%s\"\n", filename, errmsg);
+        free(steering);
+        return NULL;
+    }
+
+    struct bpf_object *const obj = xdp_program__bpf_obj(steering->prog);
+    struct bpf_map *const rodata = bpf_object__find_map_by_name(obj, ".rodata.steering");
+    if (rodata == NULL || bpf_map__set_initial_value(rodata, &socks_per_queue, sizeof(socks_per_queue)))
+    {
+        fprintf(stderr, "ERROR: %s has no socks_per_queue setting\n", filename);
+        goto error_exit;
+    }
+
+    enum xdp_attach_mode mode = XDP_MODE_UNSPEC;
+    if (xdp_flags & XDP_FLAGS_SKB_MODE)
+        mode = XDP_MODE_SKB;
+    else if (xdp_flags & XDP_FLAGS_DRV_MODE)
+        mode = XDP_MODE_NATIVE;
+
+    err = xdp_program__attach(steering->prog, if_nametoindex(interface_name), mode, 0);
+    if (err)
+    {
+        libxdp_strerror(err, errmsg, sizeof(errmsg));
+        fprintf(stderr, "ERROR: Can't attach XDP program to %s \"%s\"\n", interface_name, errmsg);
+        goto error_exit;
+    }
+
+    steering->xsks_map_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "xsks_map"));
+    if (steering->xsks_map_fd < 0)
+    {
+        fprintf(stderr, "ERROR: %s has no xsks_map\n", filename);
+        xdp_program__detach(steering->prog, if_nametoindex(interface_name), mode, 0);
+        goto error_exit;
+    }
+
+    return steering;
+
+error_exit:
+    xdp_program__close(steering->prog);
+    free(steering);
+    return NULL;
+}
+
+struct xsk_socket_info *create_steered_socket(const struct xsk_steering *const steering,
+                                              const char *const interface_name, const unsigned int queue_num,
+                                              const unsigned int slot, const uint16_t bind_flags,
+                                              struct xsk_umem_info *const umem,
+                                              const struct xsk_ring_config *const rings)
+{
+    /* Only the first socket on a queue creates its fill and completion
+     * ring, libxdp hands the same rings to the others */
+    struct xsk_umem_info *const socket_umem = slot == 0 ? clone_socket_umem(umem) : umem;
+    if (socket_umem == NULL)
+        return NULL;
+
+    struct xsk_socket_info *const xsk_socket = xsk_configure_socket(interface_name, queue_num, steering->xdp_flags,
+                                                                    bind_flags, XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD,
+                                                                    socket_umem, rings);
+    if (xsk_socket == NULL)
+    {
+        fprintf(stderr, "ERROR: Can't setup AF_XDP socket %u on queue %u \"%s\"\n",
+                slot, queue_num, strerror(errno));
+        if (bind_flags & XDP_USE_SG)
+            fprintf(stderr, "Multi-buffer sockets need Linux 6.6, and driver support in zero-copy mode\n");
+        if (slot == 0)
+            free(socket_umem);
+        return NULL;
+    }
+
+    const uint32_t key = queue_num * steering->socks_per_queue + slot;
+    const int fd = xsk_socket__fd(xsk_socket->xsk);
+    if (bpf_map_update_elem(steering->xsks_map_fd, &key, &fd, BPF_ANY))
+    {
+        fprintf(stderr, "ERROR: Can't register AF_XDP socket %u on queue %u \"%s\"\n",
+                slot, queue_num, strerror(errno));
+        xsk_socket__delete(xsk_socket->xsk);
+        free(xsk_socket);
+        if (slot == 0)
+            free(socket_umem);
+        return NULL;
+    }
+
+    frame_cache_init(&xsk_socket->frames, umem->pool);
+
+    return xsk_socket;
+}
+
+unsigned int get_queue_count(const char *const interface_name)
+{
+    struct ethtool_channels channels = {.cmd = ETHTOOL_GCHANNELS};
+    struct ifreq ifr = {0};
+    unsigned int queue_count = 1;
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return queue_count;
+
+    strncpy(ifr.ifr_name, interface_name, IF_NAMESIZE - 1);
+    ifr.ifr_data = (void *)&channels;
+
+    /* Drivers without ETHTOOL_GCHANNELS support have a single queue */
+    if (ioctl(fd, SIOCETHTOOL, &ifr) == 0)
+    {
+        if (channels.combined_count > 0)
+            queue_count = channels.combined_count;
+        else if (channels.rx_count > 0)
+            queue_count = channels.rx_count;
+    }
+
+    close(fd);
+    return queue_count;
+}
+
+bool parse_xdp_mode(const char *const mode, uint32_t *const xdp_flags)
+{
+    if (strcmp(mode, "skb") == 0)
+        *xdp_flags = XDP_FLAGS_SKB_MODE;
+    else if (strcmp(mode, "native") == 0)
+        *xdp_flags = XDP_FLAGS_DRV_MODE;
+    else
+        return false;
 
-    frame = xsk->umem_frame_addr[--xsk->umem_frame_free];
-    xsk->umem_frame_addr[xsk->umem_frame_free] = INVALID_UMEM_FRAME;
-    return frame;
+    return true;
+}
+
+int xsk_get_kernel_stats(struct xsk_socket_info *const xsk, struct xdp_statistics *const stats)
+{
+    socklen_t optlen = sizeof(*stats);
+
+    if (getsockopt(xsk_socket__fd(xsk->xsk), SOL_XDP, XDP_STATISTICS, stats, &optlen))
+        return -errno;
+
+    return 0;
+}
+
+uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk)
+{
+    return frame_cache_alloc(&xsk->frames);
 }
 
 void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame)
 {
-    assert(xsk->umem_frame_free < NUM_FRAMES);
+    frame_cache_free(&xsk->frames, frame);
+}
+
+uint32_t xsk_alloc_umem_frames(struct xsk_socket_info *xsk, uint64_t *const frames, const uint32_t n)
+{
+    return frame_cache_alloc_bulk(&xsk->frames, frames, n);
+}
 
-    xsk->umem_frame_addr[xsk->umem_frame_free++] = frame;
+void xsk_free_umem_frames(struct xsk_socket_info *xsk, const uint64_t *const frames, const uint32_t n)
+{
+    frame_cache_free_bulk(&xsk->frames, frames, n);
 }
 
+/* Frames available to this socket, including those other sockets or threads
+ * may take from the shared pool before this one gets to them */
 uint64_t xsk_umem_free_frames(struct xsk_socket_info *xsk)
 {
-	return xsk->umem_frame_free;
+    return frame_cache_available(&xsk->frames);
+}
+
+/* Tops the fill ring up with as many frames as the shared pool can spare.
+ * Frames are taken in bulk before reserving ring slots, because other
+ * sockets' threads may drain the pool between the two steps. */
+unsigned int xsk_fill_fq(struct xsk_socket_info *const xsk_socket)
+{
+    const unsigned int free_slots = xsk_prod_nb_free(&xsk_socket->umem->fq, xsk_socket->umem->fq.size);
+    unsigned int filled = 0;
+
+    while (filled < free_slots)
+    {
+        uint64_t frames[FILL_BATCH_SIZE];
+        uint32_t idx_fq = 0;
+        const unsigned int wanted = free_slots - filled < FILL_BATCH_SIZE ? free_slots - filled : FILL_BATCH_SIZE;
+        const unsigned int allocated = xsk_alloc_umem_frames(xsk_socket, frames, wanted);
+
+        if (allocated == 0)
+            break;
+
+        while (xsk_ring_prod__reserve(&xsk_socket->umem->fq, allocated, &idx_fq) != allocated)
+            ;
+
+        for (unsigned int i = 0; i < allocated; i++)
+            *xsk_ring_prod__fill_addr(&xsk_socket->umem->fq, idx_fq++) = frames[i];
+
+        xsk_ring_prod__submit(&xsk_socket->umem->fq, allocated);
+        filled += allocated;
+
+        if (allocated < wanted)
+            break;
+    }
+
+    return filled;
+}
+
+/* Buffers are rounded up to a cache line and moved to the next page
+ * rather than across one, because a zero-copy driver may have mapped the
+ * next page elsewhere. A slab whose buffers have all come back is reused
+ * in place. */
+uint64_t umem_slab_alloc(struct umem_slab *const slab, const uint32_t len)
+{
+    const uint32_t size = (len + CACHE_LINE_SIZE - 1) & ~(uint32_t)(CACHE_LINE_SIZE - 1);
+    uint32_t offset = slab->offset;
+
+    if (size == 0 || size > UMEM_PAGE_SIZE)
+        return INVALID_UMEM_FRAME;
+
+    if ((offset & (UMEM_PAGE_SIZE - 1)) + size > UMEM_PAGE_SIZE)
+        offset = (offset + UMEM_PAGE_SIZE - 1) & ~(uint32_t)(UMEM_PAGE_SIZE - 1);
+
+    if (offset + size > UMEM_SLAB_SIZE)
+    {
+        /* The full slab returns to the list when its last buffer does */
+        if (slab->live[slab->current])
+        {
+            if (slab->num_free == 0)
+                return INVALID_UMEM_FRAME;
+            slab->current = slab->free_slabs[--slab->num_free];
+        }
+        offset = 0;
+    }
+
+    slab->offset = offset + size;
+    slab->live[slab->current]++;
+    return slab->base + (uint64_t)slab->current * UMEM_SLAB_SIZE + offset;
+}
+
+void umem_slab_free(struct umem_slab *const slab, const uint64_t addr)
+{
+    const uint32_t index = (addr - slab->base) / UMEM_SLAB_SIZE;
+
+    if (--slab->live[index])
+        return;
+
+    if (index == slab->current)
+        slab->offset = 0;
+    else
+        slab->free_slabs[slab->num_free++] = index;
 }
 
-static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size)
+/* Undoes allocate_umem() on its way to failing, no socket uses the umem */
+static void destroy_umem(struct xsk_umem_info *const umem)
 {
+    if (umem->pool)
+        frame_pool_destroy(umem->pool);
+    xsk_umem__delete(umem->umem);
+    umem_buffer_free(umem->buffer, umem->mapped_size);
+    free(umem);
+}
+
+static struct umem_slab *create_umem_slab(const uint64_t base, const uint32_t num_slabs)
+{
+    struct umem_slab *const slab = calloc(1, sizeof(*slab));
+    if (slab == NULL)
+        return NULL;
+
+    slab->free_slabs = calloc(num_slabs, sizeof(*slab->free_slabs));
+    slab->live = calloc(num_slabs, sizeof(*slab->live));
+    if (slab->free_slabs == NULL || slab->live == NULL)
+    {
+        free(slab->free_slabs);
+        free(slab->live);
+        free(slab);
+        return NULL;
+    }
+
+    /* Slab 0 starts out current, the others are taken in address order */
+    slab->base = base;
+    slab->num_slabs = num_slabs;
+    for (uint32_t i = num_slabs - 1; i > 0; i--)
+        slab->free_slabs[slab->num_free++] = i;
+
+    return slab;
+}
+
+static struct xsk_umem_info *clone_socket_umem(const struct xsk_umem_info *const umem)
+{
+    struct xsk_umem_info *const socket_umem = calloc(1, sizeof(*socket_umem));
+    if (socket_umem == NULL)
+        return NULL;
+
+    socket_umem->umem = umem->umem;
+    socket_umem->buffer = umem->buffer;
+    socket_umem->num_frames = umem->num_frames;
+    socket_umem->frame_size = umem->frame_size;
+    socket_umem->frame_headroom = umem->frame_headroom;
+    socket_umem->pool = umem->pool;
+    socket_umem->slab = umem->slab;
+    return socket_umem;
+}
+
+static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size, const uint32_t frame_size,
+                                               const uint32_t flags, const struct xsk_ring_config *const rings)
+{
+    const struct xsk_umem_config umem_cfg = {
+        .fill_size = rings->fill_size,
+        .comp_size = rings->comp_size,
+        .frame_size = frame_size,
+        .frame_headroom = rings->frame_headroom,
+        .flags = flags,
+    };
     struct xsk_umem_info *umem;
     int ret;
 
@@ -92,24 +519,26 @@ static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size)
         return NULL;
 
     ret = xsk_umem__create(&umem->umem, buffer, size, &umem->fq, &umem->cq,
-                           NULL);
+                           &umem_cfg);
     if (ret)
     {
+        free(umem);
         errno = -ret;
         return NULL;
     }
 
     umem->buffer = buffer;
+    umem->frame_headroom = rings->frame_headroom;
     return umem;
 }
 
 static struct xsk_socket_info *xsk_configure_socket(const char *const interface_name, const unsigned int queue_num,
                                              const uint32_t xdp_flags, const uint16_t bind_flags,
-                                             struct xsk_umem_info *umem)
+                                             const uint32_t libbpf_flags, struct xsk_umem_info *umem,
+                                             const struct xsk_ring_config *const rings)
 {
     struct xsk_socket_config xsk_cfg;
     struct xsk_socket_info *xsk_info;
-    int i;
     int ret;
     uint32_t prog_id;
 
@@ -118,17 +547,22 @@ static struct xsk_socket_info *xsk_configure_socket(const char *const interface_
         return NULL;
 
     xsk_info->umem = umem;
-    xsk_cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
-    xsk_cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    xsk_cfg.rx_size = rings->rx_size;
+    xsk_cfg.tx_size = rings->tx_size;
     xsk_cfg.xdp_flags = xdp_flags;
     xsk_cfg.bind_flags = bind_flags;
-    xsk_cfg.libbpf_flags = 0;
-    ret = xsk_socket__create(&xsk_info->xsk, interface_name,
-                             queue_num, umem->umem, &xsk_info->rx,
-                             &xsk_info->tx, &xsk_cfg);
+    xsk_cfg.libbpf_flags = libbpf_flags;
+    ret = xsk_socket__create_shared(&xsk_info->xsk, interface_name, queue_num, umem->umem,
+                                    rings->profile == XSK_PROFILE_TX_ONLY ? NULL : &xsk_info->rx,
+                                    rings->profile == XSK_PROFILE_RX_ONLY ? NULL : &xsk_info->tx,
+                                    &umem->fq, &umem->cq, &xsk_cfg);
     if (ret)
         goto error_exit;
 
+    /* A program loaded by the caller registers its sockets itself */
+    if (libbpf_flags & XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD)
+        return xsk_info;
+
     const unsigned int interface_index = if_nametoindex(interface_name);
     if (interface_index == 0)
     {
@@ -140,10 +574,6 @@ static struct xsk_socket_info *xsk_configure_socket(const char *const interface_
     if (bpf_xdp_query_id(interface_index, xdp_flags, &prog_id))
         goto error_exit;
 
-    for (i = 0; i < NUM_FRAMES; i++)
-        xsk_info->umem_frame_addr[i] = i * XSK_FRAME_SIZE;
-    xsk_info->umem_frame_free = NUM_FRAMES;
-
     return xsk_info;
 
 error_exit:
@@ -1,17 +1,95 @@
 #pragma once
 
 #define NUM_FRAMES 4096
-#define INVALID_UMEM_FRAME UINT64_MAX
+#define XSK_RING_MIN_NUM_DESCS 64
+/* Frames taken from the frame cache per fill ring reservation */
+#define FILL_BATCH_SIZE 256
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <xdp/xsk.h>
+#include <xdp/libxdp.h>
 
+#include "xsk_busy_poll.h"
+#include <linux/if_xdp.h>
+
+#include "frame_pool.h"
+
+/* Multi-buffer AF_XDP (Linux 6.6), missing from older uapi headers */
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
+#ifndef XDP_PKT_CONTD
+#define XDP_PKT_CONTD (1 << 0)
+#endif
+
+/* Unaligned UMEMs cut variable-size buffers from slabs of this size, never
+ * across a page, and at cache line boundaries */
+#define UMEM_SLAB_SIZE (256U << 10)
+#define UMEM_PAGE_SIZE 4096
+
+/* Most descriptors one packet may span, MAX_SKB_FRAGS + 1 with the default
+ * MAX_SKB_FRAGS. Zero-copy drivers may allow fewer, see xdp_zc_max_segs. */
+#define XSK_MAX_FRAGS 18
+
+enum xsk_socket_profile
+{
+    XSK_PROFILE_BIDIRECTIONAL,
+    XSK_PROFILE_RX_ONLY,
+    XSK_PROFILE_TX_ONLY,
+};
+
+/* Ring sizes must be powers of two. rx_size and tx_size are ignored for
+ * the rings the profile leaves out. fill_size, comp_size and frame_headroom
+ * are properties of the UMEM, so every socket sharing a UMEM gets the ones
+ * given to create_umem(). */
+struct xsk_ring_config
+{
+    enum xsk_socket_profile profile;
+    uint32_t rx_size;
+    uint32_t tx_size;
+    uint32_t fill_size;
+    uint32_t comp_size;
+    /* Reserved by the kernel in front of every received packet on top of
+     * XDP_PACKET_HEADROOM, room to push encapsulation headers into */
+    uint32_t frame_headroom;
+};
+
+/* Variable-size buffers for a UMEM in unaligned chunk mode, where a TX
+ * descriptor may point at any address. Buffers are cut from the slabs by
+ * bumping an offset, and a slab goes back to the free list once all of its
+ * buffers are freed again, which suits buffers released in about the order
+ * they were taken, like TX completions. Only used by one thread, like a
+ * frame_cache. */
+struct umem_slab
+{
+    uint64_t base;
+    uint32_t num_slabs;
+    uint32_t current;
+    uint32_t offset;
+    uint32_t num_free;
+    uint32_t *free_slabs;
+    /* Buffers handed out and not yet freed, per slab */
+    uint32_t *live;
+};
+
+/* One xsk_umem_info exists per socket. Sockets sharing a UMEM point at the
+ * same umem/buffer/frame pool but each own their fill and completion rings,
+ * as required for sockets bound to different queues (XDP_SHARED_UMEM). */
 struct xsk_umem_info
 {
     struct xsk_ring_prod fq;
     struct xsk_ring_cons cq;
     struct xsk_umem *umem;
     void *buffer;
+    /* Bytes umem_buffer_alloc() mapped for buffer */
+    uint64_t mapped_size;
+    uint32_t num_frames;
+    uint32_t frame_size;
+    uint32_t frame_headroom;
+    struct frame_pool *pool;
+    /* Only for an unaligned UMEM, shared by all its sockets */
+    struct umem_slab *slab;
 };
 
 struct xsk_socket_info
@@ -21,14 +99,168 @@ struct xsk_socket_info
     struct xsk_umem_info *umem;
     struct xsk_socket *xsk;
 
-    uint64_t umem_frame_addr[NUM_FRAMES];
-    uint32_t umem_frame_free;
+    /* Sockets are serviced by a single thread, so the socket's cache is
+     * that thread's magazine in front of the shared frame pool */
+    struct frame_cache frames;
 
     uint32_t outstanding_tx;
 };
 
+/* An XDP program spreading every RX queue over socks_per_queue sockets by
+ * flow hash (af_xdp_kern.o), loaded in place of libxdp's default program */
+struct xsk_steering
+{
+    struct xdp_program *prog;
+    int xsks_map_fd;
+    uint32_t xdp_flags;
+    uint32_t socks_per_queue;
+};
+
+/* A packet read in place as the run of RX descriptors holding it. Sockets
+ * bound with XDP_USE_SG receive packets bigger than a frame as several
+ * descriptors, all but the last flagged XDP_PKT_CONTD. The headers are in
+ * the first buffer. */
+struct xsk_frag_chain
+{
+    uint32_t idx;
+    uint32_t num_frags;
+    uint32_t len;
+};
+
+/* Describes the packet whose first descriptor is idx, of avail peeked
+ * descriptors from idx on. Returns the descriptors it spans, or 0 when the
+ * packet runs on past them; the kernel posts whole packets, so the rest is
+ * already in the ring behind the peeked batch. */
+static inline uint32_t xsk_rx_frag_chain(const struct xsk_ring_cons *const rx, const uint32_t idx,
+                                         const uint32_t avail, struct xsk_frag_chain *const chain)
+{
+    const struct xdp_desc *desc = xsk_ring_cons__rx_desc(rx, idx);
+
+    chain->idx = idx;
+    chain->num_frags = 1;
+    chain->len = desc->len;
+
+    /* The bound only matters with a misbehaving kernel */
+    while ((desc->options & XDP_PKT_CONTD) && chain->num_frags < XSK_MAX_FRAGS)
+    {
+        if (chain->num_frags == avail)
+            return 0;
+
+        desc = xsk_ring_cons__rx_desc(rx, idx + chain->num_frags++);
+        chain->len += desc->len;
+    }
+
+    return chain->num_frags;
+}
+
+static inline const struct xdp_desc *xsk_frag_chain_desc(const struct xsk_ring_cons *const rx,
+                                                          const struct xsk_frag_chain *const chain,
+                                                          const uint32_t frag)
+{
+    return xsk_ring_cons__rx_desc(rx, chain->idx + frag);
+}
+
+/* Headers are pushed onto and pulled off a packet in place by moving its
+ * descriptor's start, so a received packet is rewritten and sent back out
+ * without copying it. A packet the kernel received starts
+ * XDP_PACKET_HEADROOM plus the UMEM's frame_headroom bytes into its frame,
+ * all of which can be pushed into. Frames must start frame_size aligned,
+ * as the frame pool hands them out, also in unaligned mode. */
+
+/* The descriptor's address as a plain UMEM offset, unaligned mode keeps
+ * the packet's offset in the bits above XSK_UNALIGNED_BUF_ADDR_MASK */
+static inline uint64_t xsk_desc_addr(const struct xdp_desc *const desc)
+{
+    return xsk_umem__add_offset_to_addr(desc->addr);
+}
+
+/* Bytes in front of the packet up to the start of its frame */
+static inline uint32_t xsk_packet_headroom(const struct xsk_umem_info *const umem,
+                                           const struct xdp_desc *const desc)
+{
+    return xsk_desc_addr(desc) & (umem->frame_size - 1);
+}
+
+/* Grows the packet by len bytes at the front and returns its new start,
+ * or NULL, leaving it as it was, when the headroom is smaller */
+static inline uint8_t *xsk_packet_push(const struct xsk_umem_info *const umem, struct xdp_desc *const desc,
+                                       const uint32_t len)
+{
+    const uint64_t addr = xsk_desc_addr(desc);
+
+    if ((addr & (umem->frame_size - 1)) < len)
+        return NULL;
+
+    desc->addr = addr - len;
+    desc->len += len;
+    return xsk_umem__get_data(umem->buffer, desc->addr);
+}
+
+/* Drops len bytes from the front and returns the new start, or NULL when
+ * the packet is shorter */
+static inline uint8_t *xsk_packet_pull(const struct xsk_umem_info *const umem, struct xdp_desc *const desc,
+                                       const uint32_t len)
+{
+    if (desc->len < len)
+        return NULL;
+
+    desc->addr = xsk_desc_addr(desc) + len;
+    desc->len -= len;
+    return xsk_umem__get_data(umem->buffer, desc->addr);
+}
+
+struct xsk_ring_config default_ring_config(const enum xsk_socket_profile profile);
 struct xsk_socket_info *create_socket(const char *const interface_name, const unsigned int queue_num,
-                                      const uint32_t xdp_flags, const uint16_t bind_flags);
+                                      const uint32_t xdp_flags, const uint16_t bind_flags,
+                                      const struct xsk_ring_config *const rings);
+/* Creates a UMEM of num_frames frames of frame_size bytes (a power of two
+ * between 2048 and the page size) in hugepages local to the interface's NIC */
+struct xsk_umem_info *create_umem(const char *const interface_name, const uint32_t num_frames,
+                                  const uint32_t frame_size, const struct xsk_ring_config *const rings);
+/* The same in unaligned chunk mode (XDP_UMEM_UNALIGNED_CHUNK_FLAG), with
+ * slab_bytes of variable-size buffers from umem->slab after the frames.
+ * The frames still back the fill ring, which the kernel takes a whole
+ * chunk per entry for, and RX descriptors carry the packet offset in the
+ * address bits above XSK_UNALIGNED_BUF_ADDR_MASK. */
+struct xsk_umem_info *create_unaligned_umem(const char *const interface_name, const uint32_t num_frames,
+                                            const uint32_t frame_size, const uint64_t slab_bytes,
+                                            const struct xsk_ring_config *const rings);
+/* Binds a socket to queue_num on a UMEM created by create_umem(). All sockets
+ * on a UMEM allocate from its frame pool, so a frame received on one socket
+ * may be transmitted or freed through any other. */
+struct xsk_socket_info *create_shared_socket(const char *const interface_name, const unsigned int queue_num,
+                                             const uint32_t xdp_flags, const uint16_t bind_flags,
+                                             struct xsk_umem_info *const umem,
+                                             const struct xsk_ring_config *const rings);
+/* With multi_buffer the program's frags-aware variant is loaded, which
+ * interfaces with an MTU above a single buffer need */
+struct xsk_steering *load_steering_program(const char *const interface_name, const char *const filename,
+                                           const uint32_t xdp_flags, const uint32_t socks_per_queue,
+                                           const bool multi_buffer);
+/* Binds socket number slot of queue_num and adds it to the steering
+ * program's xsks_map. Slot 0 takes a UMEM from create_umem(). All sockets of
+ * a queue share one fill and completion ring, so the other slots take the
+ * slot 0 socket's umem (xsk_socket_info.umem) and their users must
+ * serialise access to those rings. */
+struct xsk_socket_info *create_steered_socket(const struct xsk_steering *const steering,
+                                              const char *const interface_name, const unsigned int queue_num,
+                                              const unsigned int slot, const uint16_t bind_flags,
+                                              struct xsk_umem_info *const umem,
+                                              const struct xsk_ring_config *const rings);
+unsigned int get_queue_count(const char *const interface_name);
+/* Parses "skb" or "native" into XDP_FLAGS_*_MODE, returns false otherwise */
+bool parse_xdp_mode(const char *const mode, uint32_t *const xdp_flags);
+/* The kernel's drop and invalid descriptor counters of the socket */
+int xsk_get_kernel_stats(struct xsk_socket_info *const xsk, struct xdp_statistics *const stats);
 uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk);
 void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame);
-uint64_t xsk_umem_free_frames(struct xsk_socket_info *xsk);
\ No newline at end of file
+uint32_t xsk_alloc_umem_frames(struct xsk_socket_info *xsk, uint64_t *const frames, const uint32_t n);
+void xsk_free_umem_frames(struct xsk_socket_info *xsk, const uint64_t *const frames, const uint32_t n);
+uint64_t xsk_umem_free_frames(struct xsk_socket_info *xsk);
+/* Tops the fill ring up from the socket's frame cache, returns the number of
+ * frames handed to the kernel */
+unsigned int xsk_fill_fq(struct xsk_socket_info *const xsk_socket);
+/* Returns the UMEM address of a buffer of at least len bytes, at most a
+ * page, or INVALID_UMEM_FRAME when no slab has room */
+uint64_t umem_slab_alloc(struct umem_slab *const slab, const uint32_t len);
+void umem_slab_free(struct umem_slab *const slab, const uint64_t addr);
\ No newline at end of file
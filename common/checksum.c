@@ -0,0 +1,173 @@
+#include "checksum.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+typedef uint64_t (*csum_fn)(const uint8_t *const buf, const size_t len);
+
+static uint64_t _sum_scalar(const uint8_t *const buf, const size_t len);
+#ifdef HAVE_X86_SIMD
+static uint64_t _sum_avx2(const uint8_t *const buf, const size_t len);
+#endif
+
+static csum_fn csum_impl;
+static const char *csum_impl_name;
+
+/* Folds a 64 bit sum of 32 bit words into a 32 bit one's complement sum */
+static inline __wsum _fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    return (__wsum)sum;
+}
+
+__wsum csum_partial(const void *const buf, const size_t len, const __wsum sum)
+{
+    if (!csum_impl)
+        csum_select("auto");
+
+    return csum_add(_fold64(csum_impl(buf, len)), sum);
+}
+
+bool csum_select(const char *const name)
+{
+    const bool automatic = strcmp(name, "auto") == 0;
+
+#ifdef HAVE_X86_SIMD
+    if ((automatic || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    {
+        csum_impl = _sum_avx2;
+        csum_impl_name = "avx2";
+        return true;
+    }
+#endif
+    if (automatic || strcmp(name, "scalar") == 0)
+    {
+        csum_impl = _sum_scalar;
+        csum_impl_name = "scalar";
+        return true;
+    }
+
+    return false;
+}
+
+const char *csum_selected(void)
+{
+    if (!csum_impl)
+        csum_select("auto");
+
+    return csum_impl_name;
+}
+
+__wsum csum_ipv4_pseudo(const __be32 saddr, const __be32 daddr, const uint32_t len, const uint8_t proto,
+                        const __wsum sum)
+{
+    const uint64_t words = (uint64_t)saddr + daddr + htonl(((uint32_t)proto << 16) | len);
+    return csum_add(_fold64(words), sum);
+}
+
+__wsum csum_ipv6_pseudo(const struct in6_addr *const saddr, const struct in6_addr *const daddr, const uint32_t len,
+                        const uint8_t proto, const __wsum sum)
+{
+    uint64_t words = (uint64_t)htonl(len) + htonl(proto);
+
+    for (unsigned int i = 0; i < 4; i++)
+        words += (uint64_t)saddr->s6_addr32[i] + daddr->s6_addr32[i];
+
+    return csum_add(_fold64(words), sum);
+}
+
+__sum16 ipv4_header_csum(const struct iphdr *const iph)
+{
+    return csum_fold(csum_partial(iph, iph->ihl * 4, 0));
+}
+
+__sum16 ipv4_l4_csum(const struct iphdr *const iph, const void *const l4, const uint32_t len, const uint8_t proto)
+{
+    return csum_fold(csum_partial(l4, len, csum_ipv4_pseudo(iph->saddr, iph->daddr, len, proto, 0)));
+}
+
+__sum16 ipv6_l4_csum(const struct ipv6hdr *const ip6h, const void *const l4, const uint32_t len, const uint8_t proto)
+{
+    return csum_fold(csum_partial(l4, len, csum_ipv6_pseudo(&ip6h->saddr, &ip6h->daddr, len, proto, 0)));
+}
+
+/* 32 bit words into a 64 bit accumulator, which can't overflow for any
+ * buffer that fits in memory. Byte order doesn't matter to a one's
+ * complement sum as long as every word is read the same way. */
+static uint64_t _sum_scalar(const uint8_t *const buf, const size_t len)
+{
+    uint64_t sum = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        uint32_t words[4];
+        memcpy(words, buf + i, sizeof(words));
+        sum += (uint64_t)words[0] + words[1] + words[2] + words[3];
+    }
+
+    for (; i + 4 <= len; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        sum += word;
+    }
+
+    /* The last one to three bytes, zero padded to a word in memory order */
+    if (i < len)
+    {
+        uint8_t tail[4] = {0};
+        uint32_t word;
+
+        memcpy(tail, buf + i, len - i);
+        memcpy(&word, tail, sizeof(word));
+        sum += word;
+    }
+
+    return sum;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Each 32 byte load is split into its eight 32 bit words, zero extended
+ * into two accumulators of four 64 bit lanes, two loads per iteration to
+ * hide the add latency */
+__attribute__((target("avx2"))) static uint64_t _sum_avx2(const uint8_t *const buf, const size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero;
+    __m256i acc1 = zero;
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+    }
+
+    for (; i + 32 <= len; i += 32)
+    {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + _sum_scalar(buf + i, len - i);
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/types.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+
+#include "csum_helpers.h"
+
+/* Full Internet checksums (RFC 1071) over headers and payload. Sums are
+ * carried unfolded in a __wsum, combined with csum_add() and finished with
+ * csum_fold(). All values are in network byte order as they sit in the
+ * packet; the incremental helpers live in csum_helpers.h. */
+
+/* One's complement sum of len bytes added to sum. buf must start an even
+ * number of bytes into the checksummed data. Uses AVX2 where available. */
+__wsum csum_partial(const void *const buf, const size_t len, const __wsum sum);
+/* Picks csum_partial()'s implementation: "avx2", "scalar" or "auto", the
+ * default. Returns false if it isn't available on this CPU. */
+bool csum_select(const char *const name);
+const char *csum_selected(void);
+
+static inline __wsum csum_add(const __wsum a, const __wsum b)
+{
+    const uint32_t res = (uint32_t)a + (uint32_t)b;
+    return (__wsum)(res + (res < (uint32_t)b));
+}
+
+static inline __sum16 csum_fold(const __wsum sum)
+{
+    uint32_t res = (uint32_t)sum;
+
+    res = (res & 0xffff) + (res >> 16);
+    res = (res & 0xffff) + (res >> 16);
+    return (__sum16)~res;
+}
+
+/* Sums of the pseudo headers UDP, TCP and ICMPv6 checksums cover. len is
+ * the L4 length in host byte order. */
+__wsum csum_ipv4_pseudo(const __be32 saddr, const __be32 daddr, const uint32_t len, const uint8_t proto,
+                        const __wsum sum);
+__wsum csum_ipv6_pseudo(const struct in6_addr *const saddr, const struct in6_addr *const daddr, const uint32_t len,
+                        const uint8_t proto, const __wsum sum);
+
+/* Checksum to store in the header, computed with its checksum field zero.
+ * Over a header holding a valid checksum these return 0. */
+__sum16 ipv4_header_csum(const struct iphdr *const iph);
+/* l4 points at len bytes of the L4 header and payload following ip */
+__sum16 ipv4_l4_csum(const struct iphdr *const iph, const void *const l4, const uint32_t len, const uint8_t proto);
+__sum16 ipv6_l4_csum(const struct ipv6hdr *const ip6h, const void *const l4, const uint32_t len, const uint8_t proto);
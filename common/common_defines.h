@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <xdp/libxdp.h>
 
+#define MAX_FILTER_RULES 64
+
 struct config {
 	enum xdp_attach_mode attach_mode;
 	__u32 xdp_flags;
@@ -26,6 +28,20 @@ struct config {
 	__u16 xsk_bind_flags;
 	int xsk_if_queue;
 	bool xsk_poll_mode;
+	bool xsk_busy_poll;
+	bool xsk_uring;
+	bool xsk_multi_buffer;
+	__u32 umem_num_frames;
+	__u32 umem_frame_size;
+	bool xsk_reflect;
+	__u16 udp_echo_port;
+	char *filter_rules[MAX_FILTER_RULES];
+	int num_filter_rules;
+	char *filter_default;
+	char *stats_socket;
+	char *stats_json;
+	bool rx_latency;
+	bool xdp_hw_timestamp;
 	bool unload_all;
 };
 
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <net/if.h>
 #include <linux/if_link.h> /* XDP_FLAGS_* depend on kernel-headers installed */
@@ -183,6 +184,63 @@ void parse_cmdline_args(int argc, char **argv,
 		case 4: /* --unload-all */
 			cfg->unload_all = true;
 			break;
+		case 5: /* --reflect */
+			cfg->xsk_reflect = true;
+			break;
+		case 6: /* --udp-echo-port */
+			cfg->udp_echo_port = atoi(optarg);
+			break;
+		case 7: /* --frames */
+			cfg->umem_num_frames = strtoul(optarg, NULL, 0);
+			if (cfg->umem_num_frames == 0) {
+				fprintf(stderr, "ERR: --frames must be at least 1\n");
+				goto error;
+			}
+			break;
+		case 8: /* --frame-size */
+			cfg->umem_frame_size = strtoul(optarg, NULL, 0);
+			/* The kernel's limits on the UMEM chunk size */
+			if (cfg->umem_frame_size < 2048 ||
+			    cfg->umem_frame_size > (__u32)getpagesize() ||
+			    (cfg->umem_frame_size & (cfg->umem_frame_size - 1))) {
+				fprintf(stderr,
+					"ERR: --frame-size must be a power of two between 2048 and the page size (%d)\n",
+					getpagesize());
+				goto error;
+			}
+			break;
+		case 9: /* --busy-poll */
+			cfg->xsk_busy_poll = true;
+			break;
+		case 10: /* --filter */
+			if (cfg->num_filter_rules == MAX_FILTER_RULES) {
+				fprintf(stderr, "ERR: more than %d --filter rules\n",
+					MAX_FILTER_RULES);
+				goto error;
+			}
+			cfg->filter_rules[cfg->num_filter_rules++] = optarg;
+			break;
+		case 11: /* --filter-default */
+			cfg->filter_default = optarg;
+			break;
+		case 12: /* --stats-socket */
+			cfg->stats_socket = optarg;
+			break;
+		case 13: /* --stats-json */
+			cfg->stats_json = optarg;
+			break;
+		case 14: /* --rx-latency */
+			cfg->rx_latency = true;
+			break;
+		case 15: /* --hw-timestamp */
+			cfg->xdp_hw_timestamp = true;
+			break;
+		case 16: /* --uring */
+			cfg->xsk_uring = true;
+			break;
+		case 17: /* --multi-buffer */
+			cfg->xsk_multi_buffer = true;
+			break;
 		case 'h':
 			full_help = true;
 			/* fall-through */
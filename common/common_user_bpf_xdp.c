@@ -9,8 +9,11 @@
 #include <xdp/libxdp.h>
 
 #include <linux/if_link.h> /* Need XDP flags */
+#include <arpa/inet.h>   /* inet_pton */
+#include <sys/socket.h>  /* AF_INET, AF_INET6 */
 
 #include "common_defines.h"
+#include "common_user_bpf_xdp.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX	4096
@@ -287,3 +290,212 @@ out:
 	xdp_multiprog__close(mp);
 	return err ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+
+static const char *xdp_filter_action_names[XDP_FILTER_ACTION_MAX] = {
+	[XDP_FILTER_REDIRECT]	= "redirect",
+	[XDP_FILTER_PASS]	= "pass",
+	[XDP_FILTER_DROP]	= "drop",
+};
+
+static int filter_map_fd(struct bpf_object *obj, const char *name)
+{
+	struct bpf_map *map = bpf_object__find_map_by_name(obj, name);
+
+	if (!map) {
+		fprintf(stderr, "ERR: no %s map in BPF object\n", name);
+		return -ENOENT;
+	}
+	return bpf_map__fd(map);
+}
+
+int xdp_filter_open(struct bpf_object *obj, struct xdp_filter *filter)
+{
+	filter->flows_fd = filter_map_fd(obj, "filter_flows");
+	filter->v4_fd = filter_map_fd(obj, "filter_v4");
+	filter->v6_fd = filter_map_fd(obj, "filter_v6");
+	filter->default_fd = filter_map_fd(obj, "filter_default");
+
+	if (filter->flows_fd < 0 || filter->v4_fd < 0 ||
+	    filter->v6_fd < 0 || filter->default_fd < 0)
+		return -ENOENT;
+	return 0;
+}
+
+int xdp_filter_set_default(const struct xdp_filter *filter,
+			   enum xdp_filter_action action)
+{
+	__u32 key = 0, value = action;
+
+	if (bpf_map_update_elem(filter->default_fd, &key, &value, BPF_ANY))
+		return -errno;
+	return 0;
+}
+
+int xdp_filter_add_flow(const struct xdp_filter *filter,
+			const struct flow_key *key,
+			enum xdp_filter_action action)
+{
+	__u32 value = action;
+
+	if (bpf_map_update_elem(filter->flows_fd, key, &value, BPF_ANY))
+		return -errno;
+	return 0;
+}
+
+int xdp_filter_del_flow(const struct xdp_filter *filter,
+			const struct flow_key *key)
+{
+	if (bpf_map_delete_elem(filter->flows_fd, key))
+		return -errno;
+	return 0;
+}
+
+/* Builds the trie key and returns the map it belongs in, the direction
+ * byte is always matched in full */
+static int prefix_key(const struct xdp_filter *filter, enum xdp_filter_dir dir,
+		      int family, const void *addr, __u32 prefixlen,
+		      struct lpm_v6_key *key)
+{
+	struct lpm_v4_key *key4 = (struct lpm_v4_key *)key;
+
+	memset(key, 0, sizeof(*key));
+	if (family == AF_INET) {
+		if (prefixlen > 32)
+			return -EINVAL;
+		key4->prefixlen = 8 + prefixlen;
+		key4->dir = dir;
+		memcpy(key4->addr, addr, sizeof(key4->addr));
+		return filter->v4_fd;
+	} else if (family == AF_INET6) {
+		if (prefixlen > 128)
+			return -EINVAL;
+		key->prefixlen = 8 + prefixlen;
+		key->dir = dir;
+		memcpy(key->addr, addr, sizeof(key->addr));
+		return filter->v6_fd;
+	}
+	return -EAFNOSUPPORT;
+}
+
+int xdp_filter_add_prefix(const struct xdp_filter *filter,
+			  enum xdp_filter_dir dir, int family,
+			  const void *addr, __u32 prefixlen,
+			  enum xdp_filter_action action)
+{
+	struct lpm_v6_key key;
+	__u32 value = action;
+	int fd;
+
+	fd = prefix_key(filter, dir, family, addr, prefixlen, &key);
+	if (fd < 0)
+		return fd;
+
+	if (bpf_map_update_elem(fd, &key, &value, BPF_ANY))
+		return -errno;
+	return 0;
+}
+
+int xdp_filter_del_prefix(const struct xdp_filter *filter,
+			  enum xdp_filter_dir dir, int family,
+			  const void *addr, __u32 prefixlen)
+{
+	struct lpm_v6_key key;
+	int fd;
+
+	fd = prefix_key(filter, dir, family, addr, prefixlen, &key);
+	if (fd < 0)
+		return fd;
+
+	if (bpf_map_delete_elem(fd, &key))
+		return -errno;
+	return 0;
+}
+
+int xdp_filter_parse_action(const char *str)
+{
+	for (int i = 0; i < XDP_FILTER_ACTION_MAX; i++)
+		if (!strcmp(str, xdp_filter_action_names[i]))
+			return i;
+	return -EINVAL;
+}
+
+static int parse_addr(const char *str, void *addr)
+{
+	if (inet_pton(AF_INET, str, addr) == 1)
+		return AF_INET;
+	if (inet_pton(AF_INET6, str, addr) == 1)
+		return AF_INET6;
+	return -EINVAL;
+}
+
+static int add_flow_rule(const struct xdp_filter *filter,
+			 enum xdp_filter_action action, const char *proto,
+			 const char *saddr, unsigned int sport,
+			 const char *daddr, unsigned int dport)
+{
+	struct flow_key key = {};
+	int family;
+
+	if (!strcmp(proto, "tcp"))
+		key.proto = IPPROTO_TCP;
+	else if (!strcmp(proto, "udp"))
+		key.proto = IPPROTO_UDP;
+	else
+		key.proto = atoi(proto);
+
+	family = parse_addr(saddr, key.saddr);
+	if (family < 0 || parse_addr(daddr, key.daddr) != family ||
+	    sport > 0xffff || dport > 0xffff)
+		return -EINVAL;
+
+	key.family = family;
+	key.sport = htons(sport);
+	key.dport = htons(dport);
+	return xdp_filter_add_flow(filter, &key, action);
+}
+
+int xdp_filter_add_rule(const struct xdp_filter *filter, const char *rule)
+{
+	char action_str[16], type[8], proto[8], saddr[INET6_ADDRSTRLEN + 4], daddr[INET6_ADDRSTRLEN];
+	unsigned int sport, dport, prefixlen;
+	__u8 addr[16];
+	char *slash;
+	int action, family;
+
+	if (sscanf(rule, "%15s %7s", action_str, type) != 2)
+		return -EINVAL;
+
+	action = xdp_filter_parse_action(action_str);
+	if (action < 0)
+		return action;
+
+	if (!strcmp(type, "flow")) {
+		if (sscanf(rule, "%*s %*s %7s %45s %u %45s %u",
+			   proto, saddr, &sport, daddr, &dport) != 5)
+			return -EINVAL;
+		return add_flow_rule(filter, action, proto, saddr, sport,
+				     daddr, dport);
+	}
+
+	if (strcmp(type, "dst") && strcmp(type, "src"))
+		return -EINVAL;
+	if (sscanf(rule, "%*s %*s %49s", saddr) != 1)
+		return -EINVAL;
+
+	slash = strchr(saddr, '/');
+	if (slash)
+		*slash = '\0';
+
+	family = parse_addr(saddr, addr);
+	if (family < 0)
+		return family;
+
+	prefixlen = family == AF_INET ? 32 : 128;
+	if (slash)
+		prefixlen = atoi(slash + 1);
+
+	return xdp_filter_add_prefix(filter,
+				     !strcmp(type, "dst") ? XDP_FILTER_DST : XDP_FILTER_SRC,
+				     family, addr, prefixlen, action);
+}
+
@@ -2,6 +2,8 @@
 #ifndef __COMMON_USER_BPF_XDP_H
 #define __COMMON_USER_BPF_XDP_H
 
+#include "xdp_filter_kern_user.h"
+
 struct bpf_object *load_bpf_object_file(const char *filename, int ifindex);
 struct xdp_program *load_bpf_and_xdp_attach(struct config *cfg);
 
@@ -15,4 +17,35 @@ int open_bpf_map_file(const char *pin_dir,
 		      struct bpf_map_info *info);
 int do_unload(struct config *cfg);
 
+/* File descriptors of the flow filter maps in af_xdp_kern.o */
+struct xdp_filter {
+	int flows_fd;
+	int v4_fd;
+	int v6_fd;
+	int default_fd;
+};
+
+int xdp_filter_open(struct bpf_object *obj, struct xdp_filter *filter);
+int xdp_filter_set_default(const struct xdp_filter *filter,
+			   enum xdp_filter_action action);
+int xdp_filter_add_flow(const struct xdp_filter *filter,
+			const struct flow_key *key,
+			enum xdp_filter_action action);
+int xdp_filter_del_flow(const struct xdp_filter *filter,
+			const struct flow_key *key);
+/* addr is an in_addr (family AF_INET) or in6_addr (AF_INET6) */
+int xdp_filter_add_prefix(const struct xdp_filter *filter,
+			  enum xdp_filter_dir dir, int family,
+			  const void *addr, __u32 prefixlen,
+			  enum xdp_filter_action action);
+int xdp_filter_del_prefix(const struct xdp_filter *filter,
+			  enum xdp_filter_dir dir, int family,
+			  const void *addr, __u32 prefixlen);
+int xdp_filter_parse_action(const char *str);
+/* Adds a rule given as text, either
+ *   <action> dst|src <addr>[/<prefixlen>]
+ *   <action> flow tcp|udp|<proto> <saddr> <sport> <daddr> <dport>
+ * with action one of redirect, pass or drop. */
+int xdp_filter_add_rule(const struct xdp_filter *filter, const char *rule);
+
 #endif /* __COMMON_USER_BPF_XDP_H */
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: (GPL-2.0-or-later OR BSD-2-clause) */
+/*
+ * Internet checksum helpers for the userspace packet paths. The functions are
+ * static inline and fully defined in this header so every user gets its own
+ * copy and the compiler can fold them into the caller.
+ */
+
+#ifndef __CSUM_HELPERS_H
+#define __CSUM_HELPERS_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+static inline __sum16 csum16_add(__sum16 csum, __be16 addend)
+{
+	uint16_t res = (uint16_t)csum;
+
+	res += (__u16)addend;
+	return (__sum16)(res + (res < (__u16)addend));
+}
+
+static inline __sum16 csum16_sub(__sum16 csum, __be16 addend)
+{
+	return csum16_add(csum, ~addend);
+}
+
+/* Updates *sum for a 16 bit field of the covered data changing from old to
+ * new (RFC 1624) */
+static inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new)
+{
+	*sum = ~csum16_add(csum16_sub(~(*sum), old), new);
+}
+
+/* As csum_replace2() for a 32 bit field */
+static inline void csum_replace4(__sum16 *sum, __be32 old, __be32 new)
+{
+	__sum16 res = csum16_sub(~(*sum), (__be16)(old >> 16));
+
+	res = csum16_sub(res, (__be16)old);
+	res = csum16_add(res, (__be16)(new >> 16));
+	*sum = ~csum16_add(res, (__be16)new);
+}
+
+#endif /* __CSUM_HELPERS_H */
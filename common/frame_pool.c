@@ -0,0 +1,218 @@
+#include "frame_pool.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/if_xdp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+static uint32_t _move_head(struct frame_pool_headtail *const ht, struct frame_pool_headtail *const other,
+                           const uint32_t capacity, uint32_t n, uint32_t *const old_head);
+static void _update_tail(struct frame_pool_headtail *const ht, const uint32_t old_head, const uint32_t n);
+static uint32_t _cache_refill(struct frame_cache *const cache);
+static void _cache_spill(struct frame_cache *const cache, const uint32_t n);
+
+struct frame_pool *frame_pool_create(const uint32_t num_frames, const uint32_t frame_size)
+{
+    uint32_t size = 1;
+    uint32_t frame_shift = 0;
+
+    /* Frame addresses are index << frame_shift, which also strips the
+     * packet offset the kernel adds to RX descriptors in aligned mode. In
+     * unaligned mode it sits above XSK_UNALIGNED_BUF_ADDR_MASK instead. */
+    if (num_frames == 0 || frame_size == 0 || (frame_size & (frame_size - 1)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    while (size < num_frames)
+        size <<= 1;
+    while ((1U << frame_shift) < frame_size)
+        frame_shift++;
+
+    const size_t alloc_size = (sizeof(struct frame_pool) + size * sizeof(uint32_t) + CACHE_LINE_SIZE - 1)
+                              & ~(size_t)(CACHE_LINE_SIZE - 1);
+    struct frame_pool *const pool = aligned_alloc(CACHE_LINE_SIZE, alloc_size);
+    if (!pool)
+        return NULL;
+
+    atomic_init(&pool->prod.head, 0);
+    atomic_init(&pool->prod.tail, 0);
+    atomic_init(&pool->cons.head, 0);
+    atomic_init(&pool->cons.tail, 0);
+    pool->size = size;
+    pool->mask = size - 1;
+    pool->num_frames = num_frames;
+    pool->frame_shift = frame_shift;
+
+    for (uint32_t i = 0; i < num_frames; i++)
+        pool->ring[i] = i;
+    atomic_store(&pool->prod.head, num_frames);
+    atomic_store(&pool->prod.tail, num_frames);
+
+    return pool;
+}
+
+void frame_pool_destroy(struct frame_pool *const pool)
+{
+    free(pool);
+}
+
+uint32_t frame_pool_get_bulk(struct frame_pool *const pool, uint32_t *const frames, const uint32_t n)
+{
+    uint32_t head;
+    const uint32_t got = _move_head(&pool->cons, &pool->prod, 0, n, &head);
+
+    for (uint32_t i = 0; i < got; i++)
+        frames[i] = pool->ring[(head + i) & pool->mask];
+
+    if (got)
+        _update_tail(&pool->cons, head, got);
+    return got;
+}
+
+uint32_t frame_pool_put_bulk(struct frame_pool *const pool, const uint32_t *const frames, const uint32_t n)
+{
+    uint32_t head;
+    const uint32_t put = _move_head(&pool->prod, &pool->cons, pool->size, n, &head);
+
+    for (uint32_t i = 0; i < put; i++)
+        pool->ring[(head + i) & pool->mask] = frames[i];
+
+    if (put)
+        _update_tail(&pool->prod, head, put);
+    return put;
+}
+
+uint32_t frame_pool_count(const struct frame_pool *const pool)
+{
+    const uint32_t prod_tail = atomic_load_explicit(&pool->prod.tail, memory_order_acquire);
+    const uint32_t cons_head = atomic_load_explicit(&pool->cons.head, memory_order_acquire);
+    const uint32_t count = prod_tail - cons_head;
+
+    /* Both indices race ahead independently, never report garbage */
+    return count > pool->num_frames ? 0 : count;
+}
+
+/* Claims up to n slots on one side of the ring. For producers the slots
+ * available are the free ones (capacity + consumer tail - producer head),
+ * for consumers the filled ones (producer tail - consumer head). */
+static uint32_t _move_head(struct frame_pool_headtail *const ht, struct frame_pool_headtail *const other,
+                           const uint32_t capacity, uint32_t n, uint32_t *const old_head)
+{
+    uint32_t head = atomic_load_explicit(&ht->head, memory_order_relaxed);
+
+    do
+    {
+        atomic_thread_fence(memory_order_acquire);
+        const uint32_t other_tail = atomic_load_explicit(&other->tail, memory_order_acquire);
+        const uint32_t entries = capacity + other_tail - head;
+
+        if (n > entries)
+            n = entries;
+        if (n == 0)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&ht->head, &head, head + n,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    *old_head = head;
+    return n;
+}
+
+/* Publishes a claimed range once every earlier claim on this side is done */
+static void _update_tail(struct frame_pool_headtail *const ht, const uint32_t old_head, const uint32_t n)
+{
+    while (atomic_load_explicit(&ht->tail, memory_order_relaxed) != old_head)
+        cpu_relax();
+
+    atomic_store_explicit(&ht->tail, old_head + n, memory_order_release);
+}
+
+void frame_cache_init(struct frame_cache *const cache, struct frame_pool *const pool)
+{
+    cache->pool = pool;
+    cache->count = 0;
+}
+
+uint64_t frame_cache_alloc(struct frame_cache *const cache)
+{
+    if (cache->count == 0 && _cache_refill(cache) == 0)
+        return INVALID_UMEM_FRAME;
+
+    return (uint64_t)cache->frames[--cache->count] << cache->pool->frame_shift;
+}
+
+void frame_cache_free(struct frame_cache *const cache, const uint64_t addr)
+{
+    if (cache->count == FRAME_CACHE_SIZE)
+        _cache_spill(cache, FRAME_CACHE_BATCH);
+
+    cache->frames[cache->count++] = (addr & XSK_UNALIGNED_BUF_ADDR_MASK) >> cache->pool->frame_shift;
+}
+
+uint32_t frame_cache_alloc_bulk(struct frame_cache *const cache, uint64_t *const addrs, const uint32_t n)
+{
+    const uint32_t frame_shift = cache->pool->frame_shift;
+    uint32_t done = 0;
+
+    while (done < n)
+    {
+        if (cache->count == 0 && _cache_refill(cache) == 0)
+            break;
+
+        const uint32_t chunk = n - done < cache->count ? n - done : cache->count;
+        for (uint32_t i = 0; i < chunk; i++)
+            addrs[done++] = (uint64_t)cache->frames[--cache->count] << frame_shift;
+    }
+
+    return done;
+}
+
+void frame_cache_free_bulk(struct frame_cache *const cache, const uint64_t *const addrs, const uint32_t n)
+{
+    const uint32_t frame_shift = cache->pool->frame_shift;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (cache->count == FRAME_CACHE_SIZE)
+            _cache_spill(cache, FRAME_CACHE_BATCH);
+
+        cache->frames[cache->count++] = (addrs[i] & XSK_UNALIGNED_BUF_ADDR_MASK) >> frame_shift;
+    }
+}
+
+void frame_cache_flush(struct frame_cache *const cache)
+{
+    _cache_spill(cache, cache->count);
+}
+
+uint32_t frame_cache_available(const struct frame_cache *const cache)
+{
+    return cache->count + frame_pool_count(cache->pool);
+}
+
+static uint32_t _cache_refill(struct frame_cache *const cache)
+{
+    cache->count = frame_pool_get_bulk(cache->pool, cache->frames, FRAME_CACHE_BATCH);
+    return cache->count;
+}
+
+/* Returns the n oldest (coldest) cached frames to the pool */
+static void _cache_spill(struct frame_cache *const cache, const uint32_t n)
+{
+    uint32_t put = 0;
+
+    /* The ring has room for every frame of the pool, so this can't spin long */
+    while (put < n)
+        put += frame_pool_put_bulk(cache->pool, cache->frames + put, n - put);
+
+    cache->count -= n;
+    memmove(cache->frames, cache->frames + n, cache->count * sizeof(cache->frames[0]));
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define INVALID_UMEM_FRAME UINT64_MAX
+#define FRAME_CACHE_SIZE 256
+/* Frames moved between a cache and its pool per refill or flush */
+#define FRAME_CACHE_BATCH (FRAME_CACHE_SIZE / 2)
+#define CACHE_LINE_SIZE 64
+
+/* Multi-producer/multi-consumer ring of free UMEM frame indices, safe to
+ * share between any number of threads and sockets. Producers and consumers
+ * each claim a range with a CAS on their head and publish it by advancing
+ * their tail in order, so a bulk operation costs one CAS however many
+ * frames it moves. */
+struct frame_pool_headtail
+{
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct frame_pool
+{
+    struct frame_pool_headtail prod;
+    struct frame_pool_headtail cons;
+    uint32_t size;
+    uint32_t mask;
+    uint32_t num_frames;
+    uint32_t frame_shift;
+    uint32_t ring[];
+};
+
+/* Single-thread magazine in front of a frame_pool. Only the owning thread
+ * may touch it; it goes to the shared pool once per FRAME_CACHE_BATCH
+ * frames. Frames are reused LIFO so the most recently freed, and likely
+ * cache-hot, frame is handed out first. */
+struct frame_cache
+{
+    struct frame_pool *pool;
+    uint32_t count;
+    uint32_t frames[FRAME_CACHE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct frame_pool *frame_pool_create(const uint32_t num_frames, const uint32_t frame_size);
+void frame_pool_destroy(struct frame_pool *const pool);
+/* Moves up to n frame indices out of / into the pool, returns the number moved */
+uint32_t frame_pool_get_bulk(struct frame_pool *const pool, uint32_t *const frames, const uint32_t n);
+uint32_t frame_pool_put_bulk(struct frame_pool *const pool, const uint32_t *const frames, const uint32_t n);
+uint32_t frame_pool_count(const struct frame_pool *const pool);
+
+void frame_cache_init(struct frame_cache *const cache, struct frame_pool *const pool);
+uint64_t frame_cache_alloc(struct frame_cache *const cache);
+void frame_cache_free(struct frame_cache *const cache, const uint64_t addr);
+uint32_t frame_cache_alloc_bulk(struct frame_cache *const cache, uint64_t *const addrs, const uint32_t n);
+void frame_cache_free_bulk(struct frame_cache *const cache, const uint64_t *const addrs, const uint32_t n);
+/* Returns every cached frame to the pool, e.g. before the owning thread exits */
+void frame_cache_flush(struct frame_cache *const cache);
+uint32_t frame_cache_available(const struct frame_cache *const cache);
\ No newline at end of file
@@ -0,0 +1,63 @@
+#include "latency_hist.h"
+
+static uint64_t _bucket_low(const unsigned int index);
+
+void latency_hist_snapshot(const struct latency_hist *const hist, struct latency_hist *const snapshot)
+{
+    snapshot->count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    snapshot->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    for (unsigned int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+        snapshot->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+}
+
+void latency_hist_delta(const struct latency_hist *const now, const struct latency_hist *const before,
+                        struct latency_hist *const delta)
+{
+    delta->count = 0;
+    delta->max = now->max;
+    for (unsigned int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+    {
+        delta->buckets[i] = now->buckets[i] - before->buckets[i];
+        delta->count += delta->buckets[i];
+    }
+}
+
+uint64_t latency_hist_percentile(const struct latency_hist *const hist, const double percentile)
+{
+    /* Walk the buckets rather than trust count, a snapshot taken while
+     * recording may have count and buckets a few values apart */
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+        total += hist->buckets[i];
+
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+        {
+            const uint64_t low = _bucket_low(i);
+            const uint64_t high = i + 1 < LATENCY_HIST_BUCKETS ? _bucket_low(i + 1) : UINT64_MAX;
+            return low + (high - low) / 2;
+        }
+    }
+
+    return hist->max;
+}
+
+static uint64_t _bucket_low(const unsigned int index)
+{
+    const unsigned int block = index >> LATENCY_HIST_SUB_BITS;
+    if (block == 0)
+        return index;
+
+    const unsigned int shift = block - 1;
+    return ((uint64_t)(index & (LATENCY_HIST_SUB_COUNT - 1)) + LATENCY_HIST_SUB_COUNT) << shift;
+}
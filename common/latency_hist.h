@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Log-linear histogram in the style of HdrHistogram: every power of two is
+ * split into 2^LATENCY_HIST_SUB_BITS linear buckets, so values are recorded
+ * with about 3% precision from 1 ns up to the full uint64_t range. */
+#define LATENCY_HIST_SUB_BITS 5
+#define LATENCY_HIST_SUB_COUNT (1U << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS ((64 - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB_COUNT)
+
+/* Like the other per-thread counters one thread records and any other may
+ * take snapshots, all accesses are relaxed atomics */
+struct latency_hist
+{
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+static inline unsigned int latency_hist_index(const uint64_t value)
+{
+    if (value < LATENCY_HIST_SUB_COUNT)
+        return value;
+
+    const unsigned int shift = 63 - __builtin_clzll(value) - LATENCY_HIST_SUB_BITS;
+    return ((shift + 1) << LATENCY_HIST_SUB_BITS) + (value >> shift) - LATENCY_HIST_SUB_COUNT;
+}
+
+static inline void latency_hist_record(struct latency_hist *const hist, const uint64_t value)
+{
+    uint64_t *const bucket = &hist->buckets[latency_hist_index(value)];
+
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+void latency_hist_snapshot(const struct latency_hist *const hist, struct latency_hist *const snapshot);
+/* Counts recorded between two snapshots. max is that of now, the histogram
+ * doesn't keep enough to know the interval's maximum. */
+void latency_hist_delta(const struct latency_hist *const now, const struct latency_hist *const before,
+                        struct latency_hist *const delta);
+/* Value below which percentile (0-100) of the recorded values fall, as the
+ * midpoint of the bucket it lands in. 0 for an empty histogram. */
+uint64_t latency_hist_percentile(const struct latency_hist *const hist, const double percentile);
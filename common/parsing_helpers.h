@@ -100,13 +100,16 @@ static __always_inline int parse_ethhdr_vlan(struct hdr_cursor *nh,
 
 	/* Use loop unrolling to avoid the verifier restriction on loops;
 	 * support up to VLAN_MAX_DEPTH layers of VLAN encapsulation.
+	 * gcc, building the userspace users, has no such pragma.
 	 */
+#ifdef __clang__
 	#pragma unroll
+#endif
 	for (i = 0; i < VLAN_MAX_DEPTH; i++) {
 		if (!proto_is_vlan(h_proto))
 			break;
 
-		if (vlh + 1 > data_end)
+		if ((void *)(vlh + 1) > data_end)
 			break;
 
 		h_proto = vlh->h_vlan_encapsulated_proto;
@@ -139,7 +142,7 @@ static __always_inline int parse_ip6hdr(struct hdr_cursor *nh,
 	 * thing being pointed to. We will be using this style in the remainder
 	 * of the tutorial.
 	 */
-	if (ip6h + 1 > data_end)
+	if ((void *)(ip6h + 1) > data_end)
 		return -1;
 
 	nh->pos = ip6h + 1;
@@ -155,7 +158,7 @@ static __always_inline int parse_iphdr(struct hdr_cursor *nh,
 	struct iphdr *iph = nh->pos;
 	int hdrsize;
 
-	if (iph + 1 > data_end)
+	if ((void *)(iph + 1) > data_end)
 		return -1;
 
 	hdrsize = iph->ihl * 4;
@@ -179,7 +182,7 @@ static __always_inline int parse_icmp6hdr(struct hdr_cursor *nh,
 {
 	struct icmp6hdr *icmp6h = nh->pos;
 
-	if (icmp6h + 1 > data_end)
+	if ((void *)(icmp6h + 1) > data_end)
 		return -1;
 
 	nh->pos   = icmp6h + 1;
@@ -194,7 +197,7 @@ static __always_inline int parse_icmphdr(struct hdr_cursor *nh,
 {
 	struct icmphdr *icmph = nh->pos;
 
-	if (icmph + 1 > data_end)
+	if ((void *)(icmph + 1) > data_end)
 		return -1;
 
 	nh->pos  = icmph + 1;
@@ -209,7 +212,7 @@ static __always_inline int parse_icmphdr_common(struct hdr_cursor *nh,
 {
 	struct icmphdr_common *h = nh->pos;
 
-	if (h + 1 > data_end)
+	if ((void *)(h + 1) > data_end)
 		return -1;
 
 	nh->pos  = h + 1;
@@ -228,7 +231,7 @@ static __always_inline int parse_udphdr(struct hdr_cursor *nh,
 	int len;
 	struct udphdr *h = nh->pos;
 
-	if (h + 1 > data_end)
+	if ((void *)(h + 1) > data_end)
 		return -1;
 
 	nh->pos  = h + 1;
@@ -251,7 +254,7 @@ static __always_inline int parse_tcphdr(struct hdr_cursor *nh,
 	int len;
 	struct tcphdr *h = nh->pos;
 
-	if (h + 1 > data_end)
+	if ((void *)(h + 1) > data_end)
 		return -1;
 
 	len = h->doff * 4;
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+
+#include "pcap_reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NANOSEC_PER_SEC 1000000000ULL
+#define PCAP_FILE_HEADER_LEN 24
+#define PCAP_RECORD_HEADER_LEN 16
+/* Block type and length in front, length again at the end */
+#define PCAPNG_BLOCK_OVERHEAD 12
+#define PCAPNG_SHB_MIN_LEN 28
+#define PCAPNG_IDB_MIN_LEN 20
+#define PCAPNG_SPB_MIN_LEN 16
+#define PCAPNG_EPB_MIN_LEN 32
+/* if_tsresol's default, microseconds */
+#define PCAPNG_DEFAULT_TSRESOL 6
+
+static bool _next_pcap(struct pcap_reader *const reader, struct pcap_packet *const packet);
+static bool _next_pcapng(struct pcap_reader *const reader, struct pcap_packet *const packet);
+static bool _read_shb(struct pcap_reader *const reader, const uint8_t *const block, const uint32_t len);
+static void _read_idb(struct pcap_reader *const reader, const uint8_t *const block, const uint32_t len);
+static uint64_t _tsresol_units(const uint8_t tsresol);
+static uint64_t _units_to_ns(const uint64_t timestamp, const uint64_t units_per_s);
+static uint16_t _u16(const struct pcap_reader *const reader, const uint8_t *const p);
+static uint32_t _u32(const struct pcap_reader *const reader, const uint8_t *const p);
+
+struct pcap_reader *pcap_reader_open(const char *const path)
+{
+    struct stat st;
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Can't open %s \"%s\"\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) || st.st_size < PCAP_FILE_HEADER_LEN)
+    {
+        fprintf(stderr, "ERROR: %s is too short to be a capture file\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    /* The mapping outlives the descriptor */
+    const uint8_t *const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Can't map %s \"%s\"\n", path, strerror(errno));
+        return NULL;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    struct pcap_reader *const reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+    {
+        munmap((void *)map, st.st_size);
+        return NULL;
+    }
+
+    reader->map = map;
+    reader->size = st.st_size;
+
+    uint32_t magic;
+    memcpy(&magic, map, sizeof(magic));
+
+    if (magic == PCAPNG_BLOCK_SHB)
+    {
+        /* Byte order and interfaces come from the blocks as they're read */
+        reader->format = PCAP_FORMAT_PCAPNG;
+        reader->start = 0;
+    }
+    else if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC || __builtin_bswap32(magic) == PCAP_MAGIC_USEC ||
+             __builtin_bswap32(magic) == PCAP_MAGIC_NSEC)
+    {
+        reader->format = PCAP_FORMAT_PCAP;
+        reader->start = PCAP_FILE_HEADER_LEN;
+        reader->swapped = magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC;
+        reader->num_interfaces = 1;
+        reader->interfaces[0].snaplen = _u32(reader, map + 16);
+        reader->interfaces[0].linktype = _u32(reader, map + 20);
+        reader->interfaces[0].units_per_s =
+            (reader->swapped ? __builtin_bswap32(magic) : magic) == PCAP_MAGIC_NSEC ? NANOSEC_PER_SEC : 1000000;
+
+        if (reader->interfaces[0].linktype != LINKTYPE_ETHERNET)
+        {
+            fprintf(stderr, "ERROR: %s isn't an Ethernet capture (link type %u)\n", path,
+                    reader->interfaces[0].linktype);
+            pcap_reader_close(reader);
+            return NULL;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: %s isn't a pcap or pcapng file\n", path);
+        pcap_reader_close(reader);
+        return NULL;
+    }
+
+    reader->offset = reader->start;
+    return reader;
+}
+
+void pcap_reader_close(struct pcap_reader *const reader)
+{
+    munmap((void *)reader->map, reader->size);
+    free(reader);
+}
+
+bool pcap_reader_next(struct pcap_reader *const reader, struct pcap_packet *const packet)
+{
+    if (reader->format == PCAP_FORMAT_PCAP)
+        return _next_pcap(reader, packet);
+
+    return _next_pcapng(reader, packet);
+}
+
+/* pcapng sections are read again from the top, so their interfaces are
+ * rebuilt on the way */
+void pcap_reader_rewind(struct pcap_reader *const reader)
+{
+    reader->offset = reader->start;
+    if (reader->format == PCAP_FORMAT_PCAPNG)
+        reader->num_interfaces = 0;
+}
+
+static bool _next_pcap(struct pcap_reader *const reader, struct pcap_packet *const packet)
+{
+    const struct pcap_interface *const interface = &reader->interfaces[0];
+
+    while (reader->offset + PCAP_RECORD_HEADER_LEN <= reader->size)
+    {
+        const uint8_t *const record = reader->map + reader->offset;
+        const uint32_t caplen = _u32(reader, record + 8);
+
+        if (caplen > reader->size - reader->offset - PCAP_RECORD_HEADER_LEN)
+            break;
+
+        reader->offset += PCAP_RECORD_HEADER_LEN + caplen;
+
+        packet->data = record + PCAP_RECORD_HEADER_LEN;
+        packet->caplen = caplen;
+        packet->len = _u32(reader, record + 12);
+        packet->timestamp_ns = _u32(reader, record) * NANOSEC_PER_SEC +
+                               _u32(reader, record + 4) * (NANOSEC_PER_SEC / interface->units_per_s);
+        reader->last_timestamp_ns = packet->timestamp_ns;
+        return true;
+    }
+
+    reader->truncated = reader->offset != reader->size;
+    return false;
+}
+
+static bool _next_pcapng(struct pcap_reader *const reader, struct pcap_packet *const packet)
+{
+    while (reader->offset + PCAPNG_BLOCK_OVERHEAD <= reader->size)
+    {
+        const uint8_t *const block = reader->map + reader->offset;
+        uint32_t type;
+
+        memcpy(&type, block, sizeof(type));
+
+        /* A section header sets the byte order for itself and what follows */
+        if (type == PCAPNG_BLOCK_SHB && !_read_shb(reader, block, reader->size - reader->offset))
+            break;
+
+        const uint32_t len = _u32(reader, block + 4);
+        if (len < PCAPNG_BLOCK_OVERHEAD || len % 4 || len > reader->size - reader->offset)
+            break;
+
+        reader->offset += len;
+        type = _u32(reader, block);
+
+        if (type == PCAPNG_BLOCK_IDB)
+        {
+            _read_idb(reader, block, len);
+        }
+        else if (type == PCAPNG_BLOCK_EPB && len >= PCAPNG_EPB_MIN_LEN)
+        {
+            const uint32_t interface_id = _u32(reader, block + 8);
+            const uint32_t caplen = _u32(reader, block + 20);
+
+            if (interface_id >= reader->num_interfaces || caplen > len - PCAPNG_EPB_MIN_LEN)
+            {
+                reader->skipped++;
+                continue;
+            }
+
+            const struct pcap_interface *const interface = &reader->interfaces[interface_id];
+            if (interface->linktype != LINKTYPE_ETHERNET)
+            {
+                reader->skipped++;
+                continue;
+            }
+
+            const uint64_t timestamp = (uint64_t)_u32(reader, block + 12) << 32 | _u32(reader, block + 16);
+
+            packet->data = block + 28;
+            packet->caplen = caplen;
+            packet->len = _u32(reader, block + 24);
+            packet->timestamp_ns = _units_to_ns(timestamp, interface->units_per_s);
+            reader->last_timestamp_ns = packet->timestamp_ns;
+            return true;
+        }
+        else if (type == PCAPNG_BLOCK_SPB && len >= PCAPNG_SPB_MIN_LEN)
+        {
+            /* Simple packets belong to the first interface and carry no
+             * time, they're given the previous packet's */
+            if (reader->num_interfaces == 0 || reader->interfaces[0].linktype != LINKTYPE_ETHERNET)
+            {
+                reader->skipped++;
+                continue;
+            }
+
+            const uint32_t origlen = _u32(reader, block + 8);
+            const uint32_t snaplen = reader->interfaces[0].snaplen;
+            uint32_t caplen = len - PCAPNG_SPB_MIN_LEN;
+
+            if (origlen < caplen)
+                caplen = origlen;
+            if (snaplen && snaplen < caplen)
+                caplen = snaplen;
+
+            packet->data = block + 12;
+            packet->caplen = caplen;
+            packet->len = origlen;
+            packet->timestamp_ns = reader->last_timestamp_ns;
+            return true;
+        }
+    }
+
+    reader->truncated = reader->offset != reader->size;
+    return false;
+}
+
+static bool _read_shb(struct pcap_reader *const reader, const uint8_t *const block, const uint32_t len)
+{
+    uint32_t byte_order_magic;
+
+    if (len < PCAPNG_SHB_MIN_LEN)
+        return false;
+
+    memcpy(&byte_order_magic, block + 8, sizeof(byte_order_magic));
+    if (byte_order_magic == PCAPNG_BYTE_ORDER_MAGIC)
+        reader->swapped = false;
+    else if (__builtin_bswap32(byte_order_magic) == PCAPNG_BYTE_ORDER_MAGIC)
+        reader->swapped = true;
+    else
+        return false;
+
+    /* Interface ids start over in every section */
+    reader->num_interfaces = 0;
+    return true;
+}
+
+static void _read_idb(struct pcap_reader *const reader, const uint8_t *const block, const uint32_t len)
+{
+    if (len < PCAPNG_IDB_MIN_LEN || reader->num_interfaces == PCAP_READER_MAX_INTERFACES)
+        return;
+
+    struct pcap_interface *const interface = &reader->interfaces[reader->num_interfaces++];
+    interface->linktype = _u16(reader, block + 8);
+    interface->snaplen = _u32(reader, block + 12);
+    interface->units_per_s = _tsresol_units(PCAPNG_DEFAULT_TSRESOL);
+
+    /* Options run from after snaplen up to the trailing length */
+    const uint8_t *option = block + 16;
+    const uint8_t *const end = block + len - 4;
+
+    while (option + 4 <= end)
+    {
+        const uint16_t code = _u16(reader, option);
+        const uint16_t option_len = _u16(reader, option + 2);
+
+        if (code == PCAPNG_OPT_END || option + 4 + option_len > end)
+            break;
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && option_len >= 1)
+            interface->units_per_s = _tsresol_units(option[4]);
+
+        option += 4 + ((option_len + 3) & ~3U);
+    }
+}
+
+/* The top bit picks a power of two, otherwise it's a power of ten */
+static uint64_t _tsresol_units(const uint8_t tsresol)
+{
+    const unsigned int exponent = tsresol & 0x7f;
+    uint64_t units = 1;
+
+    if (tsresol & 0x80)
+        return exponent < 64 ? 1ULL << exponent : 1;
+
+    for (unsigned int i = 0; i < exponent && i < 19; i++)
+        units *= 10;
+
+    return units;
+}
+
+static uint64_t _units_to_ns(const uint64_t timestamp, const uint64_t units_per_s)
+{
+    const uint64_t seconds = timestamp / units_per_s;
+    const uint64_t fraction = timestamp % units_per_s;
+
+    return seconds * NANOSEC_PER_SEC + (uint64_t)((unsigned __int128)fraction * NANOSEC_PER_SEC / units_per_s);
+}
+
+static uint16_t _u16(const struct pcap_reader *const reader, const uint8_t *const p)
+{
+    uint16_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap16(value) : value;
+}
+
+static uint32_t _u32(const struct pcap_reader *const reader, const uint8_t *const p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap32(value) : value;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pcap_writer.h"
+
+/* pcapng interfaces tracked per section, packets on others are skipped */
+#define PCAP_READER_MAX_INTERFACES 64
+
+/* Points into the mapped file, valid until the reader is closed */
+struct pcap_packet
+{
+    const uint8_t *data;
+    uint32_t caplen;
+    uint32_t len;
+    uint64_t timestamp_ns;
+};
+
+struct pcap_interface
+{
+    uint32_t linktype;
+    uint32_t snaplen;
+    /* Timestamp units per second, from if_tsresol */
+    uint64_t units_per_s;
+};
+
+/* Reads pcap (microsecond or nanosecond, either byte order) and pcapng
+ * files in place from a read-only mapping, so replaying a trace never
+ * copies it through a read buffer. Only Ethernet packets are returned,
+ * others and blocks it doesn't know are skipped. */
+struct pcap_reader
+{
+    const uint8_t *map;
+    size_t size;
+    size_t offset;
+    /* Where the first record starts, for rewinding */
+    size_t start;
+    enum pcap_format format;
+    /* The current section is in the other byte order */
+    bool swapped;
+    /* Classic pcap has one interface, pcapng one per IDB of the section */
+    unsigned int num_interfaces;
+    struct pcap_interface interfaces[PCAP_READER_MAX_INTERFACES];
+    uint64_t last_timestamp_ns;
+    uint64_t skipped;
+    /* The file ends in a partial or malformed record */
+    bool truncated;
+};
+
+struct pcap_reader *pcap_reader_open(const char *const path);
+void pcap_reader_close(struct pcap_reader *const reader);
+/* Returns the next Ethernet packet, false at the end of the file */
+bool pcap_reader_next(struct pcap_reader *const reader, struct pcap_packet *const packet);
+void pcap_reader_rewind(struct pcap_reader *const reader);
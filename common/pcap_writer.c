@@ -0,0 +1,616 @@
+#define _GNU_SOURCE
+
+#include "pcap_writer.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NANOSEC_PER_SEC 1000000000ULL
+/* How long the writer sleeps when no stream has a full buffer */
+#define WRITER_IDLE_NS 1000000
+
+struct pcap_file_header
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+/* Section header and one Ethernet interface with nanosecond timestamps */
+struct pcapng_file_header
+{
+    uint32_t shb_type;
+    uint32_t shb_len;
+    uint32_t byte_order_magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int64_t section_len;
+    uint32_t shb_len_trailer;
+
+    uint32_t idb_type;
+    uint32_t idb_len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint16_t tsresol_code;
+    uint16_t tsresol_len;
+    uint8_t tsresol[4];
+    uint16_t end_code;
+    uint16_t end_len;
+    uint32_t idb_len_trailer;
+} __attribute__((packed));
+
+/* Enhanced packet block up to the packet data, which is followed by
+ * padding to four bytes and the block length again */
+struct pcapng_record_header
+{
+    uint32_t type;
+    uint32_t len;
+    uint32_t interface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t origlen;
+};
+
+static bool _ring_init(struct pcap_ring *const ring, const uint32_t size);
+static bool _ring_push(struct pcap_ring *const ring, struct pcap_buffer *const buffer);
+static struct pcap_buffer *_ring_pop(struct pcap_ring *const ring);
+static uint32_t _ring_count(const struct pcap_ring *const ring);
+static uint32_t _file_header_len(const enum pcap_format format);
+static uint32_t _record_len(const enum pcap_format format, const uint32_t caplen);
+static uint64_t _room(const struct pcap_stream *const stream);
+static void _append(struct pcap_stream *const stream, const void *const src, const uint32_t len);
+static void _append_iov(struct pcap_stream *const stream, const struct iovec *const iov, const unsigned int iovcnt,
+                        uint32_t len);
+static void _begin_file(struct pcap_stream *const stream, const uint64_t now_ns);
+static void _end_file(struct pcap_stream *const stream);
+static bool _rotate_due(const struct pcap_stream *const stream, const uint32_t record_len, const uint64_t now_ns);
+static void *_write_loop(void *arg);
+static void _write_buffer(struct pcap_writer *const writer, struct pcap_stream *const stream,
+                          struct pcap_buffer *const buffer);
+static int _open_file(struct pcap_writer *const writer, struct pcap_stream *const stream);
+static bool _pwrite_all(const int fd, const uint8_t *buf, size_t len, uint64_t offset);
+static void _free_stream(struct pcap_stream *const stream);
+static void _counter_add(uint64_t *const counter, const uint64_t value);
+
+struct pcap_writer *pcap_writer_start(const struct pcap_config *const config, const unsigned int num_streams)
+{
+    if (config->buffer_size == 0 || config->buffer_size % PCAP_WRITER_ALIGN ||
+        config->num_buffers < 2 || config->num_buffers & (config->num_buffers - 1))
+    {
+        fprintf(stderr, "ERROR: pcap buffers must be a multiple of %u bytes and a power of two >= 2 of them\n",
+                PCAP_WRITER_ALIGN);
+        return NULL;
+    }
+
+    /* A record never needs more than the current buffer and one more */
+    if (_record_len(config->format, config->snaplen) + _file_header_len(config->format) > config->buffer_size)
+    {
+        fprintf(stderr, "ERROR: snaplen %u doesn't fit a %u byte pcap buffer\n", config->snaplen,
+                config->buffer_size);
+        return NULL;
+    }
+
+    struct pcap_writer *const writer = aligned_alloc(64, sizeof(*writer) + num_streams * sizeof(writer->streams[0]));
+    if (writer == NULL)
+        return NULL;
+
+    memset(writer, 0, sizeof(*writer) + num_streams * sizeof(writer->streams[0]));
+    writer->config = *config;
+    writer->num_streams = num_streams;
+
+    for (unsigned int s = 0; s < num_streams; s++)
+    {
+        struct pcap_stream *const stream = &writer->streams[s];
+
+        stream->writer = writer;
+        stream->id = s;
+        stream->fd = -1;
+
+        if (!_ring_init(&stream->full, config->num_buffers) || !_ring_init(&stream->free, config->num_buffers))
+            goto error_exit;
+
+        for (uint32_t b = 0; b < config->num_buffers; b++)
+        {
+            struct pcap_buffer *const buffer = calloc(1, sizeof(*buffer));
+            if (buffer == NULL)
+                goto error_exit;
+
+            /* Touched now so the RX thread never takes the page faults */
+            buffer->data = aligned_alloc(PCAP_WRITER_ALIGN, config->buffer_size);
+            if (buffer->data == NULL)
+            {
+                free(buffer);
+                goto error_exit;
+            }
+            memset(buffer->data, 0, config->buffer_size);
+            _ring_push(&stream->free, buffer);
+        }
+    }
+
+    const int ret = pthread_create(&writer->thread, NULL, _write_loop, writer);
+    if (ret)
+    {
+        errno = ret;
+        goto error_exit;
+    }
+
+    return writer;
+
+error_exit:
+    for (unsigned int s = 0; s < num_streams; s++)
+        _free_stream(&writer->streams[s]);
+    free(writer);
+    return NULL;
+}
+
+void pcap_writer_stop(struct pcap_writer *const writer)
+{
+    atomic_store_explicit(&writer->stop, true, memory_order_release);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->write_errors)
+        fprintf(stderr, "WARNING: %lu pcap buffer(s) couldn't be written\n", writer->write_errors);
+
+    for (unsigned int s = 0; s < writer->num_streams; s++)
+        _free_stream(&writer->streams[s]);
+    free(writer);
+}
+
+bool pcap_parse_format(const char *const name, enum pcap_format *const format)
+{
+    if (strcmp(name, "pcap") == 0)
+        *format = PCAP_FORMAT_PCAP;
+    else if (strcmp(name, "pcapng") == 0)
+        *format = PCAP_FORMAT_PCAPNG;
+    else
+        return false;
+
+    return true;
+}
+
+bool pcap_stream_write(struct pcap_stream *const stream, const uint8_t *const pkt, const uint32_t len,
+                       const uint64_t timestamp_ns)
+{
+    const struct iovec iov = {.iov_base = (void *)pkt, .iov_len = len};
+
+    return pcap_stream_writev(stream, &iov, 1, timestamp_ns);
+}
+
+bool pcap_stream_writev(struct pcap_stream *const stream, const struct iovec *const iov, const unsigned int iovcnt,
+                        const uint64_t timestamp_ns)
+{
+    const struct pcap_config *const config = &stream->writer->config;
+    uint32_t len = 0;
+
+    for (unsigned int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    const uint32_t caplen = len < config->snaplen ? len : config->snaplen;
+    const uint32_t record_len = _record_len(config->format, caplen);
+
+    if (stream->file_open && _rotate_due(stream, record_len, timestamp_ns))
+        _end_file(stream);
+
+    /* Check for room before writing anything so a dropped packet leaves no
+     * partial record behind */
+    const uint32_t needed = record_len + (stream->file_open ? 0 : _file_header_len(config->format));
+    if (_room(stream) < needed)
+    {
+        _counter_add(&stream->dropped, 1);
+        return false;
+    }
+
+    if (!stream->file_open)
+        _begin_file(stream, timestamp_ns);
+
+    if (config->format == PCAP_FORMAT_PCAP)
+    {
+        const struct pcap_record_header header = {
+            .ts_sec = timestamp_ns / NANOSEC_PER_SEC,
+            .ts_nsec = timestamp_ns % NANOSEC_PER_SEC,
+            .caplen = caplen,
+            .len = len,
+        };
+
+        _append(stream, &header, sizeof(header));
+        _append_iov(stream, iov, iovcnt, caplen);
+    }
+    else
+    {
+        const struct pcapng_record_header header = {
+            .type = PCAPNG_BLOCK_EPB,
+            .len = record_len,
+            .ts_high = timestamp_ns >> 32,
+            .ts_low = (uint32_t)timestamp_ns,
+            .caplen = caplen,
+            .origlen = len,
+        };
+        const uint32_t padding[1] = {0};
+
+        _append(stream, &header, sizeof(header));
+        _append_iov(stream, iov, iovcnt, caplen);
+        _append(stream, padding, -caplen & 3);
+        _append(stream, &record_len, sizeof(record_len));
+    }
+
+    stream->file_bytes += record_len;
+    _counter_add(&stream->packets, 1);
+    _counter_add(&stream->bytes, record_len);
+    return true;
+}
+
+void pcap_stream_tick(struct pcap_stream *const stream, const uint64_t now_ns)
+{
+    if (stream->file_open && _rotate_due(stream, 0, now_ns))
+        _end_file(stream);
+}
+
+void pcap_stream_close(struct pcap_stream *const stream)
+{
+    if (stream->file_open)
+        _end_file(stream);
+}
+
+static bool _ring_init(struct pcap_ring *const ring, const uint32_t size)
+{
+    ring->slots = calloc(size, sizeof(*ring->slots));
+    ring->mask = size - 1;
+    return ring->slots != NULL;
+}
+
+/* Every buffer is always in exactly one place, so neither ring can overflow */
+static bool _ring_push(struct pcap_ring *const ring, struct pcap_buffer *const buffer)
+{
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask)
+        return false;
+
+    ring->slots[head & ring->mask] = buffer;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+static struct pcap_buffer *_ring_pop(struct pcap_ring *const ring)
+{
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+
+    struct pcap_buffer *const buffer = ring->slots[tail & ring->mask];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return buffer;
+}
+
+static uint32_t _ring_count(const struct pcap_ring *const ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+static uint32_t _file_header_len(const enum pcap_format format)
+{
+    return format == PCAP_FORMAT_PCAP ? sizeof(struct pcap_file_header) : sizeof(struct pcapng_file_header);
+}
+
+static uint32_t _record_len(const enum pcap_format format, const uint32_t caplen)
+{
+    if (format == PCAP_FORMAT_PCAP)
+        return sizeof(struct pcap_record_header) + caplen;
+
+    return sizeof(struct pcapng_record_header) + ((caplen + 3) & ~3U) + sizeof(uint32_t);
+}
+
+/* Bytes the RX thread can write without waiting for the writer */
+static uint64_t _room(const struct pcap_stream *const stream)
+{
+    const uint32_t size = stream->writer->config.buffer_size;
+    const uint64_t current = stream->current ? size - stream->current->len : 0;
+
+    return current + (uint64_t)_ring_count(&stream->free) * size;
+}
+
+/* A full buffer is only handed over when more bytes follow, so the buffer
+ * ending a file is always the current one when the file is closed */
+static void _append(struct pcap_stream *const stream, const void *const src, const uint32_t len)
+{
+    const uint32_t size = stream->writer->config.buffer_size;
+    const uint8_t *data = src;
+    uint32_t left = len;
+
+    while (left)
+    {
+        if (stream->current == NULL || stream->current->len == size)
+        {
+            if (stream->current)
+                _ring_push(&stream->full, stream->current);
+            stream->current = _ring_pop(&stream->free);
+        }
+
+        struct pcap_buffer *const buffer = stream->current;
+        const uint32_t chunk = left < size - buffer->len ? left : size - buffer->len;
+
+        memcpy(buffer->data + buffer->len, data, chunk);
+        buffer->len += chunk;
+        data += chunk;
+        left -= chunk;
+    }
+}
+
+/* The first len bytes of the fragments, the captured part of a packet */
+static void _append_iov(struct pcap_stream *const stream, const struct iovec *const iov, const unsigned int iovcnt,
+                        uint32_t len)
+{
+    for (unsigned int i = 0; i < iovcnt && len; i++)
+    {
+        const uint32_t chunk = iov[i].iov_len < len ? iov[i].iov_len : len;
+
+        _append(stream, iov[i].iov_base, chunk);
+        len -= chunk;
+    }
+}
+
+/* Every file starts at the beginning of a fresh buffer, which keeps the
+ * writer's offsets aligned */
+static void _begin_file(struct pcap_stream *const stream, const uint64_t now_ns)
+{
+    const struct pcap_config *const config = &stream->writer->config;
+
+    if (config->format == PCAP_FORMAT_PCAP)
+    {
+        const struct pcap_file_header header = {
+            .magic = PCAP_MAGIC_NSEC,
+            .version_major = 2,
+            .version_minor = 4,
+            .snaplen = config->snaplen,
+            .linktype = LINKTYPE_ETHERNET,
+        };
+
+        _append(stream, &header, sizeof(header));
+    }
+    else
+    {
+        const struct pcapng_file_header header = {
+            .shb_type = PCAPNG_BLOCK_SHB,
+            .shb_len = offsetof(struct pcapng_file_header, idb_type),
+            .byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC,
+            .version_major = 1,
+            .version_minor = 0,
+            .section_len = -1,
+            .shb_len_trailer = offsetof(struct pcapng_file_header, idb_type),
+            .idb_type = PCAPNG_BLOCK_IDB,
+            .idb_len = sizeof(header) - offsetof(struct pcapng_file_header, idb_type),
+            .linktype = LINKTYPE_ETHERNET,
+            .snaplen = config->snaplen,
+            .tsresol_code = PCAPNG_OPT_IF_TSRESOL,
+            .tsresol_len = 1,
+            .tsresol = {9},
+            .end_code = PCAPNG_OPT_END,
+            .idb_len_trailer = sizeof(header) - offsetof(struct pcapng_file_header, idb_type),
+        };
+
+        _append(stream, &header, sizeof(header));
+    }
+
+    stream->file_open = true;
+    stream->file_bytes = _file_header_len(config->format);
+    stream->file_start_ns = now_ns;
+}
+
+static void _end_file(struct pcap_stream *const stream)
+{
+    stream->current->last = true;
+    _ring_push(&stream->full, stream->current);
+    stream->current = NULL;
+    stream->file_open = false;
+}
+
+/* Only files holding at least one packet are rotated */
+static bool _rotate_due(const struct pcap_stream *const stream, const uint32_t record_len, const uint64_t now_ns)
+{
+    const struct pcap_config *const config = &stream->writer->config;
+
+    if (stream->file_bytes == _file_header_len(config->format))
+        return false;
+
+    if (config->rotate_bytes && stream->file_bytes + record_len > config->rotate_bytes)
+        return true;
+
+    return config->rotate_seconds && now_ns >= stream->file_start_ns &&
+           now_ns - stream->file_start_ns >= config->rotate_seconds * NANOSEC_PER_SEC;
+}
+
+/* Writes every stream's full buffers in turn and hands them back. Once
+ * stopped it keeps going until a pass finds nothing, so whatever the
+ * streams queued before the stop reaches the disk. */
+static void *_write_loop(void *arg)
+{
+    struct pcap_writer *const writer = arg;
+    const struct timespec idle = {.tv_nsec = WRITER_IDLE_NS};
+
+    while (true)
+    {
+        const bool stop = atomic_load_explicit(&writer->stop, memory_order_acquire);
+        bool busy = false;
+
+        for (unsigned int s = 0; s < writer->num_streams; s++)
+        {
+            struct pcap_stream *const stream = &writer->streams[s];
+            struct pcap_buffer *buffer;
+
+            while ((buffer = _ring_pop(&stream->full)) != NULL)
+            {
+                _write_buffer(writer, stream, buffer);
+                _ring_push(&stream->free, buffer);
+                busy = true;
+            }
+        }
+
+        if (stop && !busy)
+            break;
+        if (!busy)
+            nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+/* Buffers before a file's last are full and so a multiple of the alignment.
+ * The last is written rounded up and the file truncated back to its real
+ * length. A failed file is skipped up to its last buffer, never resumed
+ * somewhere in the middle. */
+static void _write_buffer(struct pcap_writer *const writer, struct pcap_stream *const stream,
+                          struct pcap_buffer *const buffer)
+{
+    const uint32_t len = buffer->len;
+    const bool last = buffer->last;
+
+    buffer->len = 0;
+    buffer->last = false;
+
+    if (stream->fd == -1)
+        stream->fd = _open_file(writer, stream);
+
+    if (stream->fd >= 0)
+    {
+        const size_t aligned = (len + PCAP_WRITER_ALIGN - 1) & ~(size_t)(PCAP_WRITER_ALIGN - 1);
+
+        if (_pwrite_all(stream->fd, buffer->data, aligned, stream->offset))
+            stream->offset += len;
+        else
+        {
+            fprintf(stderr, "ERROR: Can't write pcap file \"%s\"\n", strerror(errno));
+            close(stream->fd);
+            stream->fd = -2;
+        }
+    }
+
+    if (stream->fd < 0)
+        writer->write_errors++;
+
+    if (!last)
+        return;
+
+    if (stream->fd >= 0)
+    {
+        if (ftruncate(stream->fd, stream->offset))
+            fprintf(stderr, "ERROR: Can't truncate pcap file \"%s\"\n", strerror(errno));
+        close(stream->fd);
+    }
+
+    stream->fd = -1;
+    stream->offset = 0;
+}
+
+/* Opens the stream's next file, with O_DIRECT so the captured data doesn't
+ * pile up in the page cache, unless the filesystem doesn't support it.
+ * Returns -2 on failure, marking the rest of the file to be skipped. */
+static int _open_file(struct pcap_writer *const writer, struct pcap_stream *const stream)
+{
+    const struct pcap_config *const config = &writer->config;
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s-%u-%04u.%s", config->prefix, stream->id, stream->file_number++,
+             config->format == PCAP_FORMAT_PCAP ? "pcap" : "pcapng");
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL)
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Can't open pcap file %s \"%s\"\n", path, strerror(errno));
+        return -2;
+    }
+
+    return fd;
+}
+
+/* Drops O_DIRECT and retries if the filesystem only rejects it at write time */
+static bool _pwrite_all(const int fd, const uint8_t *buf, size_t len, uint64_t offset)
+{
+    while (len)
+    {
+        const ssize_t ret = pwrite(fd, buf, len, offset);
+        if (ret < 0)
+        {
+            const int flags = fcntl(fd, F_GETFL);
+
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && flags >= 0 && (flags & O_DIRECT) && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0)
+                continue;
+            return false;
+        }
+
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return true;
+}
+
+static void _free_stream(struct pcap_stream *const stream)
+{
+    struct pcap_buffer *buffer;
+
+    if (stream->current)
+    {
+        free(stream->current->data);
+        free(stream->current);
+        stream->current = NULL;
+    }
+
+    if (stream->free.slots)
+    {
+        while ((buffer = _ring_pop(&stream->free)) != NULL)
+        {
+            free(buffer->data);
+            free(buffer);
+        }
+    }
+
+    if (stream->full.slots)
+    {
+        while ((buffer = _ring_pop(&stream->full)) != NULL)
+        {
+            free(buffer->data);
+            free(buffer);
+        }
+    }
+
+    if (stream->fd >= 0)
+        close(stream->fd);
+
+    free(stream->free.slots);
+    free(stream->full.slots);
+}
+
+static void _counter_add(uint64_t *const counter, const uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
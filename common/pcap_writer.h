@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/* File offsets and write sizes are kept multiples of this for O_DIRECT */
+#define PCAP_WRITER_ALIGN 4096
+#define PCAP_DEFAULT_BUFFER_SIZE (4U << 20)
+#define PCAP_DEFAULT_BUFFERS 16
+#define PCAP_DEFAULT_SNAPLEN 65535
+
+/* File format constants, the writer writes nanosecond pcap and pcapng in
+ * host byte order */
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 0x00000001
+#define PCAPNG_BLOCK_SPB 0x00000003
+#define PCAPNG_BLOCK_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define LINKTYPE_ETHERNET 1
+
+enum pcap_format
+{
+    PCAP_FORMAT_PCAP,
+    PCAP_FORMAT_PCAPNG,
+};
+
+struct pcap_config
+{
+    /* Files are named <prefix>-<stream>-<number>.pcap or .pcapng */
+    const char *prefix;
+    enum pcap_format format;
+    uint32_t snaplen;
+    /* Start the next file once one reaches this size or age, 0 for never */
+    uint64_t rotate_bytes;
+    uint32_t rotate_seconds;
+    /* A multiple of PCAP_WRITER_ALIGN */
+    uint32_t buffer_size;
+    /* Per stream, a power of two */
+    uint32_t num_buffers;
+};
+
+struct pcap_buffer
+{
+    uint8_t *data;
+    uint32_t len;
+    /* Last buffer of its file: the writer truncates and closes it after */
+    bool last;
+};
+
+/* Single-producer/single-consumer ring of buffer pointers */
+struct pcap_ring
+{
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+    uint32_t mask;
+    struct pcap_buffer **slots;
+};
+
+/* One stream per RX thread, written to its own series of files so that no
+ * two threads ever share a buffer or a file offset. The thread fills
+ * buffers as a byte stream, records may straddle two of them, and passes
+ * each full one to the writer thread, which returns it once on disk. */
+struct pcap_stream
+{
+    struct pcap_writer *writer;
+    unsigned int id;
+
+    /* RX thread side */
+    struct pcap_buffer *current;
+    uint64_t file_bytes;
+    uint64_t file_start_ns;
+    bool file_open;
+    struct pcap_ring full;
+
+    /* Writer thread side */
+    struct pcap_ring free;
+    int fd;
+    uint64_t offset;
+    unsigned int file_number;
+
+    /* Written by the RX thread with relaxed stores, readable anywhere */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t dropped;
+} __attribute__((aligned(64)));
+
+struct pcap_writer
+{
+    struct pcap_config config;
+    pthread_t thread;
+    _Atomic bool stop;
+    uint64_t write_errors;
+    unsigned int num_streams;
+    struct pcap_stream streams[];
+};
+
+/* Allocates every stream's buffers and starts the writer thread */
+struct pcap_writer *pcap_writer_start(const struct pcap_config *const config, const unsigned int num_streams);
+/* Waits until the writer has put every closed stream on disk, then frees
+ * the writer. Streams must be closed first. */
+void pcap_writer_stop(struct pcap_writer *const writer);
+bool pcap_parse_format(const char *const name, enum pcap_format *const format);
+
+/* Appends one packet received at timestamp_ns (CLOCK_REALTIME), cut to the
+ * snaplen. Never blocks: when the writer is behind and no buffer is free
+ * the packet is counted as dropped and false returned. */
+bool pcap_stream_write(struct pcap_stream *const stream, const uint8_t *const pkt, const uint32_t len,
+                       const uint64_t timestamp_ns);
+/* The same for a packet in several buffers, such as the fragments of a
+ * multi-buffer AF_XDP packet, gathered straight into the capture buffer */
+bool pcap_stream_writev(struct pcap_stream *const stream, const struct iovec *const iov, const unsigned int iovcnt,
+                        const uint64_t timestamp_ns);
+/* Rotates an idle stream's file by age; call every so often without packets */
+void pcap_stream_tick(struct pcap_stream *const stream, const uint64_t now_ns);
+/* Passes the partly filled buffer on and ends the current file */
+void pcap_stream_close(struct pcap_stream *const stream);
@@ -0,0 +1,370 @@
+#include "pkt_classify.h"
+
+#include <string.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define VLAN_HLEN 4
+#define IPV4_MIN_HLEN 20
+#define IPV6_HLEN 40
+#define IP_FRAG_OFFSET_MASK 0x1fff
+
+typedef void (*classify_fn)(const uint8_t *const base, const uint64_t *const addrs, const uint32_t *const lens,
+                            const uint32_t n, struct pkt_batch *const batch);
+
+static void _classify_scalar(const uint8_t *const base, const uint64_t *const addrs, const uint32_t *const lens,
+                             const uint32_t n, struct pkt_batch *const batch);
+static void _classify_one(const uint8_t *const pkt, const uint32_t len, struct pkt_batch *const batch,
+                          const unsigned int i);
+static void _build_class_index(struct pkt_batch *const batch);
+#ifdef HAVE_X86_SIMD
+static void _classify_sse2(const uint8_t *const base, const uint64_t *const addrs, const uint32_t *const lens,
+                           const uint32_t n, struct pkt_batch *const batch);
+static void _classify_avx2(const uint8_t *const base, const uint64_t *const addrs, const uint32_t *const lens,
+                           const uint32_t n, struct pkt_batch *const batch);
+#endif
+
+static classify_fn classify_impl;
+static const char *classify_impl_name;
+
+void pkt_classify_batch(const void *const umem_area, const uint64_t *const addrs, const uint32_t *const lens,
+                        const uint32_t n, struct pkt_batch *const batch)
+{
+    if (!classify_impl)
+        pkt_classify_select("auto");
+
+    batch->count = n;
+    classify_impl(umem_area, addrs, lens, n, batch);
+    _build_class_index(batch);
+}
+
+bool pkt_classify_select(const char *const name)
+{
+    const bool automatic = strcmp(name, "auto") == 0;
+
+#ifdef HAVE_X86_SIMD
+    /* Not picked automatically: gathers are microcoded on most cores and,
+     * with the Gather Data Sampling mitigation, far slower than the four
+     * scalar loads they replace */
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        classify_impl = _classify_avx2;
+        classify_impl_name = "avx2";
+        return true;
+    }
+    if (automatic || strcmp(name, "sse2") == 0)
+    {
+        classify_impl = _classify_sse2;
+        classify_impl_name = "sse2";
+        return true;
+    }
+#endif
+    if (automatic || strcmp(name, "scalar") == 0)
+    {
+        classify_impl = _classify_scalar;
+        classify_impl_name = "scalar";
+        return true;
+    }
+
+    return false;
+}
+
+const char *pkt_classify_selected(void)
+{
+    if (!classify_impl)
+        pkt_classify_select("auto");
+
+    return classify_impl_name;
+}
+
+static inline uint16_t _load_be16(const uint8_t *const p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void _classify_scalar(const uint8_t *const base, const uint64_t *const addrs, const uint32_t *const lens,
+                             const uint32_t n, struct pkt_batch *const batch)
+{
+    for (uint32_t i = 0; i < n; i++)
+        _classify_one(base + addrs[i], lens[i], batch, i);
+}
+
+/* The reference the SIMD paths must agree with, and their tail */
+static void _classify_one(const uint8_t *const pkt, const uint32_t len, struct pkt_batch *const batch,
+                          const unsigned int i)
+{
+    uint16_t eth_type = len >= ETH_HLEN ? _load_be16(pkt + 12) : 0;
+    uint32_t l3 = ETH_HLEN;
+    uint32_t l4 = 0;
+    uint8_t flags = 0;
+    uint8_t version = 0;
+    uint8_t proto = 0;
+    uint16_t sport = 0;
+    uint16_t dport = 0;
+
+    if ((eth_type == ETH_P_8021Q || eth_type == ETH_P_8021AD) && len >= ETH_HLEN + VLAN_HLEN)
+    {
+        flags |= PKT_F_VLAN;
+        eth_type = _load_be16(pkt + 16);
+        l3 += VLAN_HLEN;
+    }
+
+    const uint8_t *const ip = pkt + l3;
+    bool first_fragment = true;
+
+    if (eth_type == ETH_P_IP && ip[0] >> 4 == 4 && (ip[0] & 0xf) * 4 >= IPV4_MIN_HLEN && len >= l3 + IPV4_MIN_HLEN)
+    {
+        flags |= PKT_F_L4;
+        version = 4;
+        proto = ip[9];
+        l4 = l3 + (ip[0] & 0xf) * 4;
+        first_fragment = (_load_be16(ip + 6) & IP_FRAG_OFFSET_MASK) == 0;
+    }
+    else if (eth_type == ETH_P_IPV6 && ip[0] >> 4 == 6 && len >= l3 + IPV6_HLEN)
+    {
+        flags |= PKT_F_L4;
+        version = 6;
+        proto = ip[6];
+        l4 = l3 + IPV6_HLEN;
+    }
+
+    if ((flags & PKT_F_L4) && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && first_fragment && len >= l4 + 4)
+    {
+        flags |= PKT_F_PORTS;
+        sport = _load_be16(pkt + l4);
+        dport = _load_be16(pkt + l4 + 2);
+    }
+
+    batch->eth_type[i] = eth_type;
+    batch->flags[i] = flags;
+    batch->l3_offset[i] = eth_type ? l3 : 0;
+    batch->l4_offset[i] = l4;
+    batch->ip_version[i] = version;
+    batch->l4_proto[i] = proto;
+    batch->sport[i] = sport;
+    batch->dport[i] = dport;
+    batch->pkt_class[i] = eth_type == ETH_P_IP     ? PKT_CLASS_IPV4
+                          : eth_type == ETH_P_IPV6 ? PKT_CLASS_IPV6
+                          : eth_type == ETH_P_ARP  ? PKT_CLASS_ARP
+                                                   : PKT_CLASS_OTHER;
+}
+
+/* Branch-free: every packet is written to its class's list, only that
+ * list's count moves */
+static void _build_class_index(struct pkt_batch *const batch)
+{
+    memset(batch->class_count, 0, sizeof(batch->class_count));
+
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        const uint8_t cls = batch->pkt_class[i];
+        batch->class_index[cls][batch->class_count[cls]++] = i;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Four packets' header fields, one packet per 32 bit lane. Masks are all
+ * ones in the lanes they hold for. */
+struct classify_lanes
+{
+    __m128i len;
+    __m128i eth_type;
+    __m128i vlan;
+    __m128i l3;
+    __m128i is_ipv4;
+    __m128i has_l4;
+    __m128i version;
+    __m128i proto;
+    __m128i l4;
+    __m128i ports_ok;
+};
+
+static inline __m128i _sel(const __m128i mask, const __m128i a, const __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* Big-endian 16 bit field at byte 0 of each lane (bytes 2-3 with shift 16) */
+static inline __m128i _be16(const __m128i words, const int shift)
+{
+    const __m128i ff = _mm_set1_epi32(0xff);
+    const __m128i w = shift ? _mm_srli_epi32(words, 16) : words;
+    return _mm_or_si128(_mm_slli_epi32(_mm_and_si128(w, ff), 8), _mm_and_si128(_mm_srli_epi32(w, 8), ff));
+}
+
+/* All ones where len >= need */
+static inline __m128i _len_ok(const __m128i len, const __m128i need)
+{
+    return _mm_xor_si128(_mm_cmpgt_epi32(need, len), _mm_set1_epi32(-1));
+}
+
+static inline __m128i _eq(const __m128i a, const int b)
+{
+    return _mm_cmpeq_epi32(a, _mm_set1_epi32(b));
+}
+
+/* word12 and word16 are the 32 bits at offsets 12 and 16 */
+static inline void _lanes_l2(struct classify_lanes *const lanes, const __m128i word12, const __m128i word16)
+{
+    const __m128i outer = _be16(word12, 0);
+    const __m128i runt = _mm_cmpgt_epi32(_mm_set1_epi32(ETH_HLEN), lanes->len);
+
+    lanes->vlan = _mm_and_si128(_mm_or_si128(_eq(outer, ETH_P_8021Q), _eq(outer, ETH_P_8021AD)),
+                                _len_ok(lanes->len, _mm_set1_epi32(ETH_HLEN + VLAN_HLEN)));
+    lanes->eth_type = _mm_andnot_si128(runt, _sel(lanes->vlan, _be16(word16, 0), outer));
+    lanes->l3 = _mm_add_epi32(_mm_set1_epi32(ETH_HLEN), _mm_and_si128(lanes->vlan, _mm_set1_epi32(VLAN_HLEN)));
+}
+
+/* ip0, ip4 and ip8 are the 32 bits at offsets 0, 4 and 8 of the IP header */
+static inline void _lanes_l3(struct classify_lanes *const lanes, const __m128i ip0, const __m128i ip4,
+                             const __m128i ip8)
+{
+    const __m128i nibble = _mm_set1_epi32(0xf);
+    const __m128i version = _mm_and_si128(_mm_srli_epi32(ip0, 4), nibble);
+    const __m128i ihl_bytes = _mm_slli_epi32(_mm_and_si128(ip0, nibble), 2);
+
+    const __m128i ipv4 = _mm_and_si128(
+        _mm_and_si128(_eq(lanes->eth_type, ETH_P_IP), _eq(version, 4)),
+        _mm_and_si128(_mm_cmpgt_epi32(ihl_bytes, _mm_set1_epi32(IPV4_MIN_HLEN - 1)),
+                      _len_ok(lanes->len, _mm_add_epi32(lanes->l3, _mm_set1_epi32(IPV4_MIN_HLEN)))));
+    const __m128i ipv6 = _mm_and_si128(
+        _mm_and_si128(_eq(lanes->eth_type, ETH_P_IPV6), _eq(version, 6)),
+        _len_ok(lanes->len, _mm_add_epi32(lanes->l3, _mm_set1_epi32(IPV6_HLEN))));
+
+    lanes->is_ipv4 = ipv4;
+    lanes->has_l4 = _mm_or_si128(ipv4, ipv6);
+    lanes->version = _mm_and_si128(lanes->has_l4, version);
+    lanes->proto = _mm_and_si128(lanes->has_l4, _sel(ipv4, _mm_and_si128(_mm_srli_epi32(ip8, 8), _mm_set1_epi32(0xff)),
+                                                     _mm_and_si128(_mm_srli_epi32(ip4, 16), _mm_set1_epi32(0xff))));
+    lanes->l4 = _mm_add_epi32(lanes->l3, _sel(ipv4, ihl_bytes, _mm_set1_epi32(IPV6_HLEN)));
+
+    const __m128i first_fragment = _mm_or_si128(
+        ipv6, _eq(_mm_and_si128(_be16(ip4, 16), _mm_set1_epi32(IP_FRAG_OFFSET_MASK)), 0));
+    const __m128i tcp_udp = _mm_or_si128(_eq(lanes->proto, IPPROTO_TCP), _eq(lanes->proto, IPPROTO_UDP));
+
+    lanes->ports_ok = _mm_and_si128(_mm_and_si128(lanes->has_l4, tcp_udp),
+                                    _mm_and_si128(first_fragment,
+                                                  _len_ok(lanes->len, _mm_add_epi32(lanes->l4, _mm_set1_epi32(4)))));
+    lanes->l4 = _mm_and_si128(lanes->has_l4, lanes->l4);
+}
+
+/* Narrows four 32 bit lanes holding values up to 0xffff to 16 bits. The
+ * shifts sign extend them so the signed saturating pack keeps every bit. */
+static inline __m128i _pack16(const __m128i v)
+{
+    const __m128i x = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+    return _mm_packs_epi32(x, x);
+}
+
+static inline void _store16(uint16_t *const dst, const __m128i v)
+{
+    _mm_storel_epi64((__m128i *)dst, _pack16(v));
+}
+
+/* Lanes hold values up to 0xff */
+static inline void _store8(uint8_t *const dst, const __m128i v)
+{
+    const __m128i x = _mm_packs_epi32(v, v);
+    const int packed = _mm_cvtsi128_si32(_mm_packus_epi16(x, x));
+    memcpy(dst, &packed, sizeof(packed));
+}
+
+/* l4_word is the 32 bits at the start of the L4 header */
+static inline void _lanes_store(const struct classify_lanes *const lanes, const __m128i l4_word,
+                                struct pkt_batch *const batch, const unsigned int i)
+{
+    const __m128i vlan_flag = _mm_and_si128(lanes->vlan, _mm_set1_epi32(PKT_F_VLAN));
+    const __m128i l4_flag = _mm_and_si128(lanes->has_l4, _mm_set1_epi32(PKT_F_L4));
+    const __m128i ports_flag = _mm_and_si128(lanes->ports_ok, _mm_set1_epi32(PKT_F_PORTS));
+    const __m128i pkt_class = _sel(_eq(lanes->eth_type, ETH_P_IP), _mm_set1_epi32(PKT_CLASS_IPV4),
+                                   _sel(_eq(lanes->eth_type, ETH_P_IPV6), _mm_set1_epi32(PKT_CLASS_IPV6),
+                                        _sel(_eq(lanes->eth_type, ETH_P_ARP), _mm_set1_epi32(PKT_CLASS_ARP),
+                                             _mm_set1_epi32(PKT_CLASS_OTHER))));
+
+    _store16(&batch->eth_type[i], lanes->eth_type);
+    _store16(&batch->sport[i], _mm_and_si128(lanes->ports_ok, _be16(l4_word, 0)));
+    _store16(&batch->dport[i], _mm_and_si128(lanes->ports_ok, _be16(l4_word, 16)));
+    _store8(&batch->flags[i], _mm_or_si128(vlan_flag, _mm_or_si128(l4_flag, ports_flag)));
+    _store8(&batch->l3_offset[i], _mm_andnot_si128(_eq(lanes->eth_type, 0), lanes->l3));
+    _store8(&batch->l4_offset[i], lanes->l4);
+    _store8(&batch->ip_version[i], lanes->version);
+    _store8(&batch->l4_proto[i], lanes->proto);
+    _store8(&batch->pkt_class[i], pkt_class);
+}
+
+static inline uint32_t _load32(const uint8_t *const p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/* Offsets stay below PKT_CLASSIFY_PEEK whatever the packet holds, the
+ * largest is a tagged IPv4 header with options: 14 + 4 + 60 + 4 */
+static inline __m128i _gather_sse2(const uint8_t *const *const pkts, const __m128i offsets)
+{
+    return _mm_set_epi32(_load32(pkts[3] + _mm_cvtsi128_si32(_mm_shuffle_epi32(offsets, 3))),
+                         _load32(pkts[2] + _mm_cvtsi128_si32(_mm_shuffle_epi32(offsets, 2))),
+                         _load32(pkts[1] + _mm_cvtsi128_si32(_mm_shuffle_epi32(offsets, 1))),
+                         _load32(pkts[0] + _mm_cvtsi128_si32(offsets)));
+}
+
+static void _classify_sse2(const uint8_t *const base, const uint64_t *const addrs, const uint32_t *const lens,
+                           const uint32_t n, struct pkt_batch *const batch)
+{
+    uint32_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        const uint8_t *const pkts[4] = {base + addrs[i], base + addrs[i + 1], base + addrs[i + 2],
+                                        base + addrs[i + 3]};
+        struct classify_lanes lanes = {.len = _mm_loadu_si128((const __m128i *)&lens[i])};
+
+        _lanes_l2(&lanes, _gather_sse2(pkts, _mm_set1_epi32(12)), _gather_sse2(pkts, _mm_set1_epi32(16)));
+        _lanes_l3(&lanes, _gather_sse2(pkts, lanes.l3), _gather_sse2(pkts, _mm_add_epi32(lanes.l3, _mm_set1_epi32(4))),
+                  _gather_sse2(pkts, _mm_add_epi32(lanes.l3, _mm_set1_epi32(8))));
+        _lanes_store(&lanes, _gather_sse2(pkts, lanes.l4), batch, i);
+    }
+
+    for (; i < n; i++)
+        _classify_one(base + addrs[i], lens[i], batch, i);
+}
+
+__attribute__((target("avx2"))) static inline __m128i _gather_avx2(const uint8_t *const base, const __m256i addrs,
+                                                                    const __m128i offsets)
+{
+    const __m256i index = _mm256_add_epi64(addrs, _mm256_cvtepu32_epi64(offsets));
+    return _mm256_i64gather_epi32((const int *)base, index, 1);
+}
+
+/* Same lanes as the SSE2 path, but each header word of the four packets
+ * is one gather instead of four loads and inserts */
+__attribute__((target("avx2"))) static void _classify_avx2(const uint8_t *const base, const uint64_t *const addrs,
+                                                           const uint32_t *const lens, const uint32_t n,
+                                                           struct pkt_batch *const batch)
+{
+    uint32_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m256i pkts = _mm256_loadu_si256((const __m256i *)&addrs[i]);
+        struct classify_lanes lanes = {.len = _mm_loadu_si128((const __m128i *)&lens[i])};
+
+        _lanes_l2(&lanes, _gather_avx2(base, pkts, _mm_set1_epi32(12)), _gather_avx2(base, pkts, _mm_set1_epi32(16)));
+        _lanes_l3(&lanes, _gather_avx2(base, pkts, lanes.l3),
+                  _gather_avx2(base, pkts, _mm_add_epi32(lanes.l3, _mm_set1_epi32(4))),
+                  _gather_avx2(base, pkts, _mm_add_epi32(lanes.l3, _mm_set1_epi32(8))));
+        _lanes_store(&lanes, _gather_avx2(base, pkts, lanes.l4), batch, i);
+    }
+
+    for (; i < n; i++)
+        _classify_one(base + addrs[i], lens[i], batch, i);
+}
+
+#endif
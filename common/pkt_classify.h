@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Largest batch pkt_classify_batch() takes, callers split bigger RX batches */
+#define PKT_CLASSIFY_MAX_BATCH 64
+/* Bytes from the start of each packet the classifier may load whatever the
+ * packet's length; results past the length are discarded, not read. UMEM
+ * frames always have this much room. */
+#define PKT_CLASSIFY_PEEK 128
+
+enum pkt_class
+{
+    PKT_CLASS_IPV4,
+    PKT_CLASS_IPV6,
+    PKT_CLASS_ARP,
+    PKT_CLASS_OTHER,
+    PKT_CLASS_MAX,
+};
+
+/* Single 802.1Q or 802.1ad tag in front of eth_type */
+#define PKT_F_VLAN 0x1
+/* Complete IPv4 or IPv6 header, l4_proto and l4_offset are valid */
+#define PKT_F_L4 0x2
+/* TCP or UDP, first fragment, sport and dport are valid */
+#define PKT_F_PORTS 0x4
+
+/* One RX batch in structure-of-arrays form: entry i of every array is
+ * packet i of the batch, so a handler walking one field reads contiguous
+ * memory. Packets shorter than an Ethernet header are class OTHER with an
+ * eth_type of 0. Fields a packet doesn't have are 0. */
+struct pkt_batch
+{
+    uint32_t count;
+    uint16_t eth_type[PKT_CLASSIFY_MAX_BATCH];
+    uint16_t sport[PKT_CLASSIFY_MAX_BATCH];
+    uint16_t dport[PKT_CLASSIFY_MAX_BATCH];
+    uint8_t flags[PKT_CLASSIFY_MAX_BATCH];
+    uint8_t l3_offset[PKT_CLASSIFY_MAX_BATCH];
+    uint8_t l4_offset[PKT_CLASSIFY_MAX_BATCH];
+    uint8_t ip_version[PKT_CLASSIFY_MAX_BATCH];
+    uint8_t l4_proto[PKT_CLASSIFY_MAX_BATCH];
+    uint8_t pkt_class[PKT_CLASSIFY_MAX_BATCH];
+    /* Batch positions of each class's packets in receive order */
+    uint8_t class_count[PKT_CLASS_MAX];
+    uint8_t class_index[PKT_CLASS_MAX][PKT_CLASSIFY_MAX_BATCH];
+};
+
+/* Classifies n (at most PKT_CLASSIFY_MAX_BATCH) packets at umem_area +
+ * addrs[i] of lens[i] bytes. On x86 four packets go through the SIMD lanes
+ * together, their header words loaded with AVX2 gathers or SSE2 inserts;
+ * elsewhere, and for the last n % 4, one packet at a time. Every
+ * implementation gives the same result. Ports are in host byte order. */
+void pkt_classify_batch(const void *const umem_area, const uint64_t *const addrs, const uint32_t *const lens,
+                        const uint32_t n, struct pkt_batch *const batch);
+/* Picks the implementation: "avx2", "sse2", "scalar" or "auto", the default,
+ * which is SSE2 on x86 and scalar elsewhere. Returns false if it isn't
+ * available on this CPU. */
+bool pkt_classify_select(const char *const name);
+const char *pkt_classify_selected(void);
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+
+#include "stats_exporter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#define NANOSEC_PER_SEC 1000000000ULL
+
+/* Defined in common_user_bpf_xdp.c */
+const char *action2str(__u32 action);
+
+static void *_export_loop(void *arg);
+static int _open_socket(const char *const path);
+static int _lookup_per_key(struct xdp_stats_exporter *const exporter);
+static void _write_json(FILE *const out, const struct xdp_stats_snapshot *const snapshot);
+static void _serve_prometheus(const int fd, const struct xdp_stats_snapshot *const snapshot);
+static uint64_t _now_ns(void);
+
+struct xdp_stats_exporter *xdp_stats_exporter_start(const int map_fd, const unsigned int interval_ms,
+                                                    const char *const socket_path, FILE *const json)
+{
+    const int num_cpus = libbpf_num_possible_cpus();
+    if (num_cpus <= 0)
+        return NULL;
+
+    struct xdp_stats_exporter *const exporter = calloc(1, sizeof(*exporter));
+    if (exporter == NULL)
+        return NULL;
+
+    exporter->map_fd = map_fd;
+    exporter->listen_fd = -1;
+    exporter->stop_fd = eventfd(0, EFD_CLOEXEC);
+    exporter->json = json;
+    exporter->interval_ms = interval_ms;
+    exporter->num_cpus = num_cpus;
+    exporter->keys = calloc(XDP_ACTION_MAX, sizeof(*exporter->keys));
+    exporter->values = calloc((size_t)XDP_ACTION_MAX * num_cpus, sizeof(*exporter->values));
+    pthread_mutex_init(&exporter->lock, NULL);
+
+    if (exporter->stop_fd < 0 || exporter->keys == NULL || exporter->values == NULL)
+        goto error_exit;
+
+    if (socket_path)
+    {
+        exporter->listen_fd = _open_socket(socket_path);
+        if (exporter->listen_fd < 0)
+            goto error_exit;
+
+        exporter->socket_path = strdup(socket_path);
+        if (exporter->socket_path == NULL)
+            goto error_exit;
+    }
+
+    if (xdp_stats_read(exporter, &exporter->current, NULL))
+    {
+        fprintf(stderr, "ERROR: Can't read xdp_stats_map \"%s\"\n", strerror(errno));
+        goto error_exit;
+    }
+
+    const int ret = pthread_create(&exporter->thread, NULL, _export_loop, exporter);
+    if (ret)
+    {
+        errno = ret;
+        goto error_exit;
+    }
+
+    return exporter;
+
+error_exit:
+    if (exporter->listen_fd >= 0)
+    {
+        close(exporter->listen_fd);
+        unlink(socket_path);
+    }
+    if (exporter->stop_fd >= 0)
+        close(exporter->stop_fd);
+    pthread_mutex_destroy(&exporter->lock);
+    free(exporter->socket_path);
+    free(exporter->keys);
+    free(exporter->values);
+    free(exporter);
+    return NULL;
+}
+
+void xdp_stats_exporter_stop(struct xdp_stats_exporter *const exporter)
+{
+    const uint64_t one = 1;
+
+    if (write(exporter->stop_fd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "ERROR: Can't stop the stats exporter \"%s\"\n", strerror(errno));
+    pthread_join(exporter->thread, NULL);
+
+    if (exporter->listen_fd >= 0)
+    {
+        close(exporter->listen_fd);
+        unlink(exporter->socket_path);
+    }
+    close(exporter->stop_fd);
+    pthread_mutex_destroy(&exporter->lock);
+    free(exporter->socket_path);
+    free(exporter->keys);
+    free(exporter->values);
+    free(exporter);
+}
+
+int xdp_stats_read(struct xdp_stats_exporter *const exporter, struct xdp_stats_snapshot *const snapshot,
+                   const struct xdp_stats_snapshot *const previous)
+{
+    DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 count = XDP_ACTION_MAX;
+    __u32 out_batch;
+
+    /* The map is an array, so one batch returns every key with the values
+     * of all CPUs. -ENOENT only says that the end of the map was reached. */
+    int ret = bpf_map_lookup_batch(exporter->map_fd, NULL, &out_batch, exporter->keys, exporter->values,
+                                   &count, &opts);
+    if (ret < 0 && errno == ENOENT)
+        ret = 0;
+    else if (ret < 0 && (errno == EINVAL || errno == ENOTSUP || errno == EOPNOTSUPP))
+        ret = _lookup_per_key(exporter); /* Kernels before 5.6 */
+    if (ret < 0)
+        return ret;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->timestamp_ns = _now_ns();
+
+    for (__u32 i = 0; i < count; i++)
+    {
+        const __u32 action = exporter->keys[i];
+        if (action >= XDP_ACTION_MAX)
+            continue;
+
+        const struct datarec *const per_cpu = &exporter->values[(size_t)i * exporter->num_cpus];
+        for (unsigned int cpu = 0; cpu < exporter->num_cpus; cpu++)
+        {
+            snapshot->actions[action].packets += per_cpu[cpu].rx_packets;
+            snapshot->actions[action].bytes += per_cpu[cpu].rx_bytes;
+        }
+    }
+
+    if (previous && snapshot->timestamp_ns > previous->timestamp_ns)
+    {
+        const double period = (double)(snapshot->timestamp_ns - previous->timestamp_ns) / NANOSEC_PER_SEC;
+
+        for (int action = 0; action < XDP_ACTION_MAX; action++)
+        {
+            struct xdp_action_rates *const now = &snapshot->actions[action];
+            const struct xdp_action_rates *const before = &previous->actions[action];
+
+            now->pps = (now->packets - before->packets) / period;
+            now->bps = (now->bytes - before->bytes) * 8 / period;
+        }
+    }
+
+    return 0;
+}
+
+static void *_export_loop(void *arg)
+{
+    struct xdp_stats_exporter *const exporter = arg;
+    struct xdp_stats_snapshot snapshot;
+    struct pollfd fds[2] = {{.fd = exporter->stop_fd, .events = POLLIN},
+                            {.fd = exporter->listen_fd, .events = POLLIN}};
+    uint64_t next_ns = _now_ns() + exporter->interval_ms * 1000000ULL;
+
+    while (true)
+    {
+        const uint64_t now_ns = _now_ns();
+        if (now_ns >= next_ns)
+        {
+            if (xdp_stats_read(exporter, &snapshot, &exporter->current) == 0)
+            {
+                pthread_mutex_lock(&exporter->lock);
+                exporter->current = snapshot;
+                pthread_mutex_unlock(&exporter->lock);
+
+                if (exporter->json)
+                    _write_json(exporter->json, &snapshot);
+            }
+
+            next_ns += exporter->interval_ms * 1000000ULL;
+            continue;
+        }
+
+        /* Scrapes are answered between samples from the last snapshot, so
+         * they never cost a map read */
+        const int timeout_ms = (next_ns - now_ns + 999999) / 1000000;
+        if (poll(fds, exporter->listen_fd >= 0 ? 2 : 1, timeout_ms) <= 0)
+            continue;
+
+        if (fds[0].revents)
+            break;
+        if (!fds[1].revents)
+            continue;
+
+        const int fd = accept(exporter->listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        pthread_mutex_lock(&exporter->lock);
+        snapshot = exporter->current;
+        pthread_mutex_unlock(&exporter->lock);
+
+        _serve_prometheus(fd, &snapshot);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int _open_socket(const char *const path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "ERROR: Socket path %s too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8))
+    {
+        fprintf(stderr, "ERROR: Can't listen on %s \"%s\"\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int _lookup_per_key(struct xdp_stats_exporter *const exporter)
+{
+    for (__u32 key = 0; key < XDP_ACTION_MAX; key++)
+    {
+        exporter->keys[key] = key;
+        if (bpf_map_lookup_elem(exporter->map_fd, &key, &exporter->values[(size_t)key * exporter->num_cpus]))
+            return -1;
+    }
+
+    return 0;
+}
+
+static void _write_json(FILE *const out, const struct xdp_stats_snapshot *const snapshot)
+{
+    fprintf(out, "{\"timestamp_ns\":%lu,\"actions\":{", snapshot->timestamp_ns);
+    for (int action = 0; action < XDP_ACTION_MAX; action++)
+    {
+        const struct xdp_action_rates *const rates = &snapshot->actions[action];
+
+        fprintf(out, "%s\"%s\":{\"packets\":%lu,\"bytes\":%lu,\"pps\":%.1f,\"bps\":%.1f}",
+                action ? "," : "", action2str(action), rates->packets, rates->bytes, rates->pps, rates->bps);
+    }
+    fprintf(out, "}}\n");
+    fflush(out);
+}
+
+static void _serve_prometheus(const int fd, const struct xdp_stats_snapshot *const snapshot)
+{
+    static const struct
+    {
+        const char *name;
+        const char *type;
+        const char *help;
+    } metrics[] = {
+        {"xdp_action_packets_total", "counter", "Packets that got an XDP action"},
+        {"xdp_action_bytes_total", "counter", "Bytes that got an XDP action"},
+        {"xdp_action_packets_per_second", "gauge", "Packet rate per XDP action"},
+        {"xdp_action_bits_per_second", "gauge", "Bit rate per XDP action"},
+    };
+    char buffer[4096];
+    size_t len = 0;
+
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++)
+    {
+        len += snprintf(buffer + len, sizeof(buffer) - len, "# HELP %s %s\n# TYPE %s %s\n",
+                        metrics[m].name, metrics[m].help, metrics[m].name, metrics[m].type);
+
+        for (int action = 0; action < XDP_ACTION_MAX; action++)
+        {
+            const struct xdp_action_rates *const rates = &snapshot->actions[action];
+            const uint64_t counters[] = {rates->packets, rates->bytes};
+            const double gauges[] = {rates->pps, rates->bps};
+
+            len += snprintf(buffer + len, sizeof(buffer) - len, "%s{action=\"%s\"} ",
+                            metrics[m].name, action2str(action));
+            if (m < 2)
+                len += snprintf(buffer + len, sizeof(buffer) - len, "%lu\n", counters[m]);
+            else
+                len += snprintf(buffer + len, sizeof(buffer) - len, "%.1f\n", gauges[m - 2]);
+        }
+    }
+
+    for (size_t sent = 0; sent < len;)
+    {
+        const ssize_t ret = send(fd, buffer + sent, len - sent, MSG_NOSIGNAL);
+        if (ret <= 0)
+            return;
+        sent += ret;
+    }
+}
+
+static uint64_t _now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NANOSEC_PER_SEC + now.tv_nsec;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/types.h>
+#include <linux/bpf.h>
+
+#include "xdp_stats_kern_user.h"
+
+struct xdp_action_rates
+{
+    uint64_t packets;
+    uint64_t bytes;
+    double pps;
+    double bps;
+};
+
+struct xdp_stats_snapshot
+{
+    uint64_t timestamp_ns;
+    struct xdp_action_rates actions[XDP_ACTION_MAX];
+};
+
+/* Periodically reads the per-CPU, per-action counters of xdp_stats_map
+ * (struct datarec, see xdp_stats_kern.h) and publishes the totals and rates.
+ * Every read of the whole map is a single bpf_map_lookup_batch() call. */
+struct xdp_stats_exporter
+{
+    int map_fd;
+    int listen_fd;
+    /* Unlinked on stop, NULL without a socket */
+    char *socket_path;
+    /* Written by xdp_stats_exporter_stop() to wake the thread */
+    int stop_fd;
+    FILE *json;
+    unsigned int interval_ms;
+    unsigned int num_cpus;
+    /* One value per possible CPU per key, as the batch call returns them */
+    struct datarec *values;
+    __u32 *keys;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct xdp_stats_snapshot current;
+};
+
+/* Starts a thread sampling map_fd every interval_ms. When socket_path is set
+ * every connection to that Unix socket gets the latest sample in Prometheus
+ * text format. When json is set a JSON line is written to it per sample. */
+struct xdp_stats_exporter *xdp_stats_exporter_start(const int map_fd, const unsigned int interval_ms,
+                                                    const char *const socket_path, FILE *const json);
+/* Stops and joins the thread, removes the socket and frees the exporter.
+ * json is the caller's to close. */
+void xdp_stats_exporter_stop(struct xdp_stats_exporter *const exporter);
+/* Reads the map once and returns the summed counters in snapshot, with
+ * rates computed against previous when it is not NULL */
+int xdp_stats_read(struct xdp_stats_exporter *const exporter, struct xdp_stats_snapshot *const snapshot,
+                   const struct xdp_stats_snapshot *const previous);
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+
+#include "umem_alloc.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGEPAGE_2MB (1ULL << 21)
+#define HUGEPAGE_1GB (1ULL << 30)
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+static void *_map(const uint64_t size, const uint64_t page_size, const int flags, uint64_t *const mapped_size);
+static bool _node_has_hugepages(const int numa_node, const uint64_t size, const uint64_t page_size);
+static void _bind_to_node(void *const buffer, const uint64_t size, const int numa_node);
+
+int get_interface_numa_node(const char *const interface_name)
+{
+    char path[128];
+    int numa_node = -1;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", interface_name);
+
+    FILE *const file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    if (fscanf(file, "%d", &numa_node) != 1)
+        numa_node = -1;
+
+    fclose(file);
+    return numa_node;
+}
+
+void *umem_buffer_alloc(const uint64_t size, const int numa_node, uint64_t *const mapped_size)
+{
+    const uint64_t base_page_size = getpagesize();
+    uint64_t page_size = HUGEPAGE_1GB;
+    void *buffer = NULL;
+
+    /* Only use 1 GB pages when they don't waste most of the last page */
+    if (size >= HUGEPAGE_1GB && _node_has_hugepages(numa_node, size, HUGEPAGE_1GB))
+        buffer = _map(size, HUGEPAGE_1GB, MAP_HUGETLB | MAP_HUGE_1GB, mapped_size);
+
+    if (buffer == NULL && _node_has_hugepages(numa_node, size, HUGEPAGE_2MB))
+    {
+        page_size = HUGEPAGE_2MB;
+        buffer = _map(size, HUGEPAGE_2MB, MAP_HUGETLB | MAP_HUGE_2MB, mapped_size);
+    }
+
+    if (buffer == NULL)
+    {
+        page_size = base_page_size;
+        buffer = _map(size, base_page_size, 0, mapped_size);
+        if (buffer == NULL)
+            return NULL;
+
+        fprintf(stderr, "WARN: Too few hugepages free, on the NIC's node if known, UMEM uses %lu byte pages\n",
+                page_size);
+        madvise(buffer, *mapped_size, MADV_HUGEPAGE);
+    }
+
+    if (numa_node >= 0)
+        _bind_to_node(buffer, *mapped_size, numa_node);
+
+    /* Fault every page in now instead of on the first packets that use it */
+    for (uint64_t offset = 0; offset < *mapped_size; offset += page_size)
+        ((volatile uint8_t *)buffer)[offset] = 0;
+
+    return buffer;
+}
+
+void umem_buffer_free(void *const buffer, const uint64_t mapped_size)
+{
+    munmap(buffer, mapped_size);
+}
+
+static void *_map(const uint64_t size, const uint64_t page_size, const int flags, uint64_t *const mapped_size)
+{
+    const uint64_t aligned_size = (size + page_size - 1) & ~(page_size - 1);
+
+    /* Hugetlb mappings reserve their pages up front, so this fails rather
+     * than SIGBUS later when the hugepage pool is too small */
+    void *const buffer = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (buffer == MAP_FAILED)
+        return NULL;
+
+    *mapped_size = aligned_size;
+    return buffer;
+}
+
+/* The hugetlb reservation mmap() makes is against the global pool, while
+ * the pages bound to numa_node can only be faulted in from that node's:
+ * with too few free there the prefault would SIGBUS, so the next page size
+ * is tried instead. Pages other mappings reserved but haven't faulted in
+ * yet still count as free, the check can't see them. */
+static bool _node_has_hugepages(const int numa_node, const uint64_t size, const uint64_t page_size)
+{
+    char path[128];
+    uint64_t free_pages = 0;
+
+    if (numa_node < 0)
+        return true;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/hugepages/hugepages-%lukB/free_hugepages",
+             numa_node, page_size >> 10);
+
+    FILE *const file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    if (fscanf(file, "%lu", &free_pages) != 1)
+        free_pages = 0;
+
+    fclose(file);
+    return free_pages >= (size + page_size - 1) / page_size;
+}
+
+static void _bind_to_node(void *const buffer, const uint64_t size, const int numa_node)
+{
+    unsigned long nodemask[numa_node / BITS_PER_LONG + 1];
+
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[numa_node / BITS_PER_LONG] = 1UL << (numa_node % BITS_PER_LONG);
+
+    if (syscall(SYS_mbind, buffer, size, MPOL_BIND, nodemask, sizeof(nodemask) * 8 + 1, MPOL_MF_MOVE))
+        fprintf(stderr, "WARN: Can't bind UMEM to NUMA node %d \"%s\"\n", numa_node, strerror(errno));
+}
\ No newline at end of file
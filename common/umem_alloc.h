@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Returns the NUMA node of the device behind interface_name, or -1 when the
+ * device has no NUMA affinity (virtual devices, single node systems) */
+int get_interface_numa_node(const char *const interface_name);
+
+/* Allocates a prefaulted UMEM area of at least size bytes. The area comes
+ * from 1 GB or 2 MB hugepages when the system has them reserved, on
+ * numa_node when it is >= 0, and falls back to regular pages with
+ * transparent hugepages otherwise. When numa_node
+ * is >= 0 the memory is bound to that node before it is faulted in.
+ * The size actually mapped is returned in mapped_size for umem_buffer_free(). */
+void *umem_buffer_alloc(const uint64_t size, const int numa_node, uint64_t *const mapped_size);
+void umem_buffer_free(void *const buffer, const uint64_t mapped_size);
\ No newline at end of file
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used by BPF-prog kernel side BPF-progs and userspace programs,
+ * for sharing the flow filter map layouts.
+ */
+#ifndef __XDP_FILTER_KERN_USER_H
+#define __XDP_FILTER_KERN_USER_H
+
+#define XDP_FILTER_MAX_FLOWS	65536
+#define XDP_FILTER_MAX_PREFIXES	16384
+
+/* The zero value is the default, so an empty filter keeps sending all
+ * traffic to the AF_XDP sockets */
+enum xdp_filter_action {
+	XDP_FILTER_REDIRECT = 0,
+	XDP_FILTER_PASS,
+	XDP_FILTER_DROP,
+	XDP_FILTER_ACTION_MAX,
+};
+
+enum xdp_filter_dir {
+	XDP_FILTER_DST = 0,
+	XDP_FILTER_SRC,
+};
+
+/* Exact match key. IPv4 addresses use the first 4 bytes of saddr/daddr,
+ * all fields are in network byte order and unused bytes must be zero. */
+struct flow_key {
+	__u8 saddr[16];
+	__u8 daddr[16];
+	__be16 sport;
+	__be16 dport;
+	__u8 proto;
+	__u8 family;	/* AF_INET or AF_INET6 */
+	__u16 pad;
+};
+
+/* LPM trie keys. The direction byte is part of the matched data, so one
+ * trie holds both source and destination prefixes: prefixlen counts the
+ * 8 direction bits plus the address prefix length. */
+struct lpm_v4_key {
+	__u32 prefixlen;
+	__u8 dir;
+	__u8 addr[4];
+};
+
+struct lpm_v6_key {
+	__u32 prefixlen;
+	__u8 dir;
+	__u8 addr[16];
+};
+
+#endif /* __XDP_FILTER_KERN_USER_H */
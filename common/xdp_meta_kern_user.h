@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used by BPF-prog kernel side BPF-progs and userspace programs,
+ * for sharing the layout of the XDP metadata in front of AF_XDP frames.
+ */
+#ifndef __XDP_META_KERN_USER_H
+#define __XDP_META_KERN_USER_H
+
+#define XDP_RX_META_MAGIC	0x7853544d /* "MTSx" */
+
+/* timestamp is CLOCK_MONOTONIC (bpf_ktime_get_ns) unless HW_TIMESTAMP is
+ * set, then it is the NIC's clock, which userspace can only compare with
+ * CLOCK_TAI while phc2sys keeps the two in sync */
+#define XDP_RX_META_HW_TIMESTAMP	(1U << 0)
+
+/* Must stay a multiple of 4 bytes, the metadata size limit of XDP */
+struct xdp_rx_meta {
+	__u64 timestamp;
+	__u32 flags;
+	__u32 magic;
+};
+
+#endif /* __XDP_META_KERN_USER_H */
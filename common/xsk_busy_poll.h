@@ -0,0 +1,36 @@
+#pragma once
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#define BUSY_POLL_USECS 20
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+/* Preferred busy polling on an AF_XDP socket's fd: the thread drives the
+ * queue's NAPI from its recvfrom()/sendto() calls, up to budget packets per
+ * call. Only worth it with napi_defer_hard_irqs and gro_flush_timeout set
+ * on the interface. Kept in a header of its own, free of the socket
+ * structs, for tools with their own. Returns 0 or a negative errno. */
+static inline int xsk_enable_busy_poll(const int fd, const unsigned int budget)
+{
+    int opt = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt)))
+        return -errno;
+
+    opt = BUSY_POLL_USECS;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)))
+        return -errno;
+
+    opt = budget;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &opt, sizeof(opt)))
+        return -errno;
+
+    return 0;
+}
@@ -0,0 +1,400 @@
+#include "xsk_encap.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <linux/mpls.h>
+
+#include "checksum.h"
+
+#define VLAN_HLEN 4
+/* Tags skipped to find the EtherType, QinQ at most */
+#define MAX_VLAN_TAGS 2
+#define MPLS_HLEN 4
+#define GRE_HLEN 4
+#define GRE_FLAG_CSUM 0x8000
+#define GRE_FLAG_ROUTING 0x4000
+#define GRE_FLAG_KEY 0x2000
+#define GRE_FLAG_SEQ 0x1000
+#define GRE_VERSION 0x0007
+#define VXLAN_HLEN 8
+#define VXLAN_FLAG_VNI 0x08000000
+#define VXLAN_VNI_SHIFT 8
+#define IP_DF 0x4000
+#define IP_MF 0x2000
+#define IP_FRAG_OFFSET_MASK 0x1fff
+
+/* The kernel's own headroom in front of every received packet already
+ * holds the largest encapsulation, frame_headroom only adds to it */
+_Static_assert(XDP_PACKET_HEADROOM >= XSK_ENCAP_MAX_HLEN, "received packets can't take every encapsulation");
+
+static uint8_t *_data(const struct xsk_umem_info *const umem, const struct xdp_desc *const desc);
+static uint16_t _load16(const uint8_t *const p);
+static uint32_t _load32(const uint8_t *const p);
+static void _store16(uint8_t *const p, const uint16_t value);
+static void _store32(uint8_t *const p, const uint32_t value);
+static bool _is_vlan(const uint16_t proto);
+static bool _is_mpls(const uint16_t proto);
+static uint32_t _l2_len(const uint8_t *const pkt, const uint32_t len);
+static uint32_t _ip_hlen(const int family);
+static uint32_t _write_outer(uint8_t *const pkt, const struct xsk_tunnel *const tunnel, const uint8_t proto,
+                             const uint32_t l4_len);
+static uint32_t _parse_outer(const uint8_t *const pkt, struct xdp_desc *const desc, const uint8_t proto);
+
+bool xsk_push_vlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, const uint16_t tpid,
+                   const uint16_t tci)
+{
+    if (desc->len < ETH_HLEN)
+        return false;
+
+    uint8_t *const pkt = xsk_packet_push(umem, desc, VLAN_HLEN);
+    if (!pkt)
+        return false;
+
+    memmove(pkt, pkt + VLAN_HLEN, 2 * ETH_ALEN);
+    _store16(pkt + 2 * ETH_ALEN, tpid);
+    _store16(pkt + 2 * ETH_ALEN + 2, tci);
+    return true;
+}
+
+bool xsk_pop_vlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint16_t *const tci)
+{
+    uint8_t *const pkt = _data(umem, desc);
+
+    if (desc->len < ETH_HLEN + VLAN_HLEN || !_is_vlan(_load16(pkt + 2 * ETH_ALEN)))
+        return false;
+
+    if (tci)
+        *tci = _load16(pkt + 2 * ETH_ALEN + 2);
+
+    memmove(pkt + VLAN_HLEN, pkt, 2 * ETH_ALEN);
+    xsk_packet_pull(umem, desc, VLAN_HLEN);
+    return true;
+}
+
+bool xsk_push_mpls(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, const uint32_t label,
+                   const uint8_t tc, const uint8_t ttl)
+{
+    const uint32_t l2_len = _l2_len(_data(umem, desc), desc->len);
+    if (!l2_len)
+        return false;
+
+    const bool bottom = !_is_mpls(_load16(_data(umem, desc) + l2_len - 2));
+
+    uint8_t *const pkt = xsk_packet_push(umem, desc, MPLS_HLEN);
+    if (!pkt)
+        return false;
+
+    /* The old EtherType is overwritten by the label stack entry */
+    memmove(pkt, pkt + MPLS_HLEN, l2_len - 2);
+    _store16(pkt + l2_len - 2, ETH_P_MPLS_UC);
+    _store32(pkt + l2_len, ((label << MPLS_LS_LABEL_SHIFT) & MPLS_LS_LABEL_MASK) |
+                               (((uint32_t)tc << MPLS_LS_TC_SHIFT) & MPLS_LS_TC_MASK) |
+                               ((uint32_t)bottom << MPLS_LS_S_SHIFT) | ttl);
+    return true;
+}
+
+bool xsk_pop_mpls(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, const uint16_t next_proto,
+                  uint32_t *const label)
+{
+    uint8_t *const pkt = _data(umem, desc);
+
+    const uint32_t l2_len = _l2_len(pkt, desc->len);
+    if (!l2_len || desc->len < l2_len + MPLS_HLEN || !_is_mpls(_load16(pkt + l2_len - 2)))
+        return false;
+
+    const uint32_t entry = _load32(pkt + l2_len);
+    if (label)
+        *label = (entry & MPLS_LS_LABEL_MASK) >> MPLS_LS_LABEL_SHIFT;
+
+    memmove(pkt + MPLS_HLEN, pkt, l2_len - 2);
+    xsk_packet_pull(umem, desc, MPLS_HLEN);
+    _store16(pkt + MPLS_HLEN + l2_len - 2, entry & MPLS_LS_S_MASK ? next_proto : ETH_P_MPLS_UC);
+    return true;
+}
+
+bool xsk_push_gre(const struct xsk_umem_info *const umem, struct xdp_desc *const desc,
+                  const struct xsk_tunnel *const tunnel)
+{
+    const uint32_t l2_len = _l2_len(_data(umem, desc), desc->len);
+    if (!l2_len)
+        return false;
+
+    const uint16_t proto = _load16(_data(umem, desc) + l2_len - 2);
+    const uint32_t gre_len = GRE_HLEN + (tunnel->has_key ? sizeof(uint32_t) : 0);
+    const uint32_t outer_len = ETH_HLEN + _ip_hlen(tunnel->family) + gre_len;
+    const uint32_t payload_len = desc->len - l2_len;
+
+    /* The outer headers always outgrow the Ethernet header they replace */
+    uint8_t *const pkt = xsk_packet_push(umem, desc, outer_len - l2_len);
+    if (!pkt)
+        return false;
+
+    uint8_t *const gre = pkt + _write_outer(pkt, tunnel, IPPROTO_GRE, gre_len + payload_len);
+
+    _store16(gre, tunnel->has_key ? GRE_FLAG_KEY : 0);
+    _store16(gre + 2, proto);
+    if (tunnel->has_key)
+        _store32(gre + GRE_HLEN, tunnel->key);
+    return true;
+}
+
+bool xsk_pull_gre(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint32_t *const key)
+{
+    uint8_t *const pkt = _data(umem, desc);
+    struct xdp_desc inner = *desc;
+
+    const uint32_t gre_offset = _parse_outer(pkt, &inner, IPPROTO_GRE);
+    if (!gre_offset || inner.len < gre_offset + GRE_HLEN)
+        return false;
+
+    const uint16_t flags = _load16(pkt + gre_offset);
+    if (flags & (GRE_FLAG_ROUTING | GRE_VERSION))
+        return false;
+
+    /* The optional fields follow in this order */
+    uint32_t offset = gre_offset + GRE_HLEN;
+    if (flags & GRE_FLAG_CSUM)
+        offset += sizeof(uint32_t);
+    if (flags & GRE_FLAG_KEY)
+    {
+        if (inner.len >= offset + sizeof(uint32_t) && key)
+            *key = _load32(pkt + offset);
+        offset += sizeof(uint32_t);
+    }
+    if (flags & GRE_FLAG_SEQ)
+        offset += sizeof(uint32_t);
+
+    if (inner.len < offset)
+        return false;
+
+    const uint16_t proto = _load16(pkt + gre_offset + 2);
+
+    memmove(pkt + offset - ETH_HLEN, pkt, 2 * ETH_ALEN);
+    _store16(pkt + offset - 2, proto);
+    *desc = inner;
+    xsk_packet_pull(umem, desc, offset - ETH_HLEN);
+    return true;
+}
+
+bool xsk_push_vxlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc,
+                    const struct xsk_tunnel *const tunnel)
+{
+    const uint32_t udp_len = sizeof(struct udphdr) + VXLAN_HLEN + desc->len;
+    const uint32_t outer_len = ETH_HLEN + _ip_hlen(tunnel->family) + sizeof(struct udphdr) + VXLAN_HLEN;
+
+    if (desc->len < ETH_HLEN)
+        return false;
+
+    uint8_t *const pkt = xsk_packet_push(umem, desc, outer_len);
+    if (!pkt)
+        return false;
+
+    const uint32_t udp_offset = _write_outer(pkt, tunnel, IPPROTO_UDP, udp_len);
+    struct udphdr *const udp = (struct udphdr *)(pkt + udp_offset);
+    uint8_t *const vxlan = (uint8_t *)(udp + 1);
+
+    udp->source = htons(tunnel->sport);
+    udp->dest = htons(tunnel->dport);
+    udp->len = htons(udp_len);
+    udp->check = 0;
+    _store32(vxlan, VXLAN_FLAG_VNI);
+    _store32(vxlan + 4, tunnel->key << VXLAN_VNI_SHIFT);
+
+    /* A zero checksum is only allowed over IPv4, 0 on the wire means none */
+    if (tunnel->family == AF_INET6)
+    {
+        udp->check = ipv6_l4_csum((const struct ipv6hdr *)(pkt + ETH_HLEN), udp, udp_len, IPPROTO_UDP);
+        if (udp->check == 0)
+            udp->check = 0xffff;
+    }
+    return true;
+}
+
+bool xsk_pull_vxlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint32_t *const vni)
+{
+    uint8_t *const pkt = _data(umem, desc);
+    struct xdp_desc inner = *desc;
+
+    const uint32_t udp_offset = _parse_outer(pkt, &inner, IPPROTO_UDP);
+    const uint32_t offset = udp_offset + sizeof(struct udphdr) + VXLAN_HLEN;
+
+    if (!udp_offset || inner.len < offset + ETH_HLEN || !(_load32(pkt + offset - VXLAN_HLEN) & VXLAN_FLAG_VNI))
+        return false;
+
+    if (vni)
+        *vni = _load32(pkt + offset - 4) >> VXLAN_VNI_SHIFT;
+
+    *desc = inner;
+    xsk_packet_pull(umem, desc, offset);
+    return true;
+}
+
+uint32_t xsk_encap_hlen(const enum xsk_encap_type type, const struct xsk_tunnel *const tunnel)
+{
+    switch (type)
+    {
+    case XSK_ENCAP_VLAN:
+        return VLAN_HLEN;
+    case XSK_ENCAP_MPLS:
+        return MPLS_HLEN;
+    case XSK_ENCAP_GRE:
+        return _ip_hlen(tunnel->family) + GRE_HLEN + (tunnel->has_key ? sizeof(uint32_t) : 0);
+    case XSK_ENCAP_VXLAN:
+        return ETH_HLEN + _ip_hlen(tunnel->family) + sizeof(struct udphdr) + VXLAN_HLEN;
+    }
+
+    return 0;
+}
+
+static uint8_t *_data(const struct xsk_umem_info *const umem, const struct xdp_desc *const desc)
+{
+    return xsk_umem__get_data(umem->buffer, xsk_desc_addr(desc));
+}
+
+/* Headers in the frame may sit at any alignment */
+static uint16_t _load16(const uint8_t *const p)
+{
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return ntohs(value);
+}
+
+static uint32_t _load32(const uint8_t *const p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return ntohl(value);
+}
+
+static void _store16(uint8_t *const p, const uint16_t value)
+{
+    const uint16_t value_be = htons(value);
+    memcpy(p, &value_be, sizeof(value_be));
+}
+
+static void _store32(uint8_t *const p, const uint32_t value)
+{
+    const uint32_t value_be = htonl(value);
+    memcpy(p, &value_be, sizeof(value_be));
+}
+
+static bool _is_vlan(const uint16_t proto)
+{
+    return proto == ETH_P_8021Q || proto == ETH_P_8021AD;
+}
+
+static bool _is_mpls(const uint16_t proto)
+{
+    return proto == ETH_P_MPLS_UC || proto == ETH_P_MPLS_MC;
+}
+
+/* Length of the Ethernet header with its VLAN tags, which ends in the
+ * payload's EtherType, or 0 when the packet is cut short */
+static uint32_t _l2_len(const uint8_t *const pkt, const uint32_t len)
+{
+    uint32_t offset = 2 * ETH_ALEN;
+
+    for (int i = 0; i <= MAX_VLAN_TAGS; i++)
+    {
+        if (len < offset + 2)
+            return 0;
+        if (!_is_vlan(_load16(pkt + offset)))
+            return offset + 2;
+        offset += VLAN_HLEN;
+    }
+
+    return 0;
+}
+
+static uint32_t _ip_hlen(const int family)
+{
+    return family == AF_INET ? sizeof(struct iphdr) : sizeof(struct ipv6hdr);
+}
+
+/* Writes the tunnel's Ethernet and IP headers for l4_len bytes of proto
+ * and returns where the L4 header goes */
+static uint32_t _write_outer(uint8_t *const pkt, const struct xsk_tunnel *const tunnel, const uint8_t proto,
+                             const uint32_t l4_len)
+{
+    struct ethhdr *const eth = (struct ethhdr *)pkt;
+
+    memcpy(eth->h_dest, tunnel->h_dest, ETH_ALEN);
+    memcpy(eth->h_source, tunnel->h_source, ETH_ALEN);
+
+    if (tunnel->family == AF_INET)
+    {
+        struct iphdr *const iph = (struct iphdr *)(eth + 1);
+
+        eth->h_proto = htons(ETH_P_IP);
+        memset(iph, 0, sizeof(*iph));
+        iph->version = 4;
+        iph->ihl = sizeof(*iph) / 4;
+        iph->tot_len = htons(sizeof(*iph) + l4_len);
+        iph->frag_off = htons(IP_DF);
+        iph->ttl = tunnel->ttl;
+        iph->protocol = proto;
+        memcpy(&iph->saddr, &tunnel->saddr, sizeof(iph->saddr));
+        memcpy(&iph->daddr, &tunnel->daddr, sizeof(iph->daddr));
+        iph->check = ipv4_header_csum(iph);
+        return ETH_HLEN + sizeof(*iph);
+    }
+
+    struct ipv6hdr *const ip6h = (struct ipv6hdr *)(eth + 1);
+
+    eth->h_proto = htons(ETH_P_IPV6);
+    memset(ip6h, 0, sizeof(*ip6h));
+    ip6h->version = 6;
+    ip6h->payload_len = htons(l4_len);
+    ip6h->nexthdr = proto;
+    ip6h->hop_limit = tunnel->ttl;
+    ip6h->saddr = tunnel->saddr;
+    ip6h->daddr = tunnel->daddr;
+    return ETH_HLEN + sizeof(*ip6h);
+}
+
+/* Checks for an unfragmented IPv4 or IPv6 packet of proto behind a plain
+ * Ethernet header and returns its L4 offset, or 0. Trims desc->len to the
+ * IP length, dropping any Ethernet padding. */
+static uint32_t _parse_outer(const uint8_t *const pkt, struct xdp_desc *const desc, const uint8_t proto)
+{
+    if (desc->len < ETH_HLEN)
+        return 0;
+
+    const uint16_t eth_proto = _load16(pkt + 2 * ETH_ALEN);
+    uint32_t ip_len;
+    uint32_t hlen;
+
+    if (eth_proto == ETH_P_IP && desc->len >= ETH_HLEN + sizeof(struct iphdr))
+    {
+        const struct iphdr *const iph = (const struct iphdr *)(pkt + ETH_HLEN);
+
+        hlen = iph->ihl * 4;
+        ip_len = ntohs(iph->tot_len);
+        if (iph->version != 4 || hlen < sizeof(*iph) || iph->protocol != proto ||
+            ntohs(iph->frag_off) & (IP_MF | IP_FRAG_OFFSET_MASK))
+            return 0;
+    }
+    else if (eth_proto == ETH_P_IPV6 && desc->len >= ETH_HLEN + sizeof(struct ipv6hdr))
+    {
+        const struct ipv6hdr *const ip6h = (const struct ipv6hdr *)(pkt + ETH_HLEN);
+
+        hlen = sizeof(*ip6h);
+        ip_len = hlen + ntohs(ip6h->payload_len);
+        if (ip6h->version != 6 || ip6h->nexthdr != proto)
+            return 0;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (ip_len < hlen || ETH_HLEN + ip_len > desc->len)
+        return 0;
+
+    desc->len = ETH_HLEN + ip_len;
+    return ETH_HLEN + hlen;
+}
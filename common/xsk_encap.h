@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include "af_common.h"
+
+#define VXLAN_PORT 4789
+
+/* Most headroom an encapsulation below takes: outer Ethernet, IPv6, UDP
+ * and VXLAN. A UMEM whose frame_headroom plus XDP_PACKET_HEADROOM covers
+ * it can encapsulate any received packet. */
+#define XSK_ENCAP_MAX_HLEN 70
+
+/* The outer headers of a tunnel. Both addresses are of family, IPv4 ones
+ * in the first four bytes. sport and dport are VXLAN's UDP ports, key is
+ * the VXLAN VNI or, when has_key is set, the GRE key. */
+struct xsk_tunnel
+{
+    uint8_t h_dest[ETH_ALEN];
+    uint8_t h_source[ETH_ALEN];
+    int family;
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+    uint8_t ttl;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t key;
+    bool has_key;
+};
+
+/* Encapsulation and decapsulation of Ethernet frames in UMEM, done in
+ * place with xsk_packet_push() and xsk_packet_pull(): the packet never
+ * moves, only headers are written into its headroom and at most the MAC
+ * addresses and VLAN tags in front of an inserted header are shifted.
+ * Every function leaves the packet as it was and returns false when the
+ * headroom is too small or the packet isn't of the expected form. Header
+ * fields are in host byte order. */
+
+/* Inserts an 802.1Q (tpid ETH_P_8021Q) or 802.1ad tag after the MAC
+ * addresses, in front of any tags already there */
+bool xsk_push_vlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, const uint16_t tpid,
+                   const uint16_t tci);
+bool xsk_pop_vlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint16_t *const tci);
+
+/* Pushes a label stack entry between the Ethernet header, VLAN tags
+ * included, and its payload, the bottom of the stack if the payload isn't
+ * MPLS already */
+bool xsk_push_mpls(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, const uint32_t label,
+                   const uint8_t tc, const uint8_t ttl);
+/* Pops the top label. MPLS doesn't say what the bottom of the stack
+ * carries, next_proto (e.g. ETH_P_IP) becomes the EtherType then. */
+bool xsk_pop_mpls(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, const uint16_t next_proto,
+                  uint32_t *const label);
+
+/* Replaces the Ethernet header with the tunnel's Ethernet, IP and GRE
+ * headers, GRE carrying the EtherType of the L3 packet inside */
+bool xsk_push_gre(const struct xsk_umem_info *const umem, struct xdp_desc *const desc,
+                  const struct xsk_tunnel *const tunnel);
+/* The reverse, the outer MAC addresses are kept for the inner packet's */
+bool xsk_pull_gre(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint32_t *const key);
+
+/* Puts the tunnel's Ethernet, IP, UDP and VXLAN headers in front of the
+ * whole frame. The UDP checksum is left out over IPv4 and computed over
+ * IPv6, which reads the packet once. */
+bool xsk_push_vxlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc,
+                    const struct xsk_tunnel *const tunnel);
+bool xsk_pull_vxlan(const struct xsk_umem_info *const umem, struct xdp_desc *const desc, uint32_t *const vni);
+
+enum xsk_encap_type
+{
+    XSK_ENCAP_VLAN,
+    XSK_ENCAP_MPLS,
+    XSK_ENCAP_GRE,
+    XSK_ENCAP_VXLAN,
+};
+
+/* Bytes the push of type grows a packet by, the headroom it needs. GRE's
+ * is net of the Ethernet header it replaces, tunnel is only read for GRE
+ * and VXLAN. */
+uint32_t xsk_encap_hlen(const enum xsk_encap_type type, const struct xsk_tunnel *const tunnel);
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+
+#include "xsk_sched.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+static int _wait(struct xsk_sched *const sched, uint32_t *const ready, const int timeout_ms);
+static void _activate(struct xsk_sched *const sched, const uint32_t index);
+static bool _wait_due(struct xsk_sched *const sched);
+static void _service_rings(struct xsk_sched *const sched, struct xsk_sched_socket *const socket);
+static void _reap_completions(struct xsk_socket_info *const xsk);
+
+int xsk_sched_init(struct xsk_sched *const sched, const unsigned int max_sockets, const unsigned int budget,
+                   const xsk_sched_rx_fn rx, const bool use_uring)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->rx = rx;
+    sched->budget = budget;
+    sched->max_sockets = max_sockets;
+    sched->epoll_fd = -1;
+    sched->sockets = calloc(max_sockets, sizeof(*sched->sockets));
+    sched->active = calloc(max_sockets, sizeof(*sched->active));
+
+    if (!sched->sockets || !sched->active)
+    {
+        xsk_sched_destroy(sched);
+        return -ENOMEM;
+    }
+
+    if (use_uring)
+    {
+        sched->uring = malloc(sizeof(*sched->uring));
+        if (!sched->uring)
+        {
+            xsk_sched_destroy(sched);
+            return -ENOMEM;
+        }
+
+        const int err = xsk_uring_init(sched->uring, XSK_URING_ENTRIES);
+        if (!err)
+            return 0;
+
+        free(sched->uring);
+        sched->uring = NULL;
+
+        /* Without multishot poll epoll does the same job */
+        if (err != -EOPNOTSUPP)
+        {
+            xsk_sched_destroy(sched);
+            return err;
+        }
+    }
+
+    sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epoll_fd < 0)
+    {
+        const int err = -errno;
+        xsk_sched_destroy(sched);
+        return err;
+    }
+
+    return 0;
+}
+
+void xsk_sched_destroy(struct xsk_sched *const sched)
+{
+    if (sched->uring)
+    {
+        xsk_uring_destroy(sched->uring);
+        free(sched->uring);
+    }
+    if (sched->epoll_fd >= 0)
+        close(sched->epoll_fd);
+    free(sched->sockets);
+    free(sched->active);
+    memset(sched, 0, sizeof(*sched));
+    sched->epoll_fd = -1;
+}
+
+int xsk_sched_add(struct xsk_sched *const sched, struct xsk_socket_info *const xsk, void *const ctx,
+                  pthread_spinlock_t *const ring_lock)
+{
+    if (sched->num_sockets == sched->max_sockets)
+        return -ENOSPC;
+
+    const uint32_t index = sched->num_sockets;
+    struct xsk_sched_socket *const socket = &sched->sockets[index];
+
+    socket->xsk = xsk;
+    socket->ctx = ctx;
+    socket->ring_lock = ring_lock;
+    socket->fd = xsk_socket__fd(xsk->xsk);
+
+    if (sched->uring)
+    {
+        if (!xsk_uring_add_socket(sched->uring, socket->fd, index))
+            return -EBUSY;
+    }
+    else
+    {
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = index};
+
+        if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, socket->fd, &event))
+            return -errno;
+    }
+
+    sched->num_sockets++;
+
+    /* Anything received before it was added would never raise an event */
+    _activate(sched, index);
+    return 0;
+}
+
+int xsk_sched_run(struct xsk_sched *const sched, const int timeout_ms)
+{
+    uint32_t ready[XSK_SCHED_MAX_EVENTS];
+    int total = 0;
+
+    if (_wait_due(sched))
+    {
+        const int num_ready = _wait(sched, ready, sched->active_count ? 0 : timeout_ms);
+        if (num_ready < 0)
+            return num_ready;
+
+        for (int i = 0; i < num_ready; i++)
+            _activate(sched, ready[i]);
+    }
+
+    /* Sockets activated while serving this round wait for the next one */
+    for (uint32_t round = sched->active_count; round > 0; round--)
+    {
+        const uint32_t index = sched->active[sched->active_head];
+        struct xsk_sched_socket *const socket = &sched->sockets[index];
+
+        sched->active_head = (sched->active_head + 1) % sched->max_sockets;
+        sched->active_count--;
+        socket->active = false;
+
+        const unsigned int done = sched->rx(socket->ctx, sched->budget);
+        total += done;
+
+        _service_rings(sched, socket);
+
+        /* A full batch likely left more behind. Epoll would report it too,
+         * but requeueing here saves the system call. */
+        if (done == sched->budget || socket->starved || xsk_cons_nb_avail(&socket->xsk->rx, 1))
+            _activate(sched, index);
+    }
+
+    sched->idle = total == 0;
+    return total;
+}
+
+/* The io_uring's wait costs no system call unless kicks are queued, which
+ * have to go out every round anyway */
+static bool _wait_due(struct xsk_sched *const sched)
+{
+    if (sched->uring || !sched->active_count || sched->idle || ++sched->busy_rounds >= XSK_SCHED_POLL_ROUNDS)
+    {
+        sched->busy_rounds = 0;
+        return true;
+    }
+
+    return false;
+}
+
+static int _wait(struct xsk_sched *const sched, uint32_t *const ready, const int timeout_ms)
+{
+    if (sched->uring)
+        return xsk_uring_wait(sched->uring, ready, XSK_SCHED_MAX_EVENTS, timeout_ms);
+
+    struct epoll_event events[XSK_SCHED_MAX_EVENTS];
+
+    const int n = epoll_wait(sched->epoll_fd, events, XSK_SCHED_MAX_EVENTS, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -errno;
+
+    for (int i = 0; i < n; i++)
+        ready[i] = events[i].data.u32;
+
+    return n;
+}
+
+static void _activate(struct xsk_sched *const sched, const uint32_t index)
+{
+    if (index >= sched->num_sockets || sched->sockets[index].active)
+        return;
+
+    sched->sockets[index].active = true;
+    sched->active[(sched->active_head + sched->active_count) % sched->max_sockets] = index;
+    sched->active_count++;
+}
+
+/* Kicks go through the io_uring when there is one, to be submitted with
+ * the next wait, otherwise they are made right away */
+static void _service_rings(struct xsk_sched *const sched, struct xsk_sched_socket *const socket)
+{
+    struct xsk_socket_info *const xsk = socket->xsk;
+
+    if (socket->ring_lock)
+        pthread_spin_lock(socket->ring_lock);
+
+    _reap_completions(xsk);
+
+    /* Starved only when the frames ran out before the free slots did */
+    const unsigned int free_slots = xsk_prod_nb_free(&xsk->umem->fq, xsk->umem->fq.size);
+    socket->starved = xsk_fill_fq(xsk) < free_slots;
+
+    const bool kick_rx = xsk_ring_prod__needs_wakeup(&xsk->umem->fq);
+
+    if (socket->ring_lock)
+        pthread_spin_unlock(socket->ring_lock);
+
+    const bool kick_tx = xsk->outstanding_tx && xsk_ring_prod__needs_wakeup(&xsk->tx);
+
+    if (sched->uring)
+    {
+        if (kick_rx)
+            xsk_uring_kick_rx(sched->uring, socket->fd);
+        if (kick_tx)
+            xsk_uring_kick_tx(sched->uring, socket->fd);
+        return;
+    }
+
+    if (kick_rx)
+        recvfrom(socket->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    if (kick_tx)
+        sendto(socket->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static void _reap_completions(struct xsk_socket_info *const xsk)
+{
+    uint32_t idx_cq;
+
+    if (!xsk->outstanding_tx)
+        return;
+
+    const unsigned int completed = xsk_ring_cons__peek(&xsk->umem->cq, xsk->umem->cq.size, &idx_cq);
+    if (!completed)
+        return;
+
+    for (unsigned int i = 0; i < completed; i++)
+        xsk_free_umem_frame(xsk, *xsk_ring_cons__comp_addr(&xsk->umem->cq, idx_cq + i));
+
+    xsk_ring_cons__release(&xsk->umem->cq, completed);
+    xsk->outstanding_tx -= completed < xsk->outstanding_tx ? completed : xsk->outstanding_tx;
+}
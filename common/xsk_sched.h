@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "af_common.h"
+#include "xsk_uring.h"
+
+/* Readiness events taken per wait */
+#define XSK_SCHED_MAX_EVENTS 64
+/* Busy rounds between epoll checks for newly ready sockets */
+#define XSK_SCHED_POLL_ROUNDS 16
+
+/* Consumes up to budget descriptors from the socket's RX ring and returns
+ * how many it took. Refilling, kicks and completions are the scheduler's. */
+typedef unsigned int (*xsk_sched_rx_fn)(void *ctx, const unsigned int budget);
+
+struct xsk_sched_socket
+{
+    struct xsk_socket_info *xsk;
+    void *ctx;
+    /* Held around fill and completion ring access when the socket shares
+     * them with sockets of other threads, NULL otherwise */
+    pthread_spinlock_t *ring_lock;
+    int fd;
+    bool active;
+    /* The last refill ran out of free frames before fill ring slots */
+    bool starved;
+};
+
+/* Serves many AF_XDP sockets, on any queues and interfaces, from one
+ * thread. Sockets with packets waiting are kept on a round-robin queue and
+ * each gets at most budget packets per round, so a busy socket delays the
+ * others by one batch at most and never starves them. A socket whose ring
+ * runs dry leaves the queue until epoll, or the io_uring when one is used,
+ * reports it readable again, unless its fill ring couldn't be refilled:
+ * it stays on to be refilled as frames come back, as no packet can arrive
+ * to wake it. The thread only sleeps with every socket idle. Epoll is
+ * checked for newly ready sockets after a round that handled nothing and
+ * every XSK_SCHED_POLL_ROUNDS rounds, the io_uring's completions, read
+ * without a system call, every round. */
+struct xsk_sched
+{
+    xsk_sched_rx_fn rx;
+    unsigned int budget;
+    int epoll_fd;
+    struct xsk_uring *uring;
+    unsigned int num_sockets;
+    unsigned int max_sockets;
+    struct xsk_sched_socket *sockets;
+    /* Indices of the active sockets in service order */
+    uint32_t *active;
+    uint32_t active_head;
+    uint32_t active_count;
+    /* Rounds since epoll was last checked, and whether the last one
+     * handled no packets */
+    uint32_t busy_rounds;
+    bool idle;
+};
+
+/* Returns 0 or a negative errno. use_uring falls back to epoll on kernels
+ * whose io_uring lacks multishot poll. */
+int xsk_sched_init(struct xsk_sched *const sched, const unsigned int max_sockets, const unsigned int budget,
+                   const xsk_sched_rx_fn rx, const bool use_uring);
+void xsk_sched_destroy(struct xsk_sched *const sched);
+int xsk_sched_add(struct xsk_sched *const sched, struct xsk_socket_info *const xsk, void *const ctx,
+                  pthread_spinlock_t *const ring_lock);
+/* One round: picks up newly readable sockets when due, sleeping up to
+ * timeout_ms if none has packets, then serves every active socket one
+ * batch, reaps its completion ring, refills its fill ring and kicks the
+ * kernel where it asked for it. Returns the packets handled or a negative errno. */
+int xsk_sched_run(struct xsk_sched *const sched, const int timeout_ms);
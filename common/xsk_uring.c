@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+
+#include "xsk_uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define NS_PER_MS 1000000ULL
+#define PROBE_TIMEOUT_MS 1000
+
+/* user_data layout: the token in the low half, the fd above it for
+ * re-arming a poll, and kicks, whose completions are only reaped, flagged
+ * in the top bit */
+#define USER_DATA_KICK (1ULL << 63)
+#define USER_DATA(fd, token) (((uint64_t)(uint32_t)(fd) << 32) | (token))
+#define USER_DATA_FD(data) ((int)(((data) & ~USER_DATA_KICK) >> 32))
+#define USER_DATA_TOKEN(data) ((uint32_t)(data))
+
+static struct io_uring_sqe *_get_sqe(struct xsk_uring *const ring);
+static void _prep_poll(struct io_uring_sqe *const sqe, const int fd);
+static bool _queue_poll(struct xsk_uring *const ring, const int fd, const uint32_t token);
+static bool _probe_multishot_poll(struct xsk_uring *const ring);
+static bool _queue_kick(struct xsk_uring *const ring, const uint8_t opcode, const int fd);
+static int _enter(struct xsk_uring *const ring, const unsigned int min_complete, const int timeout_ms);
+
+int xsk_uring_init(struct xsk_uring *const ring, const unsigned int entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -errno;
+
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        close(ring->fd);
+        return -EOPNOTSUPP;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Both rings share one mapping on every kernel with EXT_ARG */
+    if (params.features & IORING_FEAT_SINGLE_MMAP && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto error_exit;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto error_exit;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error_exit;
+
+    uint8_t *const sq = ring->sq_ring;
+    uint8_t *const cq = ring->cq_ring;
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (!_probe_multishot_poll(ring))
+    {
+        xsk_uring_destroy(ring);
+        return -EOPNOTSUPP;
+    }
+
+    return 0;
+
+error_exit:;
+    const int err = -errno;
+    xsk_uring_destroy(ring);
+    return err;
+}
+
+void xsk_uring_destroy(struct xsk_uring *const ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+bool xsk_uring_add_socket(struct xsk_uring *const ring, const int fd, const uint32_t token)
+{
+    return _queue_poll(ring, fd, token);
+}
+
+bool xsk_uring_kick_tx(struct xsk_uring *const ring, const int fd)
+{
+    return _queue_kick(ring, IORING_OP_SEND, fd);
+}
+
+bool xsk_uring_kick_rx(struct xsk_uring *const ring, const int fd)
+{
+    return _queue_kick(ring, IORING_OP_RECV, fd);
+}
+
+int xsk_uring_wait(struct xsk_uring *const ring, uint32_t *const tokens, const unsigned int max,
+                   const int timeout_ms)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int n = 0;
+
+    /* Only enter the kernel to submit, or to sleep when nothing completed */
+    if (ring->to_submit || (timeout_ms && head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)))
+    {
+        const int ret = _enter(ring, timeout_ms ? 1 : 0, timeout_ms);
+        if (ret < 0 && ret != -ETIME && ret != -EINTR)
+            return ret;
+    }
+
+    const unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail && n < max; head++)
+    {
+        const struct io_uring_cqe *const cqe = &ring->cqes[head & ring->cq_mask];
+
+        if (cqe->user_data & USER_DATA_KICK)
+            continue;
+
+        /* A failed poll is over, and arming it again would only fail the
+         * same way */
+        if (cqe->res < 0)
+        {
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return cqe->res;
+        }
+
+        /* The kernel ends a multishot poll when it can't post any more
+         * completions, e.g. on CQ overflow; arm it again. Without room in
+         * the SQ the completion stays put for the next call to retry. */
+        if (!(cqe->flags & IORING_CQE_F_MORE) &&
+            !_queue_poll(ring, USER_DATA_FD(cqe->user_data), USER_DATA_TOKEN(cqe->user_data)))
+            break;
+
+        if (cqe->res > 0)
+            tokens[n++] = USER_DATA_TOKEN(cqe->user_data);
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* Submits what is queued first when the SQ is full */
+static struct io_uring_sqe *_get_sqe(struct xsk_uring *const ring)
+{
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries &&
+        _enter(ring, 0, 0) < 0)
+        return NULL;
+
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+        return NULL;
+
+    const unsigned int index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *const sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+static void _prep_poll(struct io_uring_sqe *const sqe, const int fd)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    /* The kernel swaps the halfwords back */
+    sqe->poll32_events = (uint32_t)POLLIN << 16 | (uint32_t)POLLIN >> 16;
+#else
+    sqe->poll32_events = POLLIN;
+#endif
+}
+
+static bool _queue_poll(struct xsk_uring *const ring, const int fd, const uint32_t token)
+{
+    struct io_uring_sqe *const sqe = _get_sqe(ring);
+    if (!sqe)
+        return false;
+
+    _prep_poll(sqe, fd);
+    sqe->user_data = USER_DATA(fd, token);
+    return true;
+}
+
+/* Kernels before 5.13 have io_uring but fail a multishot poll with
+ * -EINVAL. Arms one on a readable pipe: with support it completes with
+ * more to come and is removed again. The probe's completions are flagged
+ * like kicks, so xsk_uring_wait() skips any that come late. */
+static bool _probe_multishot_poll(struct xsk_uring *const ring)
+{
+    struct io_uring_sqe *sqe;
+    bool supported = false;
+    int fds[2];
+
+    if (pipe(fds))
+        return false;
+
+    const uint64_t user_data = USER_DATA_KICK | USER_DATA(fds[0], 0);
+
+    if (write(fds[1], "", 1) != 1 || !(sqe = _get_sqe(ring)))
+        goto out;
+
+    _prep_poll(sqe, fds[0]);
+    sqe->user_data = user_data;
+    if (_enter(ring, 1, PROBE_TIMEOUT_MS) < 0)
+        goto out;
+
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        goto out;
+
+    const struct io_uring_cqe *const cqe = &ring->cqes[head & ring->cq_mask];
+    supported = cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE);
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (supported && (sqe = _get_sqe(ring)))
+    {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = user_data;
+        sqe->user_data = user_data;
+        _enter(ring, 1, PROBE_TIMEOUT_MS);
+    }
+
+out:
+    close(fds[0]);
+    close(fds[1]);
+    return supported;
+}
+
+static bool _queue_kick(struct xsk_uring *const ring, const uint8_t opcode, const int fd)
+{
+    struct io_uring_sqe *const sqe = _get_sqe(ring);
+    if (!sqe)
+        return false;
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = USER_DATA_KICK | USER_DATA(fd, 0);
+    return true;
+}
+
+static int _enter(struct xsk_uring *const ring, const unsigned int min_complete, const int timeout_ms)
+{
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * NS_PER_MS,
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeout_ms > 0 ? (uint64_t)(uintptr_t)&ts : 0,
+    };
+    unsigned int flags = IORING_ENTER_EXT_ARG;
+
+    if (min_complete)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    const int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, &arg, sizeof(arg));
+    if (ret < 0)
+        return -errno;
+
+    ring->to_submit -= (unsigned int)ret < ring->to_submit ? (unsigned int)ret : ring->to_submit;
+    return ret;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define XSK_URING_ENTRIES 256
+
+/* An io_uring driving AF_XDP sockets in place of poll(), sendto() and
+ * recvfrom(): every socket has a multishot poll armed once, and the
+ * wakeup kicks for the kernel's TX and RX processing are queued as
+ * zero-length sends and receives. Queued kicks go to the kernel with the
+ * next xsk_uring_wait(), so one io_uring_enter() submits all of a loop
+ * iteration's kicks and sleeps for the next ready socket. Needs Linux 5.13
+ * for multishot poll. Used by a single thread, it is not thread safe. */
+struct xsk_uring
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sq_mask;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    /* Queued but not yet submitted entries, published at submission */
+    unsigned int sqe_tail;
+    unsigned int to_submit;
+
+    unsigned int cq_mask;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/* Returns 0 or a negative errno, -EOPNOTSUPP if the kernel's io_uring
+ * lacks a feature it needs, which init probes for */
+int xsk_uring_init(struct xsk_uring *const ring, const unsigned int entries);
+void xsk_uring_destroy(struct xsk_uring *const ring);
+/* Arms a multishot poll for POLLIN on the socket's fd. Whenever the socket
+ * becomes readable xsk_uring_wait() reports its token. Returns false when
+ * the SQ has no room. */
+bool xsk_uring_add_socket(struct xsk_uring *const ring, const int fd, const uint32_t token);
+/* Queue the equivalents of sendto()/recvfrom() with MSG_DONTWAIT and no
+ * data, the kicks that make the kernel drain the TX ring or refill RX */
+bool xsk_uring_kick_tx(struct xsk_uring *const ring, const int fd);
+bool xsk_uring_kick_rx(struct xsk_uring *const ring, const int fd);
+/* Submits the queued kicks and collects the tokens of sockets that became
+ * readable, up to max. With timeout_ms 0 it doesn't wait and makes no
+ * system call when nothing is queued, otherwise it waits up to timeout_ms
+ * (-1 for ever) for a completion. Returns the number of tokens or a
+ * negative errno, also when a socket's poll failed, which ends it. A token
+ * may be reported more than once. */
+int xsk_uring_wait(struct xsk_uring *const ring, uint32_t *const tokens, const unsigned int max,
+                   const int timeout_ms);